@@ -1,10 +1,25 @@
+#include <sys/socket.h>
+
 #include "TraCIConstants.h"
 #include "Client.h"
 
-Client::Client(int port) :
-	mySocket(port),
+Client::Client(const tcpip::Endpoint &endpoint) :
+	mySocket(endpoint),
+	mySharedMemory(endpoint.sharedMemory),
+	myChannel(),
 	myPendingAnswers(),
-	myPendingCommands(),
+	myPendingShared(NULL),
+	mySharedAnswers(),
+	mySharedPosition(0),
+	myOutput(),
+	myHeldBack(false),
+	myMetrics(),
+	myTracer(NULL),
+	myTrack(0),
+	myLastSent(0),
+	myPendingCommands(NULL),
+	myPendingLength(0),
+	myPendingPosition(0),
 
 	myDisconnecting(false),
 	myConnected(false),
@@ -16,7 +31,7 @@ Client::Client(int port) :
 
 Client::~Client()
 {
-	// No destruction required
+	clearPendingAnswers();
 }
 
 
@@ -25,6 +40,32 @@ bool Client::acceptConnection() throw( tcpip::SocketException )
 	// Connect if not already connected
 	if (!myConnected) {
 		mySocket.accept();
+		if (!mySocket.has_client_connection()) {
+			return false;
+		}
+
+		if (mySharedMemory) {
+			try {
+				myChannel.create(mySocket.fd());
+			}
+			catch (tcpip::SocketException) {
+				mySocket.close();
+				throw;
+			}
+		}
+
+		// Nothing is left from an earlier client on the same endpoint
+		clearPendingAnswers();
+		myHeldBack = false;
+		myPendingCommands = NULL;
+		myPendingLength = 0;
+		myPendingPosition = 0;
+		myDisconnecting = false;
+		myWaiting = false;
+		myTargetTime = -1;
+		myMetrics.reconnected();
+		myLastSent = 0;
+
 		return (myConnected = true);
 	}
 
@@ -35,9 +76,25 @@ bool Client::acceptConnection() throw( tcpip::SocketException )
 }
 
 
-int Client::port()
+std::string Client::address() const
 {
-	return mySocket.port();
+	return mySocket.address();
+}
+
+
+int Client::fd() const
+{
+	return mySocket.fd();
+}
+
+int Client::listenerFd() const
+{
+	return mySocket.server_fd();
+}
+
+void Client::setBlocking(bool blocking) throw( tcpip::SocketException )
+{
+	mySocket.set_blocking(blocking);
 }
 
 
@@ -53,21 +110,37 @@ bool Client::isConnected() const
 	return mySocket.has_client_connection();
 }
 
+bool Client::isDraining() const
+{
+	return !myConnected && !myOutput.empty();
+}
+
+
+int Client::targetTime() const throw()
+{
+	return myWaiting? myTargetTime : -1;
+}
+
 
 void Client::handleStepResult(int currentTime, bool success, 
-							  tcpip::Storage &resultMsg)
+							  const tcpip::Storage &resultMsg, SharedBuffer *shared)
 {
 	// Don't act on premature success
-	if (success && currentTime < myTargetTime) {
+	if (!usesStepResult(currentTime, success)) {
 		return;
 	}
 
 	// Change state and send the response
 	myWaiting = false;
-	putAnswers(resultMsg);
+	putAnswers(resultMsg, shared);
+}
+
+bool Client::usesStepResult(int currentTime, bool success) const throw()
+{
+	return !success || currentTime >= myTargetTime;
 }
 
-bool Client::getCommands(tcpip::Storage &message, int currentTime)
+bool Client::getCommands(std::vector<tcpip::CommandSpan> &commands, int currentTime)
 {
 	/* Don't act if disconnected, waiting for steps or
 	   the client asked for disconnection */
@@ -77,22 +150,24 @@ bool Client::getCommands(tcpip::Storage &message, int currentTime)
 
 	// Obtain a new message, if there are no commands pending
 	if (!hasPendingCommands()) {
-		myPendingCommands.reset();
+		myPendingLength = 0;
+		myPendingPosition = 0;
 
 		try {
-			mySocket.receiveExact(myPendingCommands);
+			receiveCommands(false);
 		}
 		catch (tcpip::SocketException) {
+			closeSocket();
 			return (myConnected = false);
 		}
 	}
 
 	// Filter the commands
-	unsigned char cmd;
+	unsigned char cmd = 0;
 	int processedCmds = 0;
 
-	while(myPendingCommands.valid_pos()) {
-		cmd = handleCommand(myPendingCommands, message);
+	while(hasPendingCommands()) {
+		cmd = handleCommand(commands);
 		processedCmds++;
 
 		if (cmd == CMD_SIMSTEP2 || cmd == CMD_CLOSE) {
@@ -109,73 +184,200 @@ bool Client::getCommands(tcpip::Storage &message, int currentTime)
 }
 
 
-bool Client::putAnswers(tcpip::Storage &answers)
+bool Client::hasInput()
 {
-	// Don't act if disconnected
+	if (hasPendingCommands()) {
+		return true;
+	}
+
+	// Don't listen if disconnected
 	if (!myConnected) {
 		return false;
 	}
 
-	// Record the answers
-	myPendingAnswers.writeStorage(answers);
+	// The answers go first, and no more requests are taken while too many are queued
+	if (!flush()) {
+		return false;
+	}
+	if (isBackedUp()) {
+		if (!myHeldBack) {
+			myHeldBack = true;
+			myMetrics.heldBack++;
+		}
+		return false;
+	}
+	myHeldBack = false;
+
+	// Try to complete a new message
+	try {
+		if (receiveCommands(true)) {
+			return true;
+		}
+	}
+	catch (tcpip::SocketException) {
+		closeSocket();
+		myConnected = false;
+	}
+
+	return false;
+}
+
+
+bool Client::hasOutput() const
+{
+	return !myOutput.empty();
+}
+
+bool Client::isBackedUp() const
+{
+	return myOutput.isFull();
+}
+
+bool Client::flushesOnInput() const
+{
+	return myChannel.isOpen();
+}
+
+bool Client::flush()
+{
+	try {
+		// Through shared memory, wakeups for room and for messages come alike
+		if (myChannel.isOpen()) {
+			myChannel.takeWakeups();
+		}
+		if (myOutput.empty()) {
+			return true;
+		}
+
+		bool flushed = myChannel.isOpen()? myOutput.flush(myChannel) : myOutput.flush(mySocket);
+		if (!flushed) {
+			return true;
+		}
+	}
+	catch (tcpip::SocketException) {
+		closeSocket();
+		return (myConnected = false);
+	}
+
+	// If disconnecting, the connection is closed once its last answers are sent
+	if (!myConnected) {
+		closeSocket();
+	}
+	return true;
+}
+
+void Client::setQueueLimit(std::size_t limit)
+{
+	myOutput.setLimit(limit);
+}
+
+
+bool Client::putAnswers(const tcpip::Storage &answers, SharedBuffer *shared)
+{
+	// Don't act if disconnected
+	if (!myConnected) {
+		return false;
+	}
 
 	/* Send answers if we're not waiting for timesteps and either all commands
 	   have been handled or the client asked for disconnection */
 	if (!myWaiting && (!hasPendingCommands() || myDisconnecting)) {
-		bool result = sendAnswers();
+		bool result = sendAnswers(&answers, shared);
 		return result;
 	}
 
+	// Record the answers (a reference to them, if possible)
+	if (shared != NULL && myPendingShared == NULL) {
+		shared->acquire();
+		myPendingShared = shared;
+		mySharedAnswers.data = answers.data() + answers.position();
+		mySharedAnswers.length = answers.size() - answers.position();
+		mySharedPosition = myPendingAnswers.size();
+	} else {
+		myPendingAnswers.writeStorage(answers);
+	}
+
 	return true;
 }
 
 
+const unsigned char *Client::commandBytes() const
+{
+	return myPendingCommands;
+}
+
+
 bool Client::hasPendingCommands() throw()
 {
-	return myPendingCommands.valid_pos();
+	return myPendingPosition < myPendingLength;
 }
 
 bool Client::hasPendingAnswers() const throw()
 {
-	return myPendingAnswers.size() > 0;
+	return myPendingAnswers.size() > 0 || myPendingShared != NULL;
 }
 
 
-unsigned char Client::handleCommand(tcpip::Storage &inStorage,
-									tcpip::Storage &outStorage)
+bool Client::receiveCommands(bool onlyAvailable) throw (tcpip::SocketException)
 {
-	// Obtain and verify the command size
-	int size;
-	try {
-		size = tcpip::readCommandSize(inStorage);
+	const unsigned char *data;
+	std::size_t length;
+
+	if (myChannel.isOpen()) {
+		if (onlyAvailable) {
+			if (!myChannel.tryReceiveView(data, length)) {
+				return false;
+			}
+		} else {
+			myChannel.receiveView(data, length);
+		}
+	} else if (onlyAvailable) {
+		if (!mySocket.tryReceiveView(data, length)) {
+			return false;
+		}
+	} else {
+		mySocket.receiveView(data, length);
 	}
-	catch (std::invalid_argument) {
-		throw ProtocolException("Message too short: cannot read the size"
-								" of a command", port(), true);
+
+	myPendingCommands = data;
+	myPendingLength = static_cast<unsigned int>(length);
+	myPendingPosition = 0;
+
+	myMetrics.received(4 + length);
+	if (myTracer != NULL && myLastSent > 0) {
+		myTracer->span("think", myTrack, myLastSent, Metrics::now());
+		myLastSent = 0;
 	}
+	return true;
+}
+
 
-	// Obtain the command code
-	unsigned char commandCode;
+unsigned char Client::handleCommand(std::vector<tcpip::CommandSpan> &commands)
+{
+	// Locate the command
+	const unsigned char *bytes = commandBytes();
+	tcpip::CommandSpan span;
 	try {
-		commandCode = inStorage.readChar();
+		span = tcpip::readCommandSpan(bytes, myPendingPosition, myPendingLength);
 	}
 	catch (std::invalid_argument) {
-		throw ProtocolException("Message too short: cannot read the code"
-								" of a command", port(), true);
+		throw ProtocolException("Message too short: couldn't read all bytes"
+								" from the command", address(), true);
 	}
 
+	myPendingPosition += span.length;
+
 
-	switch (commandCode) {
+	switch (span.code) {
 	case CMD_SIMSTEP2:
 		// On simulation step: adjust target time and set waiting
 		int nextT;
-		try {
-			nextT = inStorage.readInt();
-		}
-		catch (std::invalid_argument) {
+		if (span.length < tcpip::commandSizeLength(bytes + span.offset) + 1 + 4) {
 			throw ProtocolException("Message too short: cannot read the target"
-									" time of a SIMSTEP2 command", port(), true);
+									" time of a SIMSTEP2 command", address(), true);
 		}
+		nextT = tcpip::readRawInt(bytes + span.offset
+								  + tcpip::commandSizeLength(bytes + span.offset) + 1);
 
 		myTargetTime = (nextT == 0)? -1 : nextT;
 		myWaiting = true;
@@ -188,54 +390,101 @@ unsigned char Client::handleCommand(tcpip::Storage &inStorage,
 		break;
 
 	default:
-		// Any other command: write on outStorage
-		tcpip::writeCommandSize(outStorage, size);
-		outStorage.writeChar(commandCode);
-
-		try {
-			for (int i=0; i < size-1; i++) {
-				outStorage.writeChar(inStorage.readChar());
-			}
-		}
-		catch (std::invalid_argument) {
-			throw ProtocolException("Message too short: couldn't read all bytes"
-									" from the command", port(), true);
-		}
+		// Any other command: forward its bytes
+		commands.push_back(span);
 	}
 
-	return commandCode;
+	return span.code;
 }
 
-bool Client::sendAnswers()
+bool Client::sendAnswers(const tcpip::Storage *last, SharedBuffer *shared)
 {
 	// Don't act if disconnected
 	if (!myConnected) {
 		return false;
 	}
 
+	// The message is gathered from the pending answers and the last ones
+	tcpip::Segment segments[5];
+	SharedBuffer *owners[5];
+	int count = 0;
+
+	std::size_t split = (myPendingShared != NULL)? mySharedPosition : myPendingAnswers.size();
+	owners[count] = NULL;
+	segments[count].data = myPendingAnswers.data();
+	segments[count++].length = split;
+
+	if (myPendingShared != NULL) {
+		owners[count] = myPendingShared;
+		segments[count++] = mySharedAnswers;
+
+		owners[count] = NULL;
+		segments[count].data = myPendingAnswers.data() + split;
+		segments[count++].length = myPendingAnswers.size() - split;
+	}
+
+	if (last != NULL) {
+		owners[count] = shared;
+		segments[count].data = last->data() + last->position();
+		segments[count++].length = last->size() - last->position();
+	}
+
 	// If disconnecting, write a close answer
+	tcpip::Storage closeAnswer;
 	if (myDisconnecting) {
-		writeStatusCmd(CMD_CLOSE, RTYPE_OK, "Goodbye", myPendingAnswers);
+		writeStatusCmd(CMD_CLOSE, RTYPE_OK, "Goodbye", closeAnswer);
+		owners[count] = NULL;
+		segments[count].data = closeAnswer.data();
+		segments[count++].length = closeAnswer.size();
 	}
 
 	// Send the answers
+	unsigned long long sending = (myTracer != NULL)? Metrics::now() : 0;
 	try {
-		mySocket.sendExact(myPendingAnswers);
+		if (myChannel.isOpen()) {
+			myOutput.send(myChannel, segments, count, owners);
+		} else {
+			myOutput.send(mySocket, segments, count, owners);
+		}
 	}
 	catch (tcpip::SocketException) {
 		// Alert when disconnected
+		closeSocket();
 		return (myConnected = false);
 	}
 
-	// If disconnecting, close the connection
+	std::size_t bytes = 4;
+	for (int i=0; i < count; i++) {
+		bytes += segments[i].length;
+	}
+	myMetrics.sent(bytes);
+	if (myTracer != NULL) {
+		myLastSent = Metrics::now();
+		myTracer->span("send", myTrack, sending, myLastSent);
+	}
+
+	// If disconnecting, close the connection (once the answers queued are sent)
 	if (myDisconnecting) {
-		closeConnection();
+		if (myOutput.empty()) {
+			closeConnection();
+		} else {
+			myConnected = false;
+		}
 	}
 
-	myPendingAnswers.reset();
+	clearPendingAnswers();
 	return true;
 }
 
+void Client::clearPendingAnswers()
+{
+	myPendingAnswers.reset();
+	if (myPendingShared != NULL) {
+		myPendingShared->release();
+		myPendingShared = NULL;
+	}
+}
+
 void Client::writeStatusCmd(int cmdCode, int status,
 							const std::string &description,
 							tcpip::Storage &outStorage)
@@ -249,8 +498,46 @@ void Client::writeStatusCmd(int cmdCode, int status,
 
 void Client::closeConnection()
 {
-	if (myConnected) {
-		mySocket.close();
+	if (myConnected || isDraining()) {
+		closeSocket();
 		myConnected = false;
 	}
 }
+
+void Client::interrupt()
+{
+	int fd = mySocket.fd();
+	if (fd >= 0) {
+		shutdown(fd, SHUT_RDWR);
+	}
+}
+
+const ClientMetrics &Client::metrics() const
+{
+	return myMetrics;
+}
+
+void Client::missedDeadline()
+{
+	myMetrics.deadlineMisses++;
+}
+
+void Client::setTracer(Tracer *tracer, int track)
+{
+	myTracer = tracer;
+	myTrack = track;
+}
+
+void Client::trace(const char *name, unsigned long long start, unsigned long long end)
+{
+	if (myTracer != NULL) {
+		myTracer->span(name, myTrack, start, end);
+	}
+}
+
+void Client::closeSocket()
+{
+	myChannel.close();
+	mySocket.close();
+	myOutput.clear();
+}
@@ -3,6 +3,11 @@
 
 #include "tcpip/storage.h"
 #include "tcpip/socket.h"
+#include "Metrics.h"
+#include "OutboundQueue.h"
+#include "SharedBuffer.h"
+#include "SharedChannel.h"
+#include "Tracer.h"
 #include "util.h"
 
 /** \brief Handles the connection to a Client and message exchange.
@@ -21,7 +26,8 @@
  *
  * Other operations that may be done with a Client are waiting
  * for a connection and exchanging messages: acceptConnection(),
- * getCommands(tcpip::Storage&, int), putAnswers(tcpip::Storage&).
+ * getCommands(std::vector<tcpip::CommandSpan>&, int),
+ * putAnswers(const tcpip::Storage&, SharedBuffer*).
  *
  * Message handling filters the step and close commands, which are
  * handled internally by changing the Client's state.  Also, since
@@ -30,23 +36,53 @@
  *
  * Every time a step was taken on the simulator, its result code
  * and description should be passed to handleStepResult(int, bool,
- * tcpip::Storage&)
+ * const tcpip::Storage&, SharedBuffer*)
+ *
+ * Sending never blocks, not even through shared memory: what the
+ * connection doesn't take is queued, and sent by flush() once it is
+ * writable. While more than the limit is queued, the client is held
+ * back: hasInput() doesn't read its messages until it takes its answers.
  */
 class Client {
 
  public:
-	/// Prepares to listen for a Client on the given port
-	Client(int port);
+	/** \brief Prepares to listen for a Client on the given endpoint (TCP port or Unix socket)
+	 *
+	 * With shared memory (only over a Unix socket), messages go through a
+	 * SharedChannel set up once the client connects.
+	 */
+	Client(const tcpip::Endpoint &endpoint);
 
 	virtual ~Client();
 
 	/** \brief Waits for incoming connection
 	 *
-	 * \return true if received connection, false if already connected.
+	 * The endpoint keeps listening once the client disconnects, and a
+	 * connection accepted later starts over as a new client.
+	 *
+	 * In non-blocking mode (see setBlocking(bool)), only a pending
+	 * connection is accepted: listenerFd() is readable when there's one.
+	 *
+	 * \return true if received connection, false if already connected
+	 *     or if none is pending in non-blocking mode.
 	 */
 	bool acceptConnection() throw( tcpip::SocketException );
 
-	int port();
+	/// The descriptor listening for the client (-1 before acceptConnection())
+	int listenerFd() const;
+
+	/// Describes where the client connects (see tcpip::Socket::address())
+	std::string address() const;
+
+	/// The descriptor of the client connection (-1 if not connected)
+	int fd() const;
+
+	/** \brief Switches the connection between blocking and non-blocking I/O
+	 *
+	 * In non-blocking mode, use hasInput() to check for commands before
+	 * calling getCommands(std::vector<tcpip::CommandSpan>&, int).
+	 */
+	void setBlocking(bool blocking) throw( tcpip::SocketException );
 
 	/// Determines if the client should act on the current time
 	bool canAct(int currentTime) const throw();
@@ -54,6 +90,19 @@ class Client {
 	/// Determines if the client is connected
 	bool isConnected() const;
 
+	/** \brief Determines if the client disconnected, but its last answers are still queued.
+	 *
+	 * The connection is closed once flush() sends them.
+	 */
+	bool isDraining() const;
+
+	/** \brief The time the client is waiting for.
+	 *
+	 * \return The target time of the last step request, or -1 if the
+	 *     client isn't waiting or asked for a single step.
+	 */
+	int targetTime() const throw();
+
 
 	/** \brief Handles a step given by the simulator, and its result.
 	 *
@@ -65,9 +114,18 @@ class Client {
 	 *
 	 * If the answer to a step will be used, and there are no pending
 	 * commands, the answer message will be sent to the client.
+	 *
+	 * \param shared The buffer holding resultMsg, if it's shared by the
+	 *     clients (see putAnswers(const tcpip::Storage&, SharedBuffer*))
 	 */
 	void handleStepResult(int currentTime, bool success,
-						  tcpip::Storage &resultMsg);
+						  const tcpip::Storage &resultMsg, SharedBuffer *shared=NULL);
+
+	/** \brief Determines if the result of a step is used by the client.
+	 *
+	 * See handleStepResult(int, bool, const tcpip::Storage&, SharedBuffer*).
+	 */
+	bool usesStepResult(int currentTime, bool success) const throw();
 
 
 	/** \brief Obtains commands from the client.
@@ -75,21 +133,75 @@ class Client {
 	 * Forwards commands from the client up to the end of
 	 * a message, a step request or a closing request.
 	 *
+	 * The commands aren't copied: they are located in the
+	 * received message, whose bytes are given by commandBytes().
+	 *
 	 * May listen for an incoming message when necessary.
 	 *
 	 * Handles storing of pending commands from a message
 	 * (commands after a step request), and management of
 	 * the state (connected, target time).
 	 *
-	 * \param[out] outStorage The Storage to receive commands
+	 * \param[out] commands Receives the commands to forward
 	 * \param[in] currentTime The current time in ms.
 	 *
-	 * \return true if commands were written to outStorage, false
+	 * \return true if commands were obtained, false
 	 *     otherwise (due to network errors or the internal state).
 	 *
 	 * \throw ProtocolException Signals an error parsing the commands
 	 */
-	bool getCommands(tcpip::Storage &outStorage, int currentTime);
+	bool getCommands(std::vector<tcpip::CommandSpan> &commands, int currentTime);
+
+	/** \brief The bytes of the last message received from the client.
+	 *
+	 * The spans given by getCommands(std::vector<tcpip::CommandSpan>&, int)
+	 * refer to these bytes, which remain valid until another message is
+	 * received.
+	 */
+	const unsigned char *commandBytes() const;
+
+	/** \brief Determines if commands can be obtained without blocking.
+	 *
+	 * Either there are pending commands, or a complete message
+	 * is received from the client without blocking (incomplete
+	 * messages are kept until the rest arrives).
+	 *
+	 * Queued answers are flushed first, and no message is received while
+	 * the client is held back (see isBackedUp()).
+	 *
+	 * \return true if getCommands(std::vector<tcpip::CommandSpan>&, int)
+	 *     won't block,
+	 *     false otherwise (including network errors, which disconnect
+	 *     the client).
+	 */
+	bool hasInput();
+
+	/// Determines if answers are queued, waiting for the connection to take them
+	bool hasOutput() const;
+
+	/// Determines if more answers are queued than the limit (see setQueueLimit(std::size_t))
+	bool isBackedUp() const;
+
+	/** \brief Determines if room for the queued answers is signalled as input.
+	 *
+	 * Through shared memory, the client wakes the hub up through the
+	 * socket (see SharedChannel::trySend), which becomes readable rather
+	 * than writable.
+	 */
+	bool flushesOnInput() const;
+
+	/** \brief Sends queued answers, as much as the connection takes without blocking.
+	 *
+	 * Through shared memory, the wakeups are taken first, so hasInput()
+	 * (which flushes before reading) tries again for messages too.
+	 *
+	 * \return false if an error occured and the client is now disconnected,
+	 *     true otherwise.
+	 */
+	bool flush();
+
+	/// Sets the bytes of answers queued before the client is held back
+	void setQueueLimit(std::size_t limit);
 
 	/** \brief Records answers to be sent to the client.
 	 *
@@ -97,25 +209,96 @@ class Client {
 	 * are pending commands), and creates answers for step and
 	 * close commands when required.
 	 *
-	 * Sends a message to the client when possible.
+	 * Sends a message to the client when possible, in which case the
+	 * answers are sent straight from the given storage, after the
+	 * pending ones (and copied only if the connection doesn't take
+	 * them at once).
+	 *
+	 * \param shared The buffer holding the answers, if they don't change
+	 *     while it's referenced: they are then kept by reference (instead
+	 *     of copied) when queued or pending. NULL otherwise.
 	 *
 	 * \return true if the message was sent/stored, false if an
 	 * error occured and the client is now disconnected.
 	 */
-	bool putAnswers(tcpip::Storage &answers);
+	bool putAnswers(const tcpip::Storage &answers, SharedBuffer *shared=NULL);
 
-	// Closes the connection with the client
+	// Closes the connection with the client, dropping the answers still queued
 	void closeConnection();
 
+	/** \brief Shuts the connection down, without closing it.
+	 *
+	 * Unlike closeConnection(), may be called while another thread
+	 * serves the client: that thread sees the client hang up, and
+	 * closes the connection itself.
+	 */
+	void interrupt();
+
+	/// The time spent and the bytes exchanged, since the endpoint was created
+	const ClientMetrics &metrics() const;
+
+	/// Counts a step deadline the client missed (see ClientMetrics::deadlineMisses)
+	void missedDeadline();
+
+	/** \brief Records the messages sent, and the time until the next one arrives.
+	 *
+	 * \param tracer Where to record them (NULL to stop), not owned
+	 * \param track The track of the client
+	 */
+	void setTracer(Tracer *tracer, int track);
+
+	/// Records a span on the track of the client, if traced
+	void trace(const char *name, unsigned long long start, unsigned long long end);
+
  private:
 	/// Socket for communicating with the client process
 	tcpip::Socket mySocket;
 
+	/// Whether messages go through myChannel
+	bool mySharedMemory;
+
+	/// Shared memory for the messages, set up through mySocket
+	SharedChannel myChannel;
+
 	/// Answers for a partially handled message
 	tcpip::Storage myPendingAnswers;
 
-	/// Unhandled commands from a message
-	tcpip::Storage myPendingCommands;
+	/** \brief Shared answers for a partially handled message (NULL if none)
+	 *
+	 * Referenced in myPendingShared, and sent in place at mySharedPosition
+	 * of myPendingAnswers. A single one is referenced, the next are copied.
+	 */
+	SharedBuffer *myPendingShared;
+	tcpip::Segment mySharedAnswers;
+	std::size_t mySharedPosition;
+
+	/// Messages sent that the connection didn't take yet
+	OutboundQueue myOutput;
+
+	/// Whether the client is held back (see isBackedUp())
+	bool myHeldBack;
+
+	/// Updated as messages are received and sent
+	ClientMetrics myMetrics;
+
+	/// Records the spans of the client (NULL if not traced), on myTrack
+	Tracer *myTracer;
+	int myTrack;
+
+	/// When the last message was sent, while the next isn't received (0 otherwise)
+	unsigned long long myLastSent;
+
+	/** \brief The last message received, possibly with unhandled commands
+	 *
+	 * Located in the receive buffer of mySocket (or myChannel), not copied.
+	 */
+	const unsigned char *myPendingCommands;
+
+	/// Number of bytes in myPendingCommands
+	unsigned int myPendingLength;
+
+	/// Position of the first unhandled command in myPendingCommands
+	unsigned int myPendingPosition;
 
 	/// True if the last command was a close request
 	bool myDisconnecting;
@@ -131,38 +314,59 @@ class Client {
 	bool hasPendingCommands() throw();
 	bool hasPendingAnswers() const throw();
 
-	/** \brief Handles the first command from inStorage.
+	/** \brief Receives a message of commands, without copying it.
+	 *
+	 * \param onlyAvailable Don't block if no complete message is available
+	 *
+	 * \return true iff a message was received
+	 */
+	bool receiveCommands(bool onlyAvailable) throw (tcpip::SocketException);
+
+	/** \brief Handles the first pending command.
 	 *
 	 * The commands are split into three cases:
 	 *  - Simulation step: adjust target time and set waiting
 	 *  - Close request: change state to disconnecting
-	 *  - Other commands: copy to outStorage.
+	 *  - Other commands: add its span to commands.
 	 *
-	 * \param[in] inStorage Storage to read a command
-	 * \param[out] outStorage Storage to write common commands
+	 * \param[out] commands Receives the spans of common commands
 	 *
 	 * \return The command code for the handled command
 	 *
 	 * \throw ProtocolException Signals an error parsing the command
 	 */
-	unsigned char handleCommand(tcpip::Storage &inStorage,
-								tcpip::Storage &outStorage);
+	unsigned char handleCommand(std::vector<tcpip::CommandSpan> &commands);
 
 	/** \brief Sends the pending answers to the client.
 	 *
-	 * Tries to send the storage and adjust the internal
-	 * state in case of errors.
+	 * Tries to send the storage (queueing what doesn't fit) and
+	 * adjust the internal state in case of errors.
 	 *
 	 * Adds an answer to the close command when necessary.
 	 *
+	 * \param last Answers to send after the pending ones, without
+	 *     copying them (NULL if there are none)
+	 * \param shared The buffer holding last, if shared (see
+	 *     putAnswers(const tcpip::Storage&, SharedBuffer*))
+	 *
 	 * \return true if successful, false if an error occured.
 	 */
-	bool sendAnswers();
+	bool sendAnswers(const tcpip::Storage *last=NULL, SharedBuffer *shared=NULL);
+
+	/// Forgets the pending answers, releasing the shared ones
+	void clearPendingAnswers();
+
+	/// Closes the socket and the shared memory, if any, dropping the queued answers
+	void closeSocket();
 
 	// Writes a status answer to the given storage
 	void writeStatusCmd(int cmdCode, int status, const std::string &description,
 						tcpip::Storage &outStorage);
 
+	// Not copyable (owns the sockets)
+	Client(const Client &);
+	Client &operator=(const Client &);
+
 };
 
 #endif /* CLIENT_H */
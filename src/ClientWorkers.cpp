@@ -0,0 +1,265 @@
+#include <cstring>
+
+#include "ClientWorkers.h"
+
+ClientWorkers::Worker::Worker() throw( tcpip::SocketException ) :
+	owner(NULL),
+	thread(),
+	inbox(),
+	stop(),
+	reactor()
+{
+	reactor.add(inbox.fd(), NULL);
+}
+
+
+ClientWorkers::ClientWorkers(const std::vector<Client*> &clients, unsigned int threads)
+	throw( tcpip::SocketException ) :
+	mySlots(clients.size()),
+	myWorkers(),
+	myRunning(0),
+	myReturned(),
+	myResumed(0),
+	mySnapshots(false)
+{
+	for (unsigned int i=0; i < threads; i++) {
+		myWorkers.push_back(new Worker());
+		myWorkers.back()->owner = this;
+	}
+
+	for (size_t i=0; i < clients.size(); i++) {
+		Slot &slot = mySlots[i];
+		slot.next = NULL;
+		slot.client = clients[i];
+		slot.index = i;
+		slot.thread = i % threads;
+		slot.fd = -1;
+		slot.resumed = false;
+		slot.currentTime = 0;
+		slot.answers = NULL;
+		slot.shared = NULL;
+		slot.stepResult = false;
+		slot.stepSuccess = false;
+		slot.bytes = NULL;
+		slot.error = NULL;
+		slot.connected = false;
+	}
+}
+
+ClientWorkers::~ClientWorkers()
+{
+	stop();
+
+	std::vector<Worker*>::iterator it;
+	for (it=myWorkers.begin(); it != myWorkers.end(); it++) {
+		delete *it;
+	}
+
+	std::vector<Slot>::iterator slot;
+	for (slot=mySlots.begin(); slot != mySlots.end(); slot++) {
+		delete slot->error;
+		if (slot->shared != NULL) {
+			slot->shared->release();
+		}
+	}
+}
+
+
+void ClientWorkers::start() throw( tcpip::SocketException )
+{
+	while (myRunning < myWorkers.size()) {
+		Worker *worker = myWorkers[myRunning];
+		int error = pthread_create(&worker->thread, NULL, &ClientWorkers::run, worker);
+		if (error != 0) {
+			stop();
+			throw tcpip::SocketException(std::string("ClientWorkers::start() @ pthread_create: ")
+										 + strerror(error));
+		}
+		myRunning++;
+	}
+}
+
+void ClientWorkers::stop()
+{
+	for (unsigned int i=0; i < myRunning; i++) {
+		myWorkers[i]->inbox.push(&myWorkers[i]->stop);
+	}
+	for (unsigned int i=0; i < myRunning; i++) {
+		pthread_join(myWorkers[i]->thread, NULL);
+	}
+
+	myRunning = 0;
+}
+
+ClientWorkers::Slot &ClientWorkers::slot(size_t index)
+{
+	return mySlots[index];
+}
+
+void ClientWorkers::setSnapshots(bool enabled)
+{
+	mySnapshots = enabled;
+}
+
+void ClientWorkers::resume(Slot &slot, int currentTime)
+{
+	// The client still belongs to the dispatcher
+	if (mySnapshots) {
+		slot.metrics = slot.client->metrics();
+		slot.connected = slot.client->isConnected();
+	}
+
+	slot.currentTime = currentTime;
+	slot.resumed = true;
+	myResumed++;
+
+	myWorkers[slot.thread]->inbox.push(&slot);
+}
+
+ClientWorkers::Slot *ClientWorkers::take()
+{
+	Slot *slot = static_cast<Slot*>(myReturned.pop());
+	if (slot != NULL) {
+		slot->resumed = false;
+		myResumed--;
+	}
+	return slot;
+}
+
+unsigned int ClientWorkers::resumed() const
+{
+	return myResumed;
+}
+
+bool ClientWorkers::sleep()
+{
+	return myReturned.sleep();
+}
+
+void ClientWorkers::wake()
+{
+	myReturned.wake();
+}
+
+int ClientWorkers::fd() const
+{
+	return myReturned.fd();
+}
+
+
+void *ClientWorkers::run(void *worker)
+{
+	Worker *self = static_cast<Worker*>(worker);
+	self->owner->work(*self);
+	return NULL;
+}
+
+void ClientWorkers::work(Worker &worker)
+{
+	std::vector<Slot*> candidates;
+	std::vector<void*> ready;
+
+	while (true) {
+		// Clients resumed by the dispatcher get their answers first
+		Mailbox::Node *node;
+		while ((node = worker.inbox.pop()) != NULL) {
+			if (node == &worker.stop) {
+				return;
+			}
+
+			Slot *slot = static_cast<Slot*>(node);
+			deliver(*slot);
+			candidates.push_back(slot);
+		}
+
+		// Then clients whose messages arrived (the inbox is registered as NULL)
+		std::vector<void*>::iterator readyIt;
+		for (readyIt=ready.begin(); readyIt != ready.end(); readyIt++) {
+			if (*readyIt != NULL) {
+				candidates.push_back(static_cast<Slot*>(*readyIt));
+			}
+		}
+		ready.clear();
+
+		std::vector<Slot*>::iterator it;
+		for (it=candidates.begin(); it != candidates.end(); it++) {
+			serve(worker, **it);
+		}
+		candidates.clear();
+
+		// Wait for a message, or for a client to be resumed
+		if (worker.inbox.sleep()) {
+			try {
+				worker.reactor.wait(ready);
+			}
+			catch (tcpip::SocketException) {
+				// Interrupted, the clients are checked again
+				ready.clear();
+			}
+			worker.inbox.wake();
+		}
+	}
+}
+
+void ClientWorkers::deliver(Slot &slot)
+{
+	slot.commands.clear();
+	slot.bytes = NULL;
+
+	if (slot.answers == NULL) {
+		return;
+	}
+
+	if (slot.stepResult) {
+		slot.client->handleStepResult(slot.currentTime, slot.stepSuccess, *slot.answers,
+									  slot.shared);
+	} else {
+		slot.client->putAnswers(*slot.answers);
+	}
+	slot.answers = NULL;
+
+	// The client keeps its own reference, if it needs one
+	if (slot.shared != NULL) {
+		slot.shared->release();
+		slot.shared = NULL;
+	}
+}
+
+void ClientWorkers::serve(Worker &worker, Slot &slot)
+{
+	Client &client = *slot.client;
+
+	if (client.canAct(slot.currentTime)) {
+		try {
+			// Wait for a complete message, unless the client hung up (or was detached)
+			if (client.hasInput()) {
+				client.getCommands(slot.commands, slot.currentTime);
+				slot.bytes = client.commandBytes();
+			} else if (client.isConnected()) {
+				// Only waits for room for its answers, while it's held back
+				int output = client.flushesOnInput()? Reactor::INPUT : Reactor::OUTPUT;
+				int events = client.isBackedUp()? output : Reactor::INPUT;
+				if (client.hasOutput()) {
+					events |= output;
+				}
+				slot.fd = client.fd();
+				worker.reactor.add(slot.fd, &slot, events);
+				return;
+			}
+		}
+		catch (ProtocolException &e) {
+			slot.error = new ProtocolException(e);
+		}
+		catch (tcpip::SocketException) {
+			// Can't be watched, the dispatcher sees it disconnected
+			client.closeConnection();
+		}
+	}
+
+	// The dispatcher takes over (descriptors are gone once a client disconnects)
+	if (slot.fd >= 0) {
+		worker.reactor.remove(slot.fd);
+		slot.fd = -1;
+	}
+	myReturned.push(&slot);
+}
@@ -0,0 +1,182 @@
+#ifndef CLIENTWORKERS_H
+#define CLIENTWORKERS_H
+
+#include <vector>
+#include <pthread.h>
+
+#include "tcpip/socket.h"
+#include "tcpip/storage.h"
+
+#include "Client.h"
+#include "Mailbox.h"
+#include "Reactor.h"
+#include "SharedBuffer.h"
+
+/** \brief Threads that exchange the messages of the clients.
+ *
+ * Each client is handled by one of the threads, which receives its
+ * messages, takes their commands (see Client::getCommands) and sends
+ * its answers. Only a single thread, the dispatcher, talks to SUMO.
+ *
+ * A client belongs either to its thread or to the dispatcher, never to
+ * both, and is handed over through a Mailbox:
+ *   - The dispatcher resumes a client that can act, with the answers to
+ *     deliver to it (see resume(Slot&, int)).
+ *   - The thread gives the client back once it received a message, with
+ *     its commands, or as soon as it can't act anymore (see take()).
+ *
+ * The commands remain in the client's buffer, and the answers in the
+ * dispatcher's, until the client is handed over again: nothing is
+ * copied between the threads.
+ */
+class ClientWorkers {
+
+ public:
+	/// A client as handed over between the threads
+	struct Slot : public Mailbox::Node {
+		Client *client;
+
+		/// The index of the client (and of the slot)
+		size_t index;
+
+		/// The thread that handles the client
+		unsigned int thread;
+
+		/// The descriptor watched by the thread (-1 if none)
+		int fd;
+
+		/// Whether the client belongs to its thread
+		bool resumed;
+
+		/// The time the client is resumed at
+		int currentTime;
+
+		/// Answers to deliver when resumed (NULL if none)
+		const tcpip::Storage *answers;
+
+		/// The buffer holding answers if shared, referenced until delivered (NULL if not)
+		SharedBuffer *shared;
+
+		/// Whether answers are the result of a step, and its success
+		bool stepResult, stepSuccess;
+
+		/// A buffer for the answers, owned by the dispatcher
+		tcpip::Storage buffer;
+
+		/// The commands of the message received (empty if none)
+		std::vector<tcpip::CommandSpan> commands;
+
+		/// The bytes of the message with the commands
+		const unsigned char *bytes;
+
+		/// The error parsing the message (NULL if none, owned by the slot)
+		ProtocolException *error;
+
+		/// The client's metrics and state when last resumed (see setSnapshots(bool))
+		ClientMetrics metrics;
+		bool connected;
+	};
+
+	/** \brief Prepares the threads, without starting them.
+	 *
+	 * \param clients The clients handled, connected or not, in the order of the slots
+	 * \param threads Number of threads
+	 */
+	ClientWorkers(const std::vector<Client*> &clients, unsigned int threads)
+		throw( tcpip::SocketException );
+
+	/// Stops the threads
+	virtual ~ClientWorkers();
+
+	/// Starts the threads, all clients belong to the dispatcher
+	void start() throw( tcpip::SocketException );
+
+	/// Stops and waits for the threads, clients are left as they are
+	void stop();
+
+	/// The slot of the client at the given index
+	Slot &slot(size_t index);
+
+	/** \brief Sets whether resume(Slot&, int) copies the client's metrics into the slot.
+	 *
+	 * The dispatcher reports the copy while the client belongs to its
+	 * thread, which keeps updating the client's own metrics.
+	 */
+	void setSnapshots(bool enabled);
+
+	/** \brief Hands a client to its thread (dispatcher only).
+	 *
+	 * The client must be able to act at the given time. The answers
+	 * (if any) are delivered before its next message is received.
+	 */
+	void resume(Slot &slot, int currentTime);
+
+	/// Takes back a client given back by its thread, NULL if there is none
+	Slot *take();
+
+	/// Number of clients that belong to their threads
+	unsigned int resumed() const;
+
+	/// See Mailbox::sleep(), for the clients given back
+	bool sleep();
+
+	/// See Mailbox::wake(), for the clients given back
+	void wake();
+
+	/// Readable when the sleeping dispatcher must wake up
+	int fd() const;
+
+ private:
+	/// A thread and the clients it handles
+	struct Worker {
+		ClientWorkers *owner;
+		pthread_t thread;
+
+		/// The clients resumed by the dispatcher
+		Mailbox inbox;
+
+		/// Pushed to the inbox to stop the thread
+		Mailbox::Node stop;
+
+		/// Watches the clients that belong to the thread, and the inbox
+		Reactor reactor;
+
+		Worker() throw( tcpip::SocketException );
+	};
+
+	/// One slot per client, in the order of the clients
+	std::vector<Slot> mySlots;
+
+	/// All threads, each client i is handled by thread i % size
+	std::vector<Worker*> myWorkers;
+
+	/// Number of threads running
+	unsigned int myRunning;
+
+	/// The clients given back to the dispatcher
+	Mailbox myReturned;
+
+	/// Number of clients that belong to their threads
+	unsigned int myResumed;
+
+	/// Whether resume(Slot&, int) copies the metrics of the clients
+	bool mySnapshots;
+
+	/// Entry point of the threads
+	static void *run(void *worker);
+
+	/// Handles the clients of a thread until it's stopped
+	void work(Worker &worker);
+
+	/// Delivers the answers the client was resumed with
+	void deliver(Slot &slot);
+
+	/// Takes a message from the client, or waits for it, or gives it back
+	void serve(Worker &worker, Slot &slot);
+
+	// Not copyable (owns the threads)
+	ClientWorkers(const ClientWorkers &);
+	ClientWorkers &operator=(const ClientWorkers &);
+};
+
+#endif /* CLIENTWORKERS_H */
@@ -0,0 +1,143 @@
+#include <cstring>
+#include <sstream>
+#include <sys/time.h>
+
+#include "util.h"
+
+#include "Ensemble.h"
+
+namespace {
+
+	/// Current wall clock time in seconds
+	double now()
+	{
+		struct timeval time;
+		gettimeofday(&time, NULL);
+		return time.tv_sec + time.tv_usec / 1e6;
+	}
+
+	/// The prefix of the lines written by a replica
+	std::string replicaLabel(size_t index)
+	{
+		std::ostringstream label;
+		label << "[replica " << index << "] ";
+		return label.str();
+	}
+
+}
+
+Ensemble::Ensemble() :
+	myReplicas()
+{
+	// No further initialization needed
+}
+
+Ensemble::~Ensemble()
+{
+	std::vector<Replica>::iterator it;
+	for (it=myReplicas.begin(); it != myReplicas.end(); it++) {
+		delete it->hub;
+	}
+}
+
+
+TraCIHub &Ensemble::addReplica(const tcpip::Endpoint &sumo,
+							   const std::vector<tcpip::Endpoint> &clients, int stepLength)
+{
+	Replica replica;
+	replica.hub = new TraCIHub(sumo, clients, stepLength);
+	replica.started = false;
+	replica.result = 0;
+	replica.seconds = 0;
+	myReplicas.push_back(replica);
+
+	return *replica.hub;
+}
+
+size_t Ensemble::size() const
+{
+	return myReplicas.size();
+}
+
+int Ensemble::execute()
+{
+	if (myReplicas.size() == 1) {
+		return myReplicas[0].hub->execute();
+	}
+
+	// Lines are told apart by the replica that wrote them
+	for (size_t i=0; i < myReplicas.size(); i++) {
+		myReplicas[i].hub->setLabel(replicaLabel(i));
+	}
+
+	// Replicas that can't get a thread are executed after the others
+	std::vector<Replica>::iterator it;
+	for (it=myReplicas.begin(); it != myReplicas.end(); it++) {
+		int error = pthread_create(&it->thread, NULL, &Ensemble::run, &*it);
+		if (error != 0) {
+			Report("", std::cerr) << "Error starting a thread for a replica: "
+								  << strerror(error);
+			continue;
+		}
+		it->started = true;
+	}
+
+	for (it=myReplicas.begin(); it != myReplicas.end(); it++) {
+		if (it->started) {
+			pthread_join(it->thread, NULL);
+			it->started = false;
+		} else {
+			executeReplica(*it);
+		}
+	}
+
+	printSummary();
+
+	for (it=myReplicas.begin(); it != myReplicas.end(); it++) {
+		if (it->result != 0) {
+			return it->result;
+		}
+	}
+	return 0;
+}
+
+
+void *Ensemble::run(void *replica)
+{
+	executeReplica(*static_cast<Replica*>(replica));
+	return NULL;
+}
+
+void Ensemble::executeReplica(Replica &replica)
+{
+	double start = now();
+	replica.result = replica.hub->execute();
+	replica.seconds = now() - start;
+}
+
+void Ensemble::printSummary() const
+{
+	unsigned long steps = 0;
+	double slowest = 0;
+	size_t failed = 0;
+
+	Report("");
+	for (size_t i=0; i < myReplicas.size(); i++) {
+		const Replica &replica = myReplicas[i];
+		Report(replicaLabel(i)) << (replica.result == 0? "Finished" : "Failed")
+								<< " after " << replica.hub->steps() << " steps in "
+								<< replica.seconds << " s";
+
+		steps += replica.hub->steps();
+		if (replica.seconds > slowest) {
+			slowest = replica.seconds;
+		}
+		if (replica.result != 0) {
+			failed++;
+		}
+	}
+
+	Report("") << "Ensemble: " << myReplicas.size() << " replicas (" << failed
+			   << " failed), " << steps << " steps in total, " << slowest
+			   << " s for the slowest";
+}
@@ -0,0 +1,85 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <vector>
+#include <pthread.h>
+
+#include "tcpip/socket.h"
+
+#include "TraCIHub.h"
+
+/** \brief Drives several SUMO replicas at once.
+ *
+ * Each replica is a SUMO instance (e.g. started with another seed) with
+ * its own group of clients, served by its own TraCIHub. The hubs run
+ * concurrently, one thread each, so the time the replicas take is the
+ * time of the slowest one rather than their sum.
+ *
+ * The replicas share the options (set through each hub before
+ * execute()), the output (each line is prefixed by the replica, see
+ * TraCIHub::setLabel) and a summary written once all of them finished.
+ */
+class Ensemble {
+
+ public:
+	Ensemble();
+
+	/// Destroys the hubs of all replicas
+	virtual ~Ensemble();
+
+	/** \brief Adds a replica.
+	 *
+	 * \param sumo Where the SUMO instance of the replica is listening
+	 * \param clients The endpoints of the clients bound to the replica
+	 * \param stepLength The time in ms each timestep represents
+	 *
+	 * \return The hub of the replica, to be configured before execute()
+	 */
+	TraCIHub &addReplica(const tcpip::Endpoint &sumo,
+						 const std::vector<tcpip::Endpoint> &clients, int stepLength);
+
+	/// Number of replicas added
+	size_t size() const;
+
+	/** \brief Executes the simulation on all replicas and waits for them.
+	 *
+	 * A single replica is executed by the calling thread, as a plain hub.
+	 *
+	 * \return 0 if all replicas succeeded, otherwise the result of the
+	 *     first one that failed (see TraCIHub::execute())
+	 */
+	int execute();
+
+ private:
+	/// A replica and the thread executing it
+	struct Replica {
+		TraCIHub *hub;
+		pthread_t thread;
+
+		/// Whether the thread was started
+		bool started;
+
+		/// The result of TraCIHub::execute()
+		int result;
+
+		/// Seconds taken to execute
+		double seconds;
+	};
+
+	std::vector<Replica> myReplicas;
+
+	/// Entry point of the threads
+	static void *run(void *replica);
+
+	/// Executes the hub of a replica, measuring the time taken
+	static void executeReplica(Replica &replica);
+
+	/// Writes the result of each replica and the totals
+	void printSummary() const;
+
+	// Not copyable (owns the hubs)
+	Ensemble(const Ensemble &);
+	Ensemble &operator=(const Ensemble &);
+};
+
+#endif /* ENSEMBLE_H */
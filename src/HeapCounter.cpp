@@ -0,0 +1,98 @@
+#include <cstdlib>
+#include <new>
+
+#include "HeapCounter.h"
+
+namespace {
+
+	/// Incremented by every operator new, in the thread that calls it
+	__thread unsigned long allocations = 0;
+
+	/// Allocates like the default operator new, counting the allocation
+	void *countedAlloc(std::size_t size)
+	{
+		allocations++;
+
+		if (size == 0) {
+			size = 1;
+		}
+
+		void *p;
+		while ((p = std::malloc(size)) == NULL) {
+			std::new_handler handler = std::set_new_handler(NULL);
+			std::set_new_handler(handler);
+			if (handler == NULL) {
+				return NULL;
+			}
+			handler();
+		}
+		return p;
+	}
+
+}
+
+unsigned long heapAllocations()
+{
+	return allocations;
+}
+
+
+void *operator new(std::size_t size) throw (std::bad_alloc)
+{
+	void *p = countedAlloc(size);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *operator new[](std::size_t size) throw (std::bad_alloc)
+{
+	return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) throw ()
+{
+	try {
+		return countedAlloc(size);
+	}
+	catch (std::bad_alloc) {
+		return NULL;
+	}
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) throw ()
+{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) throw ()
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) throw ()
+{
+	std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) throw ()
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) throw ()
+{
+	std::free(p);
+}
+
+// Sized since C++14, and replaced along with the unsized ones
+void operator delete(void *p, std::size_t) throw ()
+{
+	operator delete(p);
+}
+
+void operator delete[](void *p, std::size_t) throw ()
+{
+	operator delete[](p);
+}
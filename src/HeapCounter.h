@@ -0,0 +1,13 @@
+#ifndef HEAPCOUNTER_H
+#define HEAPCOUNTER_H
+
+/** \brief Number of heap allocations made by the calling thread so far.
+ *
+ * Counted by the replacements of the global operator new (see
+ * HeapCounter.cpp), including the allocations of the standard library.
+ * Each thread has its own count, so the allocations of a hub aren't
+ * mixed with the ones of the client threads or of other hubs.
+ */
+unsigned long heapAllocations();
+
+#endif /* HEAPCOUNTER_H */
@@ -0,0 +1,117 @@
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Mailbox.h"
+
+Mailbox::Mailbox() throw( tcpip::SocketException ) :
+	myHead(&myStub),
+	myTail(&myStub),
+	myStub(),
+	mySleeping(0)
+{
+	myStub.next = NULL;
+
+	if (pipe(myPipe) < 0) {
+		throw tcpip::SocketException(std::string("Mailbox @ pipe: ") + strerror(errno));
+	}
+	fcntl(myPipe[0], F_SETFL, fcntl(myPipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(myPipe[1], F_SETFL, fcntl(myPipe[1], F_GETFL) | O_NONBLOCK);
+}
+
+Mailbox::~Mailbox()
+{
+	::close(myPipe[0]);
+	::close(myPipe[1]);
+}
+
+
+void Mailbox::push(Node *node)
+{
+	link(node);
+
+	// Only a sleeping consumer needs the system call
+	int sleeping = 1;
+	if (__atomic_compare_exchange_n(&mySleeping, &sleeping, 0, false, __ATOMIC_SEQ_CST,
+									__ATOMIC_SEQ_CST)) {
+		char byte = 0;
+		while (write(myPipe[1], &byte, 1) < 0 && errno == EINTR) {
+		}
+	}
+}
+
+void Mailbox::link(Node *node)
+{
+	__atomic_store_n(&node->next, static_cast<Node*>(NULL), __ATOMIC_RELAXED);
+
+	// Sequentially consistent, so a consumer going to sleep sees it (see sleep())
+	Node *previous = __atomic_exchange_n(&myHead, node, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+Mailbox::Node *Mailbox::pop()
+{
+	Node *tail = myTail;
+	Node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &myStub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		myTail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL) {
+		myTail = next;
+		return tail;
+	}
+
+	// A producer may be between swapping myHead and linking the node
+	if (tail != __atomic_load_n(&myHead, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	link(&myStub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		myTail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+
+bool Mailbox::sleep()
+{
+	__atomic_store_n(&mySleeping, 1, __ATOMIC_SEQ_CST);
+
+	// Something pushed before the announcement wouldn't wake us up
+	Node *tail = myTail;
+	if (tail != &myStub || __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST) != NULL
+		|| tail != __atomic_load_n(&myHead, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&mySleeping, 0, __ATOMIC_SEQ_CST);
+		return false;
+	}
+
+	return true;
+}
+
+void Mailbox::wake()
+{
+	__atomic_store_n(&mySleeping, 0, __ATOMIC_SEQ_CST);
+
+	char bytes[64];
+	while (read(myPipe[0], bytes, sizeof(bytes)) > 0) {
+	}
+}
+
+int Mailbox::fd() const
+{
+	return myPipe[0];
+}
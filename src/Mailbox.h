@@ -0,0 +1,81 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include "tcpip/socket.h"
+
+/** \brief A lock-free queue between threads, for a single consumer.
+ *
+ * Any thread may push, only one thread may pop. Nodes are intrusive:
+ * whatever is queued derives from Mailbox::Node, and can't be in more
+ * than one mailbox at a time. Nothing is allocated.
+ *
+ * The links are only accessed atomically: pushing releases what was
+ * written to a node, popping acquires it.
+ *
+ * The consumer may sleep until something is pushed by watching fd(),
+ * which only costs a system call to a producer when the consumer is
+ * actually sleeping:
+ *
+ * \code
+ * if (mailbox.sleep()) {
+ *     // wait until fd() is readable (or anything else happens)
+ *     mailbox.wake();
+ * }
+ * \endcode
+ */
+class Mailbox {
+
+ public:
+	/// Something that can be queued
+	struct Node {
+		/// The node pushed after this one (atomic)
+		Node *next;
+	};
+
+	Mailbox() throw( tcpip::SocketException );
+
+	virtual ~Mailbox();
+
+	/// Queues a node, waking up the consumer (any thread)
+	void push(Node *node);
+
+	/// Takes the oldest node, NULL if there is none (consumer only)
+	Node *pop();
+
+	/** \brief Announces that the consumer will sleep (consumer only).
+	 *
+	 * \return false if something was pushed meanwhile (don't sleep)
+	 */
+	bool sleep();
+
+	/// Acknowledges the wakeup after sleeping (consumer only)
+	void wake();
+
+	/// Readable when the sleeping consumer must wake up
+	int fd() const;
+
+ private:
+	/// The last node pushed (atomic)
+	Node *myHead;
+
+	/// The next node to pop
+	Node *myTail;
+
+	/// Kept in the queue so it's never empty
+	Node myStub;
+
+	/// Whether the consumer sleeps (or is about to, atomic)
+	int mySleeping;
+
+	/// Written to wake the consumer up
+	int myPipe[2];
+
+	/// Links a node after myHead
+	void link(Node *node);
+
+	// Not copyable (owns the pipe, nodes point to myStub)
+	Mailbox(const Mailbox &);
+	Mailbox &operator=(const Mailbox &);
+};
+
+#endif /* MAILBOX_H */
@@ -0,0 +1,230 @@
+#include <iomanip>
+#include <time.h>
+
+#include "Metrics.h"
+
+Histogram::Histogram() :
+	myCount(0),
+	mySum(0),
+	myMax(0)
+{
+	for (int i=0; i < BUCKETS; i++) {
+		myBuckets[i] = 0;
+	}
+}
+
+void Histogram::record(unsigned long value)
+{
+	int bucket = 0;
+	if (value > 0) {
+		bucket = static_cast<int>(8 * sizeof(value)) - __builtin_clzl(value);
+		if (bucket >= BUCKETS) {
+			bucket = BUCKETS - 1;
+		}
+	}
+
+	myBuckets[bucket]++;
+	myCount++;
+	mySum += value;
+	if (value > myMax) {
+		myMax = value;
+	}
+}
+
+unsigned long Histogram::count() const
+{
+	return myCount;
+}
+
+unsigned long long Histogram::sum() const
+{
+	return mySum;
+}
+
+unsigned long Histogram::max() const
+{
+	return myMax;
+}
+
+unsigned long Histogram::percentile(double fraction) const
+{
+	unsigned long rank = static_cast<unsigned long>(fraction * myCount + 0.5);
+	unsigned long seen = 0;
+
+	for (int i=0; i < BUCKETS; i++) {
+		seen += myBuckets[i];
+		if (seen >= rank && seen > 0) {
+			// The largest value is a better bound for the last bucket
+			unsigned long bound = (i == 0)? 0 : (1UL << i) - 1;
+			return (bound < myMax)? bound : myMax;
+		}
+	}
+	return myMax;
+}
+
+void Histogram::print(std::ostream &out) const
+{
+	out << "count " << myCount;
+	if (myCount == 0) {
+		return;
+	}
+
+	out << ", mean " << (mySum / myCount) << ", p50 " << percentile(0.5)
+		<< ", p90 " << percentile(0.9) << ", p99 " << percentile(0.99)
+		<< ", max " << myMax;
+}
+
+
+ClientMetrics::ClientMetrics() :
+	think(),
+	wait(),
+	messagesIn(0),
+	bytesIn(0),
+	messagesOut(0),
+	bytesOut(0),
+	deadlineMisses(0),
+	heldBack(0),
+	myLastEvent(0),
+	myAnswering(false)
+{
+	// No further initialization needed
+}
+
+void ClientMetrics::received(std::size_t bytes)
+{
+	unsigned long long time = Metrics::now();
+	if (!myAnswering && myLastEvent > 0) {
+		think.record(static_cast<unsigned long>(time - myLastEvent));
+	}
+	myAnswering = true;
+	myLastEvent = time;
+
+	messagesIn++;
+	bytesIn += bytes;
+}
+
+void ClientMetrics::sent(std::size_t bytes)
+{
+	unsigned long long time = Metrics::now();
+	if (myAnswering) {
+		wait.record(static_cast<unsigned long>(time - myLastEvent));
+	}
+	myAnswering = false;
+	myLastEvent = time;
+
+	messagesOut++;
+	bytesOut += bytes;
+}
+
+void ClientMetrics::reconnected()
+{
+	myLastEvent = 0;
+	myAnswering = false;
+}
+
+void ClientMetrics::print(std::ostream &out, const char *indent) const
+{
+	out << indent << "in: " << messagesIn << " messages, " << bytesIn << " bytes; out: "
+		<< messagesOut << " messages, " << bytesOut << " bytes";
+	if (deadlineMisses > 0) {
+		out << "; missed " << deadlineMisses << " step deadlines";
+	}
+	if (heldBack > 0) {
+		out << "; held back " << heldBack << " times";
+	}
+	out << '\n' << indent << "think (us): ";
+	think.print(out);
+	out << '\n' << indent << "wait (us): ";
+	wait.print(out);
+	out << '\n';
+}
+
+
+Metrics::CommandMetrics::CommandMetrics() :
+	forwarded(0),
+	cached(0),
+	bytesOut(0),
+	bytesIn(0),
+	latency()
+{
+	// No further initialization needed
+}
+
+Metrics::Metrics() :
+	myStep(),
+	myClients(),
+	mySumo(),
+	myFanOut(),
+	myDeadlineMisses(0)
+{
+	// No further initialization needed
+}
+
+unsigned long long Metrics::now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000ULL + time.tv_nsec / 1000;
+}
+
+void Metrics::recordCommand(int code, unsigned int bytes, unsigned int answerBytes,
+							unsigned long latency)
+{
+	CommandMetrics &command = myCommands[code & 0xff];
+	command.forwarded++;
+	command.bytesOut += bytes;
+	command.bytesIn += answerBytes;
+	command.latency.record(latency);
+}
+
+void Metrics::recordCached(int code)
+{
+	myCommands[code & 0xff].cached++;
+}
+
+void Metrics::recordDeadlineMiss()
+{
+	myDeadlineMisses++;
+}
+
+unsigned long Metrics::deadlineMisses() const
+{
+	return myDeadlineMisses;
+}
+
+void Metrics::recordStep(unsigned long total, unsigned long clients, unsigned long sumo)
+{
+	myStep.record(total);
+	myClients.record(clients);
+	mySumo.record(sumo);
+	myFanOut.record(total > clients + sumo? total - clients - sumo : 0);
+}
+
+void Metrics::print(std::ostream &out) const
+{
+	out << "steps (us): ";
+	myStep.print(out);
+	out << "\n  clients: ";
+	myClients.print(out);
+	out << "\n  sumo: ";
+	mySumo.print(out);
+	out << "\n  fan-out: ";
+	myFanOut.print(out);
+	out << "\n  deadline misses: " << myDeadlineMisses << '\n';
+
+	out << "commands:\n";
+	for (int code=0; code < 256; code++) {
+		const CommandMetrics &command = myCommands[code];
+		if (command.forwarded == 0 && command.cached == 0) {
+			continue;
+		}
+
+		out << "  0x" << std::hex << std::setw(2) << std::setfill('0') << code
+			<< std::dec << std::setfill(' ') << ": " << command.forwarded
+			<< " forwarded, " << command.cached << " cached, " << command.bytesOut
+			<< " bytes out, " << command.bytesIn << " bytes in\n";
+		out << "    latency (us): ";
+		command.latency.print(out);
+		out << '\n';
+	}
+}
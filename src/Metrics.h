@@ -0,0 +1,166 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstddef>
+#include <ostream>
+
+/** \brief Counts values (durations in us, sizes) in power-of-two buckets.
+ *
+ * Recording costs a few instructions and never allocates. Percentiles
+ * are approximated by the upper bound of the bucket they fall in.
+ */
+class Histogram {
+
+ public:
+	/// Bucket 0 counts zeros, bucket i > 0 the values in [2^(i-1), 2^i)
+	static const int BUCKETS = 40;
+
+	Histogram();
+
+	/// Counts a value
+	void record(unsigned long value);
+
+	/// Number of values recorded
+	unsigned long count() const;
+
+	/// Sum of the values recorded
+	unsigned long long sum() const;
+
+	/// Largest value recorded
+	unsigned long max() const;
+
+	/** \brief Approximates the value below which a fraction of the values lie.
+	 *
+	 * \param fraction Between 0 and 1 (e.g. 0.99 for the 99th percentile)
+	 */
+	unsigned long percentile(double fraction) const;
+
+	/// Writes the count, mean, some percentiles and the maximum in a single line (not ended)
+	void print(std::ostream &out) const;
+
+ private:
+	unsigned long myBuckets[BUCKETS];
+	unsigned long myCount;
+	unsigned long long mySum;
+	unsigned long myMax;
+};
+
+
+/** \brief What a client spends its time on, and the bytes it exchanges.
+ *
+ * Updated by whichever thread the client belongs to (see ClientWorkers),
+ * and only read by that thread. Reports written meanwhile by another
+ * thread use a copy taken when the client was handed over.
+ */
+class ClientMetrics {
+
+ public:
+	ClientMetrics();
+
+	/// From the answers sent to the next message received (the client's own time)
+	Histogram think;
+
+	/// From a message received to its answers (the hub's, SUMO's and other clients' time)
+	Histogram wait;
+
+	/// Messages and bytes received from the client (lengths included)
+	unsigned long messagesIn;
+	unsigned long long bytesIn;
+
+	/// Messages and bytes sent to the client (lengths included)
+	unsigned long messagesOut;
+	unsigned long long bytesOut;
+
+	/// Steps the client didn't ask for before their deadline
+	unsigned long deadlineMisses;
+
+	/// Times the client's requests were held back, until it took the answers queued
+	unsigned long heldBack;
+
+	/// Records a message received
+	void received(std::size_t bytes);
+
+	/// Records a message sent
+	void sent(std::size_t bytes);
+
+	/// Forgets the last message, the time before the next one isn't counted
+	void reconnected();
+
+	/// Writes everything, one line for the bytes and one per histogram
+	void print(std::ostream &out, const char *indent) const;
+
+ private:
+	/// Time of the last message received or sent (0 before the first)
+	unsigned long long myLastEvent;
+
+	/// Whether a message was received and not answered yet
+	bool myAnswering;
+};
+
+
+/** \brief Instrumentation of a hub: commands, and the phases of each step.
+ *
+ * Only touched by the thread that talks to SUMO.
+ */
+class Metrics {
+
+ public:
+	Metrics();
+
+	/// Microseconds from an arbitrary point (a monotonic clock)
+	static unsigned long long now();
+
+	/** \brief Records a command forwarded to SUMO.
+	 *
+	 * \param code The command code (see TraCIConstants.h)
+	 * \param bytes Length of the command
+	 * \param answerBytes Length of its answer (status and response)
+	 * \param latency The command's share of the round trip of its message,
+	 *     in us: a message of n commands gives each one n-th, so that the
+	 *     latencies add up to the time spent waiting for SUMO
+	 */
+	void recordCommand(int code, unsigned int bytes, unsigned int answerBytes,
+					   unsigned long latency);
+
+	/// Records a query answered without asking SUMO (see ResponseCache)
+	void recordCached(int code);
+
+	/// Records a client that didn't ask for a step before its deadline
+	void recordDeadlineMiss();
+
+	/// Number of deadline misses recorded
+	unsigned long deadlineMisses() const;
+
+	/** \brief Records the time taken by a step, in us.
+	 *
+	 * \param total Wall time of the whole step
+	 * \param clients Spent serving the clients (exchanges with SUMO excluded)
+	 * \param sumo Spent on exchanges with SUMO, the step included
+	 */
+	void recordStep(unsigned long total, unsigned long clients, unsigned long sumo);
+
+	/// Writes the phases of the steps and every command code seen
+	void print(std::ostream &out) const;
+
+ private:
+	/// What is known about each command code
+	struct CommandMetrics {
+		unsigned long forwarded;
+		unsigned long cached;
+		unsigned long long bytesOut;
+		unsigned long long bytesIn;
+		Histogram latency;
+
+		CommandMetrics();
+	};
+
+	CommandMetrics myCommands[256];
+
+	/// Duration of the steps, and of their phases
+	Histogram myStep, myClients, mySumo, myFanOut;
+
+	/// Clients that missed the deadline of a step (once per client and step)
+	unsigned long myDeadlineMisses;
+};
+
+#endif /* METRICS_H */
@@ -0,0 +1,208 @@
+#include <algorithm>
+
+#include "OutboundQueue.h"
+
+const std::size_t OutboundQueue::DEFAULT_LIMIT;
+
+OutboundQueue::OutboundQueue() :
+	myChunks(),
+	myFirst(0),
+	myBytes(),
+	myHead(0),
+	mySize(0),
+	myLimit(DEFAULT_LIMIT),
+	mySegments()
+{
+	// No further initialization needed
+}
+
+OutboundQueue::~OutboundQueue()
+{
+	clear();
+}
+
+
+std::size_t OutboundQueue::send(tcpip::Socket &socket, const tcpip::Segment *segments,
+								int count, SharedBuffer *const *shared)
+	throw( tcpip::SocketException )
+{
+	return sendTo(socket, segments, count, shared);
+}
+
+std::size_t OutboundQueue::send(SharedChannel &channel, const tcpip::Segment *segments,
+								int count, SharedBuffer *const *shared)
+	throw( tcpip::SocketException )
+{
+	return sendTo(channel, segments, count, shared);
+}
+
+bool OutboundQueue::flush(tcpip::Socket &socket) throw( tcpip::SocketException )
+{
+	return flushTo(socket);
+}
+
+bool OutboundQueue::flush(SharedChannel &channel) throw( tcpip::SocketException )
+{
+	return flushTo(channel);
+}
+
+template <typename Connection>
+std::size_t OutboundQueue::sendTo(Connection &connection, const tcpip::Segment *segments,
+								  int count, SharedBuffer *const *shared)
+	throw( tcpip::SocketException )
+{
+	std::size_t length = sizeof(myHeader);
+	for (int i=0; i < count; i++) {
+		length += segments[i].length;
+	}
+
+	myHeader[0] = static_cast<unsigned char>(length >> 24);
+	myHeader[1] = static_cast<unsigned char>(length >> 16);
+	myHeader[2] = static_cast<unsigned char>(length >> 8);
+	myHeader[3] = static_cast<unsigned char>(length);
+
+	tcpip::Segment header = { myHeader, sizeof(myHeader) };
+	mySegments.assign(1, header);
+	mySegments.insert(mySegments.end(), segments, segments + count);
+
+	// Straight to the socket, unless bytes are waiting before it
+	std::size_t sent = 0;
+	bool queued = !empty();
+	if (!queued) {
+		sent = connection.trySend(&mySegments[0], static_cast<int>(mySegments.size()));
+	}
+
+	// The rest is queued (the header is never shared)
+	for (size_t i=0; i < mySegments.size(); i++) {
+		const tcpip::Segment &segment = mySegments[i];
+		if (sent >= segment.length) {
+			sent -= segment.length;
+			continue;
+		}
+		push(segment.data + sent, segment.length - sent,
+			 (i > 0 && shared != NULL)? shared[i - 1] : NULL);
+		sent = 0;
+	}
+
+	if (queued) {
+		flushTo(connection);
+	}
+	return length;
+}
+
+template <typename Connection>
+bool OutboundQueue::flushTo(Connection &connection) throw( tcpip::SocketException )
+{
+	if (empty()) {
+		return true;
+	}
+
+	// The copied bytes are taken in order, by the chunks that aren't shared
+	mySegments.clear();
+	std::size_t copied = myHead;
+	for (size_t i=myFirst; i < myChunks.size(); i++) {
+		tcpip::Segment segment = { myChunks[i].data, myChunks[i].length };
+		if (myChunks[i].shared == NULL) {
+			segment.data = &myBytes[copied];
+			copied += segment.length;
+		}
+		mySegments.push_back(segment);
+	}
+
+	std::size_t sent = connection.trySend(&mySegments[0], static_cast<int>(mySegments.size()));
+	mySize -= sent;
+
+	// Drop what was sent, maybe stopping inside a chunk
+	while (sent > 0) {
+		Chunk &chunk = myChunks[myFirst];
+		std::size_t taken = std::min(sent, chunk.length);
+		if (chunk.shared == NULL) {
+			myHead += taken;
+		} else {
+			chunk.data += taken;
+		}
+		chunk.length -= taken;
+		sent -= taken;
+
+		if (chunk.length == 0) {
+			if (chunk.shared != NULL) {
+				chunk.shared->release();
+			}
+			myFirst++;
+		}
+	}
+
+	if (empty()) {
+		clear();
+		return true;
+	}
+
+	// What was sent is dropped once it's most of the queue
+	if (myHead >= myBytes.size() - myHead) {
+		myBytes.erase(myBytes.begin(), myBytes.begin() + myHead);
+		myHead = 0;
+	}
+	if (myFirst >= myChunks.size() - myFirst) {
+		myChunks.erase(myChunks.begin(), myChunks.begin() + myFirst);
+		myFirst = 0;
+	}
+	return false;
+}
+
+void OutboundQueue::clear()
+{
+	for (size_t i=myFirst; i < myChunks.size(); i++) {
+		if (myChunks[i].shared != NULL) {
+			myChunks[i].shared->release();
+		}
+	}
+
+	myChunks.clear();
+	myFirst = 0;
+	myBytes.clear();
+	myHead = 0;
+	mySize = 0;
+}
+
+bool OutboundQueue::empty() const
+{
+	return mySize == 0;
+}
+
+std::size_t OutboundQueue::size() const
+{
+	return mySize;
+}
+
+bool OutboundQueue::isFull() const
+{
+	return mySize > myLimit;
+}
+
+void OutboundQueue::setLimit(std::size_t limit)
+{
+	myLimit = limit;
+}
+
+
+void OutboundQueue::push(const unsigned char *data, std::size_t length, SharedBuffer *shared)
+{
+	mySize += length;
+
+	if (shared != NULL) {
+		shared->acquire();
+		Chunk chunk = { shared, data, length };
+		myChunks.push_back(chunk);
+		return;
+	}
+
+	// Adjacent copies make a single chunk
+	myBytes.insert(myBytes.end(), data, data + length);
+	if (myFirst < myChunks.size() && myChunks.back().shared == NULL) {
+		myChunks.back().length += length;
+		return;
+	}
+
+	Chunk chunk = { NULL, NULL, length };
+	myChunks.push_back(chunk);
+}
@@ -0,0 +1,120 @@
+#ifndef OUTBOUNDQUEUE_H
+#define OUTBOUNDQUEUE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "tcpip/socket.h"
+#include "SharedBuffer.h"
+#include "SharedChannel.h"
+
+/** \brief The messages waiting to be sent on a connection, up to a limit.
+ *
+ * A message is sent right away when nothing is queued, and only the bytes
+ * the connection (a socket or a SharedChannel) doesn't take without
+ * blocking are queued. Bytes that belong to a SharedBuffer are referenced,
+ * the others (small ones, like status answers) are copied. The rest is
+ * sent by flush(tcpip::Socket&), once the socket is writable (or by
+ * flush(SharedChannel&), once the other end wakes this one up).
+ *
+ * The limit doesn't refuse messages (an answer can't be dropped), it tells
+ * whoever produces them to stop for a while: see isFull().
+ *
+ * The queue keeps its allocated capacity, so a connection that is
+ * regularly slow doesn't allocate memory on every step.
+ */
+class OutboundQueue {
+
+ public:
+	/// Bytes queued before the queue is full, unless set otherwise
+	static const std::size_t DEFAULT_LIMIT = 1048576;
+
+	OutboundQueue();
+
+	/// Releases the buffers still referenced
+	virtual ~OutboundQueue();
+
+	/** \brief Sends a TraCI message made of \p count segments, queueing what's left.
+	 *
+	 * The length is prefixed as by tcpip::Socket::sendExact(const tcpip::Segment*, int).
+	 * Queued bytes are sent first, so messages keep their order.
+	 *
+	 * \param shared For each segment, the buffer holding its bytes (NULL
+	 *     if they must be copied), or NULL if none is shared
+	 *
+	 * \return The bytes of the message, length included
+	 */
+	std::size_t send(tcpip::Socket &socket, const tcpip::Segment *segments, int count,
+					 SharedBuffer *const *shared=NULL) throw( tcpip::SocketException );
+
+	/// Sends a TraCI message through shared memory, queueing what doesn't fit in the ring
+	std::size_t send(SharedChannel &channel, const tcpip::Segment *segments, int count,
+					 SharedBuffer *const *shared=NULL) throw( tcpip::SocketException );
+
+	/** \brief Sends queued bytes, as many as the socket takes without blocking.
+	 *
+	 * \return true if nothing is left queued
+	 */
+	bool flush(tcpip::Socket &socket) throw( tcpip::SocketException );
+
+	/// Sends queued bytes, as many as fit in the ring of the channel
+	bool flush(SharedChannel &channel) throw( tcpip::SocketException );
+
+	/// Drops the queued bytes (e.g. once the connection is closed)
+	void clear();
+
+	/// Determines if no bytes are queued
+	bool empty() const;
+
+	/// Number of bytes queued
+	std::size_t size() const;
+
+	/// Determines if more bytes are queued than the limit
+	bool isFull() const;
+
+	/// Sets the number of bytes that may be queued before the queue is full
+	void setLimit(std::size_t limit);
+
+ private:
+	/// Queued bytes, copied into myBytes (shared is NULL) or referenced
+	struct Chunk {
+		SharedBuffer *shared;
+		const unsigned char *data;
+		std::size_t length;
+	};
+
+	/// The chunks queued are [myFirst, end), in order
+	std::vector<Chunk> myChunks;
+	std::size_t myFirst;
+
+	/// The copied bytes are [myHead, end) (the ones before were sent)
+	std::vector<unsigned char> myBytes;
+	std::size_t myHead;
+
+	/// Number of bytes queued
+	std::size_t mySize;
+
+	std::size_t myLimit;
+
+	/// The length and the segments of the message being sent (reused)
+	unsigned char myHeader[4];
+	std::vector<tcpip::Segment> mySegments;
+
+	/// See send(tcpip::Socket&, const tcpip::Segment*, int, SharedBuffer *const*)
+	template <typename Connection>
+	std::size_t sendTo(Connection &connection, const tcpip::Segment *segments, int count,
+					   SharedBuffer *const *shared) throw( tcpip::SocketException );
+
+	/// See flush(tcpip::Socket&)
+	template <typename Connection>
+	bool flushTo(Connection &connection) throw( tcpip::SocketException );
+
+	/// Queues the bytes of a segment, referencing them if shared isn't NULL
+	void push(const unsigned char *data, std::size_t length, SharedBuffer *shared);
+
+	// Not copyable (references the buffers)
+	OutboundQueue(const OutboundQueue &);
+	OutboundQueue &operator=(const OutboundQueue &);
+};
+
+#endif /* OUTBOUNDQUEUE_H */
@@ -0,0 +1,162 @@
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+#ifdef __linux__
+	#include <sys/epoll.h>
+#else
+	#include <poll.h>
+#endif
+
+#include "Reactor.h"
+
+Reactor::Reactor() throw( tcpip::SocketException ) :
+	myEntries(),
+	myCount(0),
+	myPollFd(-1)
+{
+#ifdef __linux__
+	myPollFd = epoll_create(16);
+	if (myPollFd < 0) {
+		throw tcpip::SocketException(std::string("Reactor @ epoll_create: ")
+									 + strerror(errno));
+	}
+#endif
+}
+
+Reactor::~Reactor()
+{
+	if (myPollFd >= 0) {
+		::close(myPollFd);
+	}
+}
+
+
+void Reactor::add(int fd, void *data, int events) throw( tcpip::SocketException )
+{
+	if (contains(fd) && myEntries[fd].data == data && myEntries[fd].events == events) {
+		return;
+	}
+
+#ifdef __linux__
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = 0;
+	if (events & INPUT) {
+		ev.events |= EPOLLIN;
+	}
+	if (events & OUTPUT) {
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.ptr = data;
+
+	int op = contains(fd)? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(myPollFd, op, fd, &ev) < 0) {
+		throw tcpip::SocketException(std::string("Reactor @ epoll_ctl: ")
+									 + strerror(errno));
+	}
+#endif
+
+	if (fd >= static_cast<int>(myEntries.size())) {
+		Entry unused = { false, NULL, 0 };
+		myEntries.resize(fd + 1, unused);
+	}
+
+	if (!myEntries[fd].watched) {
+		myEntries[fd].watched = true;
+		myCount++;
+	}
+	myEntries[fd].data = data;
+	myEntries[fd].events = events;
+}
+
+void Reactor::remove(int fd)
+{
+	if (!contains(fd)) {
+		return;
+	}
+	myEntries[fd].watched = false;
+	myCount--;
+
+#ifdef __linux__
+	// Closed descriptors were already dropped by the kernel, ignore errors
+	struct epoll_event ev;
+	epoll_ctl(myPollFd, EPOLL_CTL_DEL, fd, &ev);
+#endif
+}
+
+bool Reactor::contains(int fd) const
+{
+	return fd >= 0 && fd < static_cast<int>(myEntries.size()) && myEntries[fd].watched;
+}
+
+int Reactor::size() const
+{
+	return myCount;
+}
+
+
+int Reactor::wait(std::vector<void*> &ready, int timeout)
+	throw( tcpip::SocketException )
+{
+	ready.clear();
+
+	if (myCount == 0) {
+		return 0;
+	}
+
+#ifdef __linux__
+	struct epoll_event events[64];
+
+	int n;
+	do {
+		n = epoll_wait(myPollFd, events, 64, timeout);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		throw tcpip::SocketException(std::string("Reactor @ epoll_wait: ")
+									 + strerror(errno));
+	}
+
+	for (int i=0; i < n; i++) {
+		ready.push_back(events[i].data.ptr);
+	}
+#else
+	std::vector<struct pollfd> &fds = myPollFds;
+	std::vector<void*> &data = myPollData;
+	fds.clear();
+	data.clear();
+
+	for (size_t fd=0; fd < myEntries.size(); fd++) {
+		if (!myEntries[fd].watched) {
+			continue;
+		}
+		struct pollfd p;
+		p.fd = static_cast<int>(fd);
+		p.events = ((myEntries[fd].events & INPUT)? POLLIN : 0)
+			| ((myEntries[fd].events & OUTPUT)? POLLOUT : 0);
+		p.revents = 0;
+		fds.push_back(p);
+		data.push_back(myEntries[fd].data);
+	}
+
+	int n;
+	do {
+		n = poll(&fds[0], fds.size(), timeout);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		throw tcpip::SocketException(std::string("Reactor @ poll: ")
+									 + strerror(errno));
+	}
+
+	for (size_t i=0; i < fds.size(); i++) {
+		if (fds[i].revents != 0) {
+			ready.push_back(data[i]);
+		}
+	}
+#endif
+
+	return static_cast<int>(ready.size());
+}
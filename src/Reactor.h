@@ -0,0 +1,95 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <vector>
+#ifndef __linux__
+	#include <poll.h>
+#endif
+
+#include "tcpip/socket.h"
+
+/** \brief Waits for readiness on a set of file descriptors.
+ *
+ * Each registered descriptor is associated with an opaque pointer,
+ * which is what wait(std::vector<void*>&, int) reports back when the
+ * descriptor becomes readable or writable, as asked (or is hung up,
+ * or in error).
+ *
+ * Uses epoll on Linux, and falls back to poll elsewhere. Adding and
+ * removing a descriptor that was watched before doesn't allocate memory.
+ */
+class Reactor {
+
+ public:
+	/// What a descriptor is watched for
+	enum Events {
+		INPUT = 1,
+		OUTPUT = 2
+	};
+
+	Reactor() throw( tcpip::SocketException );
+
+	virtual ~Reactor();
+
+	/** \brief Starts watching a descriptor, or changes how it's watched.
+	 *
+	 * Adding a descriptor again as it's already watched does nothing.
+	 *
+	 * \param fd The descriptor to watch
+	 * \param data The pointer reported when fd is ready
+	 * \param events What fd is watched for (INPUT, OUTPUT or both)
+	 */
+	void add(int fd, void *data, int events=INPUT) throw( tcpip::SocketException );
+
+	/** \brief Stops watching a descriptor.
+	 *
+	 * It's safe to call with a descriptor that was already closed
+	 * or never added.
+	 */
+	void remove(int fd);
+
+	/// Determines if the descriptor is being watched
+	bool contains(int fd) const;
+
+	/// Number of descriptors being watched
+	int size() const;
+
+	/** \brief Waits until some registered descriptor is ready.
+	 *
+	 * \param[out] ready Receives the pointers of all ready descriptors
+	 * \param timeout Maximum time to wait in ms, -1 waits indefinitely
+	 *
+	 * \return The number of ready descriptors (0 on timeout)
+	 */
+	int wait(std::vector<void*> &ready, int timeout=-1)
+		throw( tcpip::SocketException );
+
+ private:
+	/// A descriptor that may be registered
+	struct Entry {
+		bool watched;
+		void *data;
+		int events;
+	};
+
+	/// The entries of all descriptors up to the highest ever added
+	std::vector<Entry> myEntries;
+
+	/// Number of watched entries
+	int myCount;
+
+	/// The epoll instance (-1 when using poll)
+	int myPollFd;
+
+#ifndef __linux__
+	/// The descriptors given to poll, and their pointers
+	std::vector<struct pollfd> myPollFds;
+	std::vector<void*> myPollData;
+#endif
+
+	// Not copyable (owns myPollFd)
+	Reactor(const Reactor &);
+	Reactor &operator=(const Reactor &);
+};
+
+#endif /* REACTOR_H */
@@ -0,0 +1,127 @@
+#include <algorithm>
+
+#include "ResponseCache.h"
+
+namespace {
+
+	/// Entries kept across invalidations before the stale ones are discarded
+	const std::size_t MAX_ENTRIES = 4096;
+
+	/// Longer answers aren't given room in every buffer they're looked up into
+	const std::size_t MAX_RESERVED_ANSWER = 4096;
+
+}
+
+ResponseCache::ResponseCache() :
+	myAnswers(),
+	myGeneration(1),
+	myEvictedGeneration(1),
+	myEvictionSize(MAX_ENTRIES),
+	myKey(),
+	myLongestAnswer(0),
+	myHits(0),
+	myMisses(0),
+	mySavedExchanges(0)
+{
+	// No further initialization needed
+}
+
+ResponseCache::~ResponseCache()
+{
+	// No destruction required
+}
+
+
+bool ResponseCache::lookup(const unsigned char *command, unsigned int length,
+						   std::vector<unsigned char> &answer)
+{
+	myKey.assign(reinterpret_cast<const char*>(command), length);
+
+	std::map<std::string, Entry>::const_iterator it;
+	it = myAnswers.find(myKey);
+
+	if (it == myAnswers.end() || it->second.generation != myGeneration) {
+		myMisses++;
+		return false;
+	}
+
+	myHits++;
+	if (answer.capacity() < myLongestAnswer) {
+		answer.reserve(myLongestAnswer);
+	}
+	answer.assign(it->second.answer.begin(), it->second.answer.end());
+	return true;
+}
+
+void ResponseCache::store(const unsigned char *command, unsigned int length,
+						  const unsigned char *answer, unsigned int answerLength)
+{
+	myKey.assign(reinterpret_cast<const char*>(command), length);
+
+	Entry &entry = myAnswers[myKey];
+	entry.answer.assign(answer, answer + answerLength);
+	entry.generation = myGeneration;
+
+	if (answerLength > myLongestAnswer && answerLength <= MAX_RESERVED_ANSWER) {
+		myLongestAnswer = answerLength;
+	}
+}
+
+void ResponseCache::invalidate()
+{
+	myGeneration++;
+
+	if (myAnswers.size() > myEvictionSize) {
+		evict();
+	}
+}
+
+void ResponseCache::countHit()
+{
+	myHits++;
+}
+
+void ResponseCache::countSavedExchange()
+{
+	mySavedExchanges++;
+}
+
+
+void ResponseCache::evict()
+{
+	// Only the queries not answered since the last eviction are discarded
+	std::map<std::string, Entry>::iterator it = myAnswers.begin();
+	while (it != myAnswers.end()) {
+		if (it->second.generation < myEvictedGeneration) {
+			myAnswers.erase(it++);
+		} else {
+			it++;
+		}
+	}
+	myEvictedGeneration = myGeneration;
+
+	// The queries asked regularly may exceed the limit, evictions stay rare then
+	myEvictionSize = std::max(MAX_ENTRIES, 2 * myAnswers.size());
+}
+
+unsigned long ResponseCache::hits() const
+{
+	return myHits;
+}
+
+unsigned long ResponseCache::misses() const
+{
+	return myMisses;
+}
+
+void ResponseCache::printStatistics(std::ostream &out) const
+{
+	unsigned long total = myHits + myMisses;
+
+	out << "Response cache: " << myHits << " hits out of " << total
+		<< " queries";
+	if (total > 0) {
+		out << " (" << (100 * myHits / total) << "%)";
+	}
+	out << ", " << mySavedExchanges << " exchanges with SUMO saved";
+}
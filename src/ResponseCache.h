@@ -0,0 +1,105 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+
+/** \brief Keeps the answers to CMD_GET_*_VARIABLE commands.
+ *
+ * Answers are identified by the bytes of the command (its code, the
+ * variable, the object id and any parameter), so the same query from
+ * different clients is only sent to SUMO once.
+ *
+ * The cached answers are only valid while the simulation doesn't change:
+ * invalidate() must be called on every step and whenever a command that
+ * may change the simulation is forwarded.
+ *
+ * Invalidated entries are kept and overwritten when the same query is
+ * answered again, so their buffers are reused every step. Beyond a
+ * limit, the entries not answered again since the last eviction are
+ * discarded, so the queries asked regularly keep theirs.
+ */
+class ResponseCache {
+
+ public:
+	ResponseCache();
+
+	virtual ~ResponseCache();
+
+	/** \brief Looks for the answer to a command.
+	 *
+	 * Counts a hit or a miss.
+	 *
+	 * \param[in] command The bytes of the command, after its size
+	 * \param[in] length Number of bytes in command
+	 * \param[out] answer Receives the answer bytes, when found (given the
+	 *     room of the longest answer stored at once, so a buffer reused
+	 *     for other queries stops growing)
+	 *
+	 * \return true iff the answer was found
+	 */
+	bool lookup(const unsigned char *command, unsigned int length,
+				std::vector<unsigned char> &answer);
+
+	/** \brief Records the answer to a command.
+	 *
+	 * \param command The bytes of the command, after its size
+	 * \param length Number of bytes in command
+	 * \param answer The bytes of the answer (status and response)
+	 * \param answerLength Number of bytes in answer
+	 */
+	void store(const unsigned char *command, unsigned int length,
+			   const unsigned char *answer, unsigned int answerLength);
+
+	/// Discards all answers
+	void invalidate();
+
+	/// Counts a query answered without a lookup (the same query was just forwarded)
+	void countHit();
+
+	/// Counts a message answered without contacting SUMO
+	void countSavedExchange();
+
+	/// Number of commands answered from the cache
+	unsigned long hits() const;
+
+	/// Number of cacheable commands sent to SUMO
+	unsigned long misses() const;
+
+	/// Writes the hit rate and the exchanges saved, in a single line (not ended)
+	void printStatistics(std::ostream &out) const;
+
+ private:
+	/// An answer and the generation in which it was stored
+	struct Entry {
+		std::vector<unsigned char> answer;
+		unsigned long generation;
+	};
+
+	/// The answers, indexed by the command bytes
+	std::map<std::string, Entry> myAnswers;
+
+	/// Only entries of the current generation are valid
+	unsigned long myGeneration;
+
+	/// The generation of the last eviction, and the size that causes the next one
+	unsigned long myEvictedGeneration;
+	std::size_t myEvictionSize;
+
+	/// The key being looked up (kept to reuse its buffer)
+	std::string myKey;
+
+	/// Length of the longest answer stored, up to MAX_RESERVED_ANSWER
+	std::size_t myLongestAnswer;
+
+	unsigned long myHits;
+	unsigned long myMisses;
+	unsigned long mySavedExchanges;
+
+	/// Discards the entries not stored since the last eviction
+	void evict();
+};
+
+#endif /* RESPONSECACHE_H */
@@ -0,0 +1,36 @@
+#include "SharedBuffer.h"
+
+SharedBuffer::SharedBuffer() :
+	myStorage(),
+	myReferences(1)
+{
+	// No further initialization needed
+}
+
+SharedBuffer::~SharedBuffer()
+{
+	// No destruction required
+}
+
+
+tcpip::Storage &SharedBuffer::storage()
+{
+	return myStorage;
+}
+
+void SharedBuffer::acquire()
+{
+	__sync_fetch_and_add(&myReferences, 1);
+}
+
+void SharedBuffer::release()
+{
+	if (__sync_sub_and_fetch(&myReferences, 1) == 0) {
+		delete this;
+	}
+}
+
+bool SharedBuffer::isShared()
+{
+	return __sync_fetch_and_add(&myReferences, 0) > 1;
+}
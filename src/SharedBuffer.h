@@ -0,0 +1,44 @@
+#ifndef SHAREDBUFFER_H
+#define SHAREDBUFFER_H
+
+#include "tcpip/storage.h"
+
+/** \brief Bytes written once, then read by several owners until the last releases them.
+ *
+ * Holds the answer to a step, which the clients send (or queue, see
+ * OutboundQueue) without copying it. References are counted atomically,
+ * so the threads serving the clients may release them (see ClientWorkers).
+ * The bytes must not change while the buffer is shared.
+ */
+class SharedBuffer {
+
+ public:
+	/// Creates an empty buffer, with the reference of its creator
+	SharedBuffer();
+
+	/// The bytes, only written while the buffer isn't shared
+	tcpip::Storage &storage();
+
+	/// Adds a reference
+	void acquire();
+
+	/// Removes a reference, destroying the buffer with the last one
+	void release();
+
+	/// Determines if there are other references than the caller's
+	bool isShared();
+
+ private:
+	tcpip::Storage myStorage;
+
+	int myReferences;
+
+	/// Only release() destroys it
+	~SharedBuffer();
+
+	// Not copyable (counts its references)
+	SharedBuffer(const SharedBuffer &);
+	SharedBuffer &operator=(const SharedBuffer &);
+};
+
+#endif /* SHAREDBUFFER_H */
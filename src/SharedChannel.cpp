@@ -0,0 +1,557 @@
+#ifdef __linux__
+	#ifndef _GNU_SOURCE
+		#define _GNU_SOURCE
+	#endif
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "SharedChannel.h"
+
+namespace {
+
+	/// Identifies the memory created by a compatible SharedChannel
+	const unsigned int MAGIC = 0x54524831;
+
+	/// Decodes the length of a TraCI message
+	unsigned int readLength(const unsigned char *bytes)
+	{
+		return (static_cast<unsigned int>(bytes[0]) << 24) | (bytes[1] << 16)
+			| (bytes[2] << 8) | bytes[3];
+	}
+
+	/// Creates the shared memory, only reachable through the descriptor
+	int createMemory()
+	{
+#ifdef __linux__
+		return memfd_create("tracihub", 0);
+#else
+		char name[64];
+		snprintf(name, sizeof(name), "/tracihub-%ld-%p", static_cast<long>(getpid()),
+				 static_cast<void*>(&name));
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			shm_unlink(name);
+		}
+		return fd;
+#endif
+	}
+
+}
+
+const std::size_t SharedChannel::RING_SIZE = 1 << 20;
+
+SharedChannel::SharedChannel() :
+	mySocket(-1),
+	mySide(0),
+	myHeader(NULL),
+	myHeaderSize(0),
+	myRingSize(0),
+	myViewed(0),
+	myLarge(),
+	myLargeLength(0),
+	myPeerClosed(false)
+{
+	myData[0] = myData[1] = NULL;
+}
+
+SharedChannel::~SharedChannel()
+{
+	close();
+}
+
+
+void SharedChannel::create(int socket) throw( tcpip::SocketException )
+{
+	int fd = createMemory();
+	if (fd < 0) {
+		fail("SharedChannel::create() @ memory");
+	}
+
+	std::size_t pageSize = sysconf(_SC_PAGESIZE);
+	std::size_t size = (sizeof(Header) + pageSize - 1) / pageSize * pageSize
+		+ 2 * RING_SIZE;
+	if (ftruncate(fd, size) < 0) {
+		int error = errno;
+		::close(fd);
+		errno = error;
+		fail("SharedChannel::create() @ ftruncate");
+	}
+
+	// The other side finds the ring size in the header
+	Header *header = static_cast<Header*>(mmap(NULL, sizeof(Header), PROT_READ | PROT_WRITE,
+											   MAP_SHARED, fd, 0));
+	if (header == MAP_FAILED) {
+		int error = errno;
+		::close(fd);
+		errno = error;
+		fail("SharedChannel::create() @ mmap");
+	}
+	memset(header, 0, sizeof(Header));
+	header->magic = MAGIC;
+	header->ringSize = RING_SIZE;
+	munmap(header, sizeof(Header));
+
+	// Pass the descriptor along with a single byte
+	char byte = 0;
+	struct iovec payload = { &byte, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &payload;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+	rights->cmsg_level = SOL_SOCKET;
+	rights->cmsg_type = SCM_RIGHTS;
+	rights->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(rights), &fd, sizeof(int));
+
+	try {
+		mySocket = socket;
+		mySide = 0;
+		map(fd);
+
+		ssize_t sent;
+		do {
+			sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+		} while (sent < 0 && errno == EINTR);
+		if (sent < 0) {
+			fail("SharedChannel::create() @ sendmsg");
+		}
+	}
+	catch (tcpip::SocketException) {
+		::close(fd);
+		close();
+		throw;
+	}
+
+	::close(fd);
+}
+
+void SharedChannel::attach(int socket) throw( tcpip::SocketException )
+{
+	char byte;
+	struct iovec payload = { &byte, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &payload;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t received;
+	do {
+		received = recvmsg(socket, &message, 0);
+	} while (received < 0 && errno == EINTR);
+
+	if (received < 0) {
+		fail("SharedChannel::attach() @ recvmsg");
+	}
+
+	struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+	if (received == 0 || rights == NULL || rights->cmsg_type != SCM_RIGHTS) {
+		throw tcpip::SocketException("SharedChannel::attach(): no shared memory received");
+	}
+
+	int fd;
+	memcpy(&fd, CMSG_DATA(rights), sizeof(int));
+
+	try {
+		mySocket = socket;
+		mySide = 1;
+		map(fd);
+	}
+	catch (tcpip::SocketException) {
+		::close(fd);
+		close();
+		throw;
+	}
+
+	::close(fd);
+}
+
+bool SharedChannel::isOpen() const
+{
+	return myHeader != NULL;
+}
+
+void SharedChannel::close()
+{
+	for (int i=0; i < 2; i++) {
+		if (myData[i] != NULL) {
+			munmap(myData[i], 2 * myRingSize);
+			myData[i] = NULL;
+		}
+	}
+
+	if (myHeader != NULL) {
+		munmap(myHeader, myHeaderSize);
+		myHeader = NULL;
+	}
+
+	mySocket = -1;
+	myViewed = 0;
+	myLargeLength = 0;
+	myPeerClosed = false;
+}
+
+
+void SharedChannel::send(const tcpip::Segment *segments, int count)
+	throw( tcpip::SocketException )
+{
+	if (!isOpen()) {
+		return;
+	}
+
+	Ring &ring = myHeader->rings[mySide];
+	unsigned char *data = myData[mySide];
+	unsigned int size = static_cast<unsigned int>(myRingSize);
+
+	// The length goes first, as one more segment
+	unsigned int total = 4;
+	for (int i=0; i < count; i++) {
+		total += static_cast<unsigned int>(segments[i].length);
+	}
+	unsigned char length[4] = { static_cast<unsigned char>(total >> 24),
+								static_cast<unsigned char>(total >> 16),
+								static_cast<unsigned char>(total >> 8),
+								static_cast<unsigned char>(total) };
+
+	unsigned int head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	for (int i=-1; i < count; i++) {
+		const unsigned char *bytes = (i < 0)? length : segments[i].data;
+		std::size_t remaining = (i < 0)? 4 : segments[i].length;
+
+		while (remaining > 0) {
+			unsigned int tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+			unsigned int room = size - (head - tail);
+
+			// Let the other side read what's written so far, and wait for it
+			if (room == 0) {
+				__atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+				wakePeer();
+				if (!sleep(&ring.tail, tail)) {
+					throw tcpip::SocketException("SharedChannel: connection closed");
+				}
+				continue;
+			}
+
+			// The ring is mapped twice, any room is contiguous
+			unsigned int chunk = (remaining < room)? static_cast<unsigned int>(remaining) : room;
+			memcpy(data + head % size, bytes, chunk);
+			bytes += chunk;
+			remaining -= chunk;
+			head += chunk;
+		}
+	}
+
+	__atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+	wakePeer();
+}
+
+std::size_t SharedChannel::trySend(const tcpip::Segment *segments, int count)
+	throw( tcpip::SocketException )
+{
+	if (!isOpen()) {
+		return 0;
+	}
+
+	Ring &ring = myHeader->rings[mySide];
+	unsigned char *data = myData[mySide];
+	unsigned int size = static_cast<unsigned int>(myRingSize);
+
+	unsigned int head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	std::size_t sent = 0;
+	bool announced = false;
+	for (int i=0; i < count; i++) {
+		const unsigned char *bytes = segments[i].data;
+		std::size_t remaining = segments[i].length;
+
+		while (remaining > 0) {
+			// Sequentially consistent, it's checked again after the announcement
+			unsigned int tail = __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST);
+			unsigned int room = size - (head - tail);
+
+			// Ask for a wakeup once there's room, unless some appeared meanwhile
+			if (room == 0) {
+				if (announced) {
+					__atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+					wakePeer();
+					return sent;
+				}
+
+				if (myPeerClosed) {
+					throw tcpip::SocketException("SharedChannel: connection closed");
+				}
+				__atomic_store_n(&myHeader->sleeping[mySide], 1, __ATOMIC_SEQ_CST);
+				announced = true;
+				continue;
+			}
+
+			unsigned int chunk = (remaining < room)? static_cast<unsigned int>(remaining) : room;
+			memcpy(data + head % size, bytes, chunk);
+			bytes += chunk;
+			remaining -= chunk;
+			head += chunk;
+			sent += chunk;
+		}
+	}
+
+	if (announced) {
+		__atomic_store_n(&myHeader->sleeping[mySide], 0, __ATOMIC_SEQ_CST);
+	}
+
+	__atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+	wakePeer();
+	return sent;
+}
+
+void SharedChannel::takeWakeups() throw( tcpip::SocketException )
+{
+	if (isOpen() && !drain()) {
+		myPeerClosed = true;
+	}
+}
+
+bool SharedChannel::tryReceiveView(const unsigned char *&data, std::size_t &length)
+	throw( tcpip::SocketException )
+{
+	if (!isOpen()) {
+		throw tcpip::SocketException("SharedChannel::tryReceiveView(): closed");
+	}
+
+	release();
+	if (takeMessage(data, length)) {
+		return true;
+	}
+
+	// Ask for a wakeup, unless something arrived meanwhile
+	__atomic_store_n(&myHeader->sleeping[mySide], 1, __ATOMIC_SEQ_CST);
+
+	if (takeMessage(data, length)) {
+		__atomic_store_n(&myHeader->sleeping[mySide], 0, __ATOMIC_SEQ_CST);
+		return true;
+	}
+
+	if (myPeerClosed) {
+		throw tcpip::SocketException("SharedChannel: connection closed");
+	}
+	return false;
+}
+
+void SharedChannel::receiveView(const unsigned char *&data, std::size_t &length)
+	throw( tcpip::SocketException )
+{
+	if (!isOpen()) {
+		throw tcpip::SocketException("SharedChannel::receiveView(): closed");
+	}
+
+	release();
+
+	Ring &ring = myHeader->rings[1 - mySide];
+	while (true) {
+		unsigned int head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+		if (takeMessage(data, length)) {
+			return;
+		}
+
+		// Messages written before closing are still taken
+		if (!sleep(&ring.head, head) && !takeMessage(data, length)) {
+			throw tcpip::SocketException("SharedChannel: connection closed");
+		}
+	}
+}
+
+
+void SharedChannel::map(int fd) throw( tcpip::SocketException )
+{
+	std::size_t pageSize = sysconf(_SC_PAGESIZE);
+	myHeaderSize = (sizeof(Header) + pageSize - 1) / pageSize * pageSize;
+
+	void *header = mmap(NULL, myHeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		fail("SharedChannel::map() @ mmap");
+	}
+	myHeader = static_cast<Header*>(header);
+
+	if (myHeader->magic != MAGIC || myHeader->ringSize == 0
+		|| myHeader->ringSize % pageSize != 0) {
+		throw tcpip::SocketException("SharedChannel::map(): invalid shared memory");
+	}
+	myRingSize = myHeader->ringSize;
+
+	// Reserve twice the size of each ring, then map the ring on both halves
+	for (int i=0; i < 2; i++) {
+		void *area = mmap(NULL, 2 * myRingSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (area == MAP_FAILED) {
+			fail("SharedChannel::map() @ mmap");
+		}
+		myData[i] = static_cast<unsigned char*>(area);
+
+		off_t offset = myHeaderSize + i * myRingSize;
+		for (int half=0; half < 2; half++) {
+			if (mmap(myData[i] + half * myRingSize, myRingSize, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+				fail("SharedChannel::map() @ mmap");
+			}
+		}
+	}
+}
+
+bool SharedChannel::takeMessage(const unsigned char *&data, std::size_t &length)
+	throw( tcpip::SocketException )
+{
+	Ring &ring = myHeader->rings[1 - mySide];
+	const unsigned char *bytes = myData[1 - mySide];
+	unsigned int size = static_cast<unsigned int>(myRingSize);
+
+	unsigned int tail = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+	// Sequentially consistent, it's checked again after asking for a wakeup
+	unsigned int head = __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST);
+
+	if (myLargeLength == 0) {
+		if (head - tail < 4) {
+			return false;
+		}
+
+		unsigned int total = readLength(bytes + tail % size);
+		if (total < 4) {
+			throw tcpip::SocketException("SharedChannel: invalid message length");
+		}
+
+		// Read in place once complete
+		if (total <= size) {
+			if (head - tail < total) {
+				return false;
+			}
+
+			data = bytes + tail % size + 4;
+			length = total - 4;
+			myViewed = total;
+			return true;
+		}
+
+		myLarge.clear();
+		myLargeLength = total;
+	}
+
+	// A message larger than the ring is copied out as it's written
+	unsigned int available = head - tail;
+	std::size_t missing = myLargeLength - myLarge.size();
+	unsigned int chunk = (available < missing)? available : static_cast<unsigned int>(missing);
+	if (chunk > 0) {
+		myLarge.insert(myLarge.end(), bytes + tail % size, bytes + tail % size + chunk);
+
+		__atomic_store_n(&ring.tail, tail + chunk, __ATOMIC_RELEASE);
+		wakePeer();
+	}
+
+	if (myLarge.size() < myLargeLength) {
+		return false;
+	}
+
+	data = &myLarge[4];
+	length = myLargeLength - 4;
+	myLargeLength = 0;
+	return true;
+}
+
+void SharedChannel::release()
+{
+	if (myViewed == 0) {
+		return;
+	}
+
+	Ring &ring = myHeader->rings[1 - mySide];
+	unsigned int tail = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring.tail, tail + myViewed, __ATOMIC_RELEASE);
+	myViewed = 0;
+
+	wakePeer();
+}
+
+void SharedChannel::wakePeer()
+{
+	// Sequentially consistent with the announcement, which is followed by a check
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&myHeader->sleeping[1 - mySide], 0, __ATOMIC_SEQ_CST) == 1) {
+		char byte = 0;
+		while (::send(mySocket, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno == EINTR) {
+		}
+	}
+}
+
+bool SharedChannel::sleep(unsigned int *word, unsigned int seen)
+	throw( tcpip::SocketException )
+{
+	__atomic_store_n(&myHeader->sleeping[mySide], 1, __ATOMIC_SEQ_CST);
+
+	// Changed before the announcement, there won't be a wakeup
+	if (__atomic_load_n(word, __ATOMIC_SEQ_CST) != seen) {
+		__atomic_store_n(&myHeader->sleeping[mySide], 0, __ATOMIC_SEQ_CST);
+		return true;
+	}
+
+	struct pollfd watched;
+	watched.fd = mySocket;
+	watched.events = POLLIN;
+	watched.revents = 0;
+	while (poll(&watched, 1, -1) < 0) {
+		if (errno != EINTR) {
+			fail("SharedChannel::sleep() @ poll");
+		}
+	}
+
+	return drain();
+}
+
+bool SharedChannel::drain() throw( tcpip::SocketException )
+{
+	char bytes[64];
+	while (true) {
+		ssize_t received = recv(mySocket, bytes, sizeof(bytes), MSG_DONTWAIT);
+		if (received > 0) {
+			continue;
+		}
+		if (received == 0) {
+			return false;
+		}
+
+		switch (errno) {
+		case EINTR:
+			continue;
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			return true;
+		case ECONNRESET:
+		case EPIPE:
+			return false;
+		default:
+			fail("SharedChannel::drain() @ recv");
+		}
+	}
+}
+
+void SharedChannel::fail(const char *context) throw( tcpip::SocketException )
+{
+	throw tcpip::SocketException(std::string(context) + ": " + strerror(errno));
+}
@@ -0,0 +1,179 @@
+#ifndef SHAREDCHANNEL_H
+#define SHAREDCHANNEL_H
+
+#include <cstddef>
+#include <vector>
+
+#include "tcpip/socket.h"
+
+/** \brief Exchanges TraCI messages through shared memory.
+ *
+ * Two single-producer single-consumer rings, one for each direction,
+ * live in memory shared by the hub and a client on the same host.
+ * Messages are written by the sender and read in place by the
+ * receiver, without going through the kernel.
+ *
+ * The channel is set up over a connected Unix domain socket, which
+ * passes the shared memory (see create(int) and attach(int)) and then
+ * only carries wakeups: like in Mailbox, a byte is written only when
+ * the other end sleeps waiting for a message or for room. The socket
+ * remains what a Reactor watches, and closing it closes the channel.
+ *
+ * Each ring is mapped twice in a row, so a message that fits in it is
+ * always read as contiguous bytes. Larger messages are copied out
+ * while they are written.
+ *
+ * Copying is only meant for a closed channel (e.g. inside a Client).
+ */
+class SharedChannel {
+
+ public:
+	/// Bytes in each ring
+	static const std::size_t RING_SIZE;
+
+	SharedChannel();
+
+	virtual ~SharedChannel();
+
+	/** \brief Creates the rings and passes them to the other end (the hub's side).
+	 *
+	 * \param socket A connected Unix domain socket, not owned
+	 */
+	void create(int socket) throw( tcpip::SocketException );
+
+	/** \brief Maps the rings passed by the other end (the client's side).
+	 *
+	 * \param socket A connected Unix domain socket, not owned
+	 */
+	void attach(int socket) throw( tcpip::SocketException );
+
+	/// Determines if the rings are mapped
+	bool isOpen() const;
+
+	/// Unmaps the rings (the socket is left open)
+	void close();
+
+	/** \brief Sends a TraCI message made of several segments.
+	 *
+	 * The length is prefixed. Waits for room while the other end
+	 * hasn't read the earlier messages, so the hub's side uses
+	 * trySend(const tcpip::Segment*, int) instead.
+	 */
+	void send(const tcpip::Segment *segments, int count) throw( tcpip::SocketException );
+
+	/** \brief Sends the bytes of several segments, as many as fit without waiting.
+	 *
+	 * Nothing is framed, like tcpip::Socket::trySend(const tcpip::Segment*,
+	 * int). When the ring is full, the other end is asked to wake this one
+	 * up through the socket once it makes room (see takeWakeups()).
+	 *
+	 * \return The number of bytes sent
+	 */
+	std::size_t trySend(const tcpip::Segment *segments, int count)
+		throw( tcpip::SocketException );
+
+	/** \brief Consumes the wakeups received, without waiting.
+	 *
+	 * trySend(const tcpip::Segment*, int) and tryReceiveView() only ask
+	 * for a wakeup: room and messages are signalled alike, so both are
+	 * tried again after this, before waiting for the socket.
+	 */
+	void takeWakeups() throw( tcpip::SocketException );
+
+	/** \brief Receives a complete message only if available, without copying it.
+	 *
+	 * When there's none, the other end is asked to wake this one up
+	 * through the socket once it sends something (see takeWakeups()).
+	 *
+	 * The bytes (after the length) are valid until the next call that
+	 * receives, which is also when their room is given back.
+	 *
+	 * \return true iff a complete message was located
+	 */
+	bool tryReceiveView(const unsigned char *&data, std::size_t &length)
+		throw( tcpip::SocketException );
+
+	/// Receives a complete message, waiting for it (see tryReceiveView)
+	void receiveView(const unsigned char *&data, std::size_t &length)
+		throw( tcpip::SocketException );
+
+ private:
+	/// The positions in a ring, as byte counts that wrap around (atomic)
+	struct Ring {
+		unsigned int head;
+		char headPadding[60];
+		unsigned int tail;
+		char tailPadding[60];
+	};
+
+	/// The beginning of the shared memory
+	struct Header {
+		unsigned int magic;
+		unsigned int ringSize;
+
+		/// Whether each side waits for a wakeup (see Mailbox::sleep(), atomic)
+		int sleeping[2];
+		char padding[48];
+
+		/// From the hub to the client, and from the client to the hub
+		Ring rings[2];
+	};
+
+	/// The socket that passed the memory and carries wakeups (-1 if closed)
+	int mySocket;
+
+	/// 0 on the hub's side, 1 on the client's (the ring it writes)
+	int mySide;
+
+	/// The shared memory, and the data of each ring (mapped twice)
+	Header *myHeader;
+	unsigned char *myData[2];
+
+	/// Bytes mapped for the header, and in each ring
+	std::size_t myHeaderSize;
+	std::size_t myRingSize;
+
+	/// Length of the message last viewed, given back by the next receive
+	unsigned int myViewed;
+
+	/// A message larger than the ring, length included, while copied
+	std::vector<unsigned char> myLarge;
+
+	/// Length of the message in myLarge (0 if none is being copied)
+	std::size_t myLargeLength;
+
+	/// Whether takeWakeups() found the socket closed by the other side
+	bool myPeerClosed;
+
+	/// Maps the header and the rings of the shared memory in fd
+	void map(int fd) throw( tcpip::SocketException );
+
+	/// Locates the next complete message, copying it if it's too large
+	bool takeMessage(const unsigned char *&data, std::size_t &length)
+		throw( tcpip::SocketException );
+
+	/// Gives back the room of the message last viewed
+	void release();
+
+	/// Wakes up the other side if it sleeps
+	void wakePeer();
+
+	/** \brief Sleeps until the other side changes the value in \p word from \p seen
+	 *
+	 * \return false if the other side closed the socket
+	 */
+	bool sleep(unsigned int *word, unsigned int seen)
+		throw( tcpip::SocketException );
+
+	/** \brief Consumes the wakeups received
+	 *
+	 * \return false if the other side closed the socket (what it
+	 *     wrote before may still be read)
+	 */
+	bool drain() throw( tcpip::SocketException );
+
+	/// Throws a SocketException describing errno
+	static void fail(const char *context) throw( tcpip::SocketException );
+};
+
+#endif /* SHAREDCHANNEL_H */
@@ -0,0 +1,75 @@
+#include "SharedClient.h"
+
+namespace {
+
+	/// The endpoint of a Unix domain socket
+	tcpip::Endpoint unixEndpoint(const std::string &path)
+	{
+		tcpip::Endpoint endpoint;
+		endpoint.port = 0;
+		endpoint.path = path;
+		endpoint.sharedMemory = true;
+		return endpoint;
+	}
+
+}
+
+SharedClient::SharedClient(const std::string &path) :
+	mySocket(unixEndpoint(path)),
+	myChannel()
+{
+	// No further initialization needed
+}
+
+SharedClient::~SharedClient()
+{
+	close();
+}
+
+
+void SharedClient::connect() throw( tcpip::SocketException )
+{
+	mySocket.connect();
+
+	try {
+		myChannel.attach(mySocket.fd());
+	}
+	catch (tcpip::SocketException) {
+		mySocket.close();
+		throw;
+	}
+}
+
+void SharedClient::sendExact(const tcpip::Storage &message) throw( tcpip::SocketException )
+{
+	tcpip::Segment body = { message.data(), message.size() };
+	myChannel.send(&body, 1);
+}
+
+bool SharedClient::receiveExact(tcpip::Storage &message) throw( tcpip::SocketException )
+{
+	const unsigned char *data;
+	std::size_t length;
+	receiveView(data, length);
+
+	message.reset();
+	message.writePacket(data, static_cast<int>(length));
+	return true;
+}
+
+void SharedClient::receiveView(const unsigned char *&data, std::size_t &length)
+	throw( tcpip::SocketException )
+{
+	myChannel.receiveView(data, length);
+}
+
+void SharedClient::close()
+{
+	myChannel.close();
+	mySocket.close();
+}
+
+bool SharedClient::isConnected() const
+{
+	return myChannel.isOpen();
+}
@@ -0,0 +1,68 @@
+#ifndef SHAREDCLIENT_H
+#define SHAREDCLIENT_H
+
+#include <string>
+
+#include "tcpip/socket.h"
+#include "tcpip/storage.h"
+
+#include "SharedChannel.h"
+
+/** \brief Connects a TraCI client to the hub through shared memory.
+ *
+ * The other end of a client port given to the hub as shm:PATH. Offers
+ * the calls a TraCI client makes on tcpip::Socket, so it can replace it:
+ *
+ * \code
+ * SharedClient hub("/tmp/controller.sock");
+ * hub.connect();
+ * hub.sendExact(request);
+ * hub.receiveExact(answer);
+ * \endcode
+ *
+ * Built as libtracishm.a, to be linked along with the tcpip library.
+ */
+class SharedClient {
+
+ public:
+	/// Prepares to connect to the Unix domain socket at the given path
+	SharedClient(const std::string &path);
+
+	virtual ~SharedClient();
+
+	/// Connects to the hub and maps the shared memory it passes
+	void connect() throw( tcpip::SocketException );
+
+	/// Sends a TraCI message (the length is prefixed)
+	void sendExact(const tcpip::Storage &message) throw( tcpip::SocketException );
+
+	/// Receives a complete TraCI message, copying it (after the length)
+	bool receiveExact(tcpip::Storage &message) throw( tcpip::SocketException );
+
+	/** \brief Receives a complete TraCI message without copying it.
+	 *
+	 * The bytes (after the length) are valid until the next call that
+	 * receives.
+	 */
+	void receiveView(const unsigned char *&data, std::size_t &length)
+		throw( tcpip::SocketException );
+
+	/// Closes the connection
+	void close();
+
+	/// Determines if connected to the hub
+	bool isConnected() const;
+
+ private:
+	/// Sets up myChannel, then carries wakeups
+	tcpip::Socket mySocket;
+
+	/// Carries the messages
+	SharedChannel myChannel;
+
+	// Not copyable (owns the connection)
+	SharedClient(const SharedClient &);
+	SharedClient &operator=(const SharedClient &);
+};
+
+#endif /* SHAREDCLIENT_H */
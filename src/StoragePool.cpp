@@ -0,0 +1,64 @@
+#include "StoragePool.h"
+
+const std::size_t StoragePool::SHARED_CAPACITY = 1 << 16;
+
+StoragePool::StoragePool() :
+	myFree(),
+	myCreated(0),
+	myCapacity(0)
+{
+	// No further initialization needed
+}
+
+StoragePool::~StoragePool()
+{
+	std::vector<tcpip::Storage*>::iterator it;
+	for (it=myFree.begin(); it != myFree.end(); it++) {
+		delete *it;
+	}
+}
+
+
+tcpip::Storage *StoragePool::acquire()
+{
+	if (myFree.empty()) {
+		myCreated++;
+		return new tcpip::Storage();
+	}
+
+	tcpip::Storage *buffer = myFree.back();
+	myFree.pop_back();
+	if (buffer->capacity() < myCapacity) {
+		buffer->reserve(myCapacity);
+	}
+	return buffer;
+}
+
+void StoragePool::release(tcpip::Storage *buffer)
+{
+	buffer->reset();
+	myFree.push_back(buffer);
+
+	std::size_t capacity = buffer->capacity();
+	if (capacity > myCapacity) {
+		myCapacity = (capacity < SHARED_CAPACITY)? capacity : SHARED_CAPACITY;
+	}
+}
+
+unsigned int StoragePool::created() const
+{
+	return myCreated;
+}
+
+
+PooledStorage::PooledStorage(StoragePool &pool) :
+	myPool(pool),
+	myBuffer(pool.acquire())
+{
+	// No further initialization needed
+}
+
+PooledStorage::~PooledStorage()
+{
+	myPool.release(myBuffer);
+}
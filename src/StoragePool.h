@@ -0,0 +1,72 @@
+#ifndef STORAGEPOOL_H
+#define STORAGEPOOL_H
+
+#include <vector>
+
+#include "tcpip/storage.h"
+
+/** \brief Recycles the buffers used for messages.
+ *
+ * Released buffers are emptied but keep their allocated capacity, so once
+ * they have grown to the size of the messages exchanged, handling a step
+ * doesn't allocate memory anymore. A buffer acquired again is grown at
+ * once to the largest capacity seen (up to SHARED_CAPACITY), rather than
+ * each buffer growing whenever it happens to hold a larger message.
+ */
+class StoragePool {
+
+ public:
+	/// The largest capacity given to every buffer acquired
+	static const std::size_t SHARED_CAPACITY;
+
+	StoragePool();
+
+	/// Destroys the free buffers (all buffers must have been released)
+	virtual ~StoragePool();
+
+	/// Obtains an empty buffer, creating one if none is free
+	tcpip::Storage *acquire();
+
+	/// Returns a buffer obtained from acquire(), emptying it
+	void release(tcpip::Storage *buffer);
+
+	/// Number of buffers created so far
+	unsigned int created() const;
+
+ private:
+	/// The buffers available to acquire()
+	std::vector<tcpip::Storage*> myFree;
+
+	/// Number of buffers created
+	unsigned int myCreated;
+
+	/// The largest capacity of a buffer released, up to SHARED_CAPACITY
+	std::size_t myCapacity;
+
+	// Not copyable (owns the buffers)
+	StoragePool(const StoragePool &);
+	StoragePool &operator=(const StoragePool &);
+};
+
+/** \brief A buffer from a StoragePool, released when it goes out of scope.
+ */
+class PooledStorage {
+
+ public:
+	explicit PooledStorage(StoragePool &pool);
+
+	~PooledStorage();
+
+	tcpip::Storage &operator*() const { return *myBuffer; }
+	tcpip::Storage *operator->() const { return myBuffer; }
+
+ private:
+	StoragePool &myPool;
+	tcpip::Storage *myBuffer;
+
+	// Not copyable (releases the buffer)
+	PooledStorage(const PooledStorage &);
+	PooledStorage &operator=(const PooledStorage &);
+};
+
+#endif /* STORAGEPOOL_H */
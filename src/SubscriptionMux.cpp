@@ -0,0 +1,486 @@
+#include <algorithm>
+
+#include "TraCIConstants.h"
+#include "util.h"
+
+#include "SubscriptionMux.h"
+
+namespace {
+
+	/// Difference between the code of a subscription and of its results
+	const unsigned char RESPONSE_OFFSET =
+		RESPONSE_SUBSCRIBE_INDUCTIONLOOP_VARIABLE - CMD_SUBSCRIBE_INDUCTIONLOOP_VARIABLE;
+
+	/// The end time of a subscription that never ends
+	const int END_OF_TIME = 0x7fffffff;
+
+}
+
+SubscriptionMux::SubscriptionMux() :
+	mySubscriptions(),
+	myClientKeys(),
+	myChanges(),
+	myFirstChange(0),
+	myUpstream(),
+	myOrphans(),
+	myOrphansLeft(),
+	myStepAnswer(NULL),
+	myStepStatusLength(0),
+	myUnknownResults(),
+	myResultKey(),
+	myClientResults()
+{
+	// No further initialization needed
+}
+
+SubscriptionMux::~SubscriptionMux()
+{
+	// No destruction required
+}
+
+
+void SubscriptionMux::subscribe(const Client *client, const unsigned char *command,
+								unsigned int length, tcpip::Storage &upstream)
+	throw (std::invalid_argument)
+{
+	// Parse the command
+	unsigned int sizeLen = tcpip::commandSizeLength(command);
+	tcpip::Storage content(command + sizeLen, length - sizeLen);
+
+	ClientSubscription subscription;
+	subscription.client = client;
+
+	unsigned char code = content.readChar();
+	subscription.begin = content.readInt();
+	subscription.end = content.readInt();
+	Key key(code, content.readString());
+
+	int count = content.readUnsignedByte();
+	for (int i=0; i < count; i++) {
+		subscription.variables.push_back(content.readChar());
+	}
+
+	// Replace the previous subscription of the client, until SUMO answers
+	Subscription &merged = mySubscriptions[key];
+	std::vector<ClientSubscription>::iterator it;
+	for (it=merged.subscribers.begin(); it != merged.subscribers.end(); it++) {
+		if (it->client == client) {
+			break;
+		}
+	}
+
+	Change change;
+	change.client = client;
+	change.key = key;
+	change.existed = it != merged.subscribers.end();
+	if (change.existed) {
+		change.previous = *it;
+	}
+	myChanges.push_back(change);
+
+	if (count == 0) {
+		if (it != merged.subscribers.end()) {
+			merged.subscribers.erase(it);
+		}
+		myClientKeys[client].erase(key);
+	} else {
+		if (it != merged.subscribers.end()) {
+			*it = subscription;
+		} else {
+			merged.subscribers.push_back(subscription);
+		}
+		myClientKeys[client].insert(key);
+	}
+
+	if (merged.subscribers.empty()) {
+		mySubscriptions.erase(key);
+	} else {
+		myOrphans.erase(key);
+	}
+
+	writeMergedCommand(key, upstream);
+}
+
+void SubscriptionMux::rewriteSubscribeAnswer(const Client *client,
+											 const unsigned char *answer,
+											 unsigned int length,
+											 tcpip::Storage &out)
+	throw (std::invalid_argument)
+{
+	// The status is kept as is
+	tcpip::StatusResponse status = tcpip::readStatusResponse(answer, 0, length);
+	out.writePacket(answer, status.span.length);
+
+	// The change made by the subscription stays only if SUMO accepted it
+	size_t found;
+	for (found=myFirstChange; found < myChanges.size(); found++) {
+		if (myChanges[found].client == client) {
+			break;
+		}
+	}
+	if (found == myChanges.size()) {
+		throw std::invalid_argument("Answer to a subscription that wasn't made");
+	}
+
+	if (status.result != RTYPE_OK) {
+		undoChange(found);
+	}
+
+	// Changes are answered in order, the ones taken are dropped at once
+	myChanges[found].client = NULL;
+	while (myFirstChange < myChanges.size() && myChanges[myFirstChange].client == NULL) {
+		myFirstChange++;
+	}
+	if (myFirstChange == myChanges.size()) {
+		myChanges.clear();
+		myFirstChange = 0;
+	}
+
+	if (status.span.length == length) {
+		return;
+	}
+
+	// The result only goes if the client is still subscribed
+	Key key;
+	readResultKey(answer + status.span.length, length - status.span.length, key);
+
+	std::map<Key, Subscription>::const_iterator subscription = mySubscriptions.find(key);
+	if (subscription == mySubscriptions.end()) {
+		return;
+	}
+
+	std::vector<ClientSubscription>::const_iterator it;
+	for (it=subscription->second.subscribers.begin();
+		 it != subscription->second.subscribers.end(); it++) {
+		if (it->client == client) {
+			writeFilteredResult(answer + status.span.length, length - status.span.length,
+								it->variables, out);
+		}
+	}
+}
+
+void SubscriptionMux::readStepAnswer(const unsigned char *answer, unsigned int length,
+									 unsigned int statusLength) throw (std::invalid_argument)
+{
+	myStepAnswer = answer;
+	myUnknownResults.clear();
+
+	std::map<Key, Subscription>::iterator subscription;
+	for (subscription=mySubscriptions.begin(); subscription != mySubscriptions.end();
+		 subscription++) {
+		subscription->second.result = ResultBytes(0, 0);
+	}
+
+	myStepStatusLength = statusLength;
+
+	unsigned int offset = statusLength;
+	if (offset + 4 > length) {
+		throw std::invalid_argument("Step answer without subscription count");
+	}
+	int count = tcpip::readRawInt(answer + offset);
+	offset += 4;
+
+	// Index the results by subscription
+	for (int i=0; i < count; i++) {
+		tcpip::CommandSpan block = tcpip::readCommandSpan(answer, offset, length);
+
+		readResultKey(answer + offset, block.length, myResultKey);
+
+		subscription = mySubscriptions.find(myResultKey);
+		if (subscription != mySubscriptions.end()) {
+			subscription->second.result = ResultBytes(offset, block.length);
+		} else if (myOrphans.count(myResultKey) > 0) {
+			// Nobody subscribes anymore, not even someone unknown to the hub
+			myOrphansLeft.insert(myResultKey);
+		} else {
+			myUnknownResults.push_back(ResultBytes(offset, block.length));
+		}
+
+		offset += block.length;
+	}
+
+	// Orphans are forgotten once SUMO stops sending their results
+	myOrphans.swap(myOrphansLeft);
+	myOrphansLeft.clear();
+}
+
+void SubscriptionMux::writeStepAnswer(const Client *client, int currentTime,
+									  tcpip::Storage &out)
+{
+	// The status is kept as is
+	out.writePacket(myStepAnswer, myStepStatusLength);
+
+	// Rebuild the results of the client's subscriptions
+	tcpip::Storage &results = myClientResults;
+	results.reset();
+	int resultCount = 0;
+
+	std::map<const Client*, std::set<Key> >::const_iterator keys = myClientKeys.find(client);
+	if (keys != myClientKeys.end()) {
+		std::set<Key>::const_iterator key;
+		for (key=keys->second.begin(); key != keys->second.end(); key++) {
+			std::map<Key, Subscription>::const_iterator subscription = mySubscriptions.find(*key);
+			if (subscription == mySubscriptions.end()) {
+				continue;
+			}
+
+			const Subscription &merged = subscription->second;
+			if (merged.result.second == 0) {
+				continue;
+			}
+
+			std::vector<ClientSubscription>::const_iterator it;
+			for (it=merged.subscribers.begin(); it != merged.subscribers.end(); it++) {
+				if (it->client == client
+					&& it->begin <= currentTime && currentTime <= it->end) {
+					writeFilteredResult(myStepAnswer + merged.result.first,
+										merged.result.second, it->variables, results);
+					resultCount++;
+				}
+			}
+		}
+	}
+
+	// Results that can't be attributed go to everyone
+	std::vector<ResultBytes>::const_iterator unknown;
+	for (unknown=myUnknownResults.begin(); unknown != myUnknownResults.end(); unknown++) {
+		results.writePacket(myStepAnswer + unknown->first, unknown->second);
+		resultCount++;
+	}
+
+	out.writeInt(resultCount);
+	out.writeStorage(results);
+}
+
+void SubscriptionMux::removeClient(const Client *client)
+{
+	std::map<const Client*, std::set<Key> >::iterator keys = myClientKeys.find(client);
+	if (keys == myClientKeys.end()) {
+		return;
+	}
+
+	std::set<Key>::const_iterator key;
+	for (key=keys->second.begin(); key != keys->second.end(); key++) {
+		std::map<Key, Subscription>::iterator subscription = mySubscriptions.find(*key);
+		if (subscription == mySubscriptions.end()) {
+			continue;
+		}
+
+		Subscription &merged = subscription->second;
+
+		std::vector<ClientSubscription>::iterator it;
+		for (it=merged.subscribers.begin(); it != merged.subscribers.end(); it++) {
+			if (it->client == client) {
+				merged.subscribers.erase(it);
+				break;
+			}
+		}
+
+		// The others keep the rest, SUMO is told so before the next step
+		if (merged.subscribers.empty()) {
+			mySubscriptions.erase(*key);
+			myOrphans.insert(*key);
+		}
+		myUpstream.insert(*key);
+	}
+
+	myClientKeys.erase(keys);
+}
+
+bool SubscriptionMux::empty() const
+{
+	return mySubscriptions.empty() && myOrphans.empty();
+}
+
+bool SubscriptionMux::hasUpstream() const
+{
+	return !myUpstream.empty();
+}
+
+void SubscriptionMux::writeUpstream(tcpip::Storage &commands)
+{
+	std::set<Key>::const_iterator key;
+	for (key=myUpstream.begin(); key != myUpstream.end(); key++) {
+		writeMergedCommand(*key, commands);
+	}
+	myUpstream.clear();
+}
+
+
+void SubscriptionMux::undoChange(size_t index)
+{
+	const Change &change = myChanges[index];
+
+	// A later change of the same subscription now replaces the one before this
+	for (size_t i=index + 1; i < myChanges.size(); i++) {
+		if (myChanges[i].client == change.client && myChanges[i].key == change.key) {
+			myChanges[i].existed = change.existed;
+			myChanges[i].previous = change.previous;
+			return;
+		}
+	}
+
+	Subscription &merged = mySubscriptions[change.key];
+	std::vector<ClientSubscription>::iterator it;
+	for (it=merged.subscribers.begin(); it != merged.subscribers.end(); it++) {
+		if (it->client == change.client) {
+			break;
+		}
+	}
+
+	if (change.existed) {
+		if (it != merged.subscribers.end()) {
+			*it = change.previous;
+		} else {
+			merged.subscribers.push_back(change.previous);
+		}
+		myClientKeys[change.client].insert(change.key);
+	} else {
+		if (it != merged.subscribers.end()) {
+			merged.subscribers.erase(it);
+		}
+		myClientKeys[change.client].erase(change.key);
+	}
+
+	if (merged.subscribers.empty()) {
+		mySubscriptions.erase(change.key);
+		myOrphans.insert(change.key);
+	} else {
+		myOrphans.erase(change.key);
+	}
+
+	// SUMO may have dropped the subscription along with the change
+	myUpstream.insert(change.key);
+}
+
+void SubscriptionMux::writeMergedCommand(const Key &key, tcpip::Storage &out)
+{
+	// Nothing left to merge removes the subscription
+	std::map<Key, Subscription>::iterator found = mySubscriptions.find(key);
+	if (found == mySubscriptions.end()) {
+		tcpip::writeCommandSize(out, 1 + 4 + 4 + 4 + key.second.length() + 1);
+		out.writeUnsignedByte(key.first);
+		out.writeInt(0);
+		out.writeInt(END_OF_TIME);
+		out.writeString(key.second);
+		out.writeUnsignedByte(0);
+		return;
+	}
+
+	// Merge all subscriptions
+	Subscription &merged = found->second;
+	int begin = merged.subscribers.front().begin;
+	int end = merged.subscribers.front().end;
+	merged.variables.clear();
+
+	std::vector<ClientSubscription>::const_iterator it;
+	for (it=merged.subscribers.begin(); it != merged.subscribers.end(); it++) {
+		begin = std::min(begin, it->begin);
+		end = std::max(end, it->end);
+
+		std::vector<unsigned char>::const_iterator var;
+		for (var=it->variables.begin(); var != it->variables.end(); var++) {
+			if (std::find(merged.variables.begin(), merged.variables.end(), *var)
+				== merged.variables.end()) {
+				merged.variables.push_back(*var);
+			}
+		}
+	}
+
+	// Compose the merged command
+	tcpip::writeCommandSize(out, 1 + 4 + 4 + 4 + key.second.length()
+							+ 1 + merged.variables.size());
+	out.writeUnsignedByte(key.first);
+	out.writeInt(begin);
+	out.writeInt(end);
+	out.writeString(key.second);
+	out.writeUnsignedByte(merged.variables.size());
+	out.writePacket(merged.variables);
+}
+
+
+unsigned int SubscriptionMux::readResultHeader(const unsigned char *block,
+											   unsigned int length)
+	throw (std::invalid_argument)
+{
+	unsigned int pos = tcpip::commandSizeLength(block) + 1;
+
+	if (pos + 4 > length) {
+		throw std::invalid_argument("Subscription result without object id");
+	}
+	int idLength = tcpip::readRawInt(block + pos);
+	pos += 4;
+
+	if (idLength < 0 || static_cast<unsigned int>(idLength) + 1 > length - pos) {
+		throw std::invalid_argument("Subscription result without variables");
+	}
+
+	return pos + idLength;
+}
+
+unsigned int SubscriptionMux::readResultKey(const unsigned char *block, unsigned int length,
+											Key &key) throw (std::invalid_argument)
+{
+	unsigned int headerEnd = readResultHeader(block, length);
+	unsigned int pos = tcpip::commandSizeLength(block);
+
+	key.first = block[pos] - RESPONSE_OFFSET;
+	key.second.assign(reinterpret_cast<const char*>(block + pos + 1 + 4),
+					  headerEnd - (pos + 1 + 4));
+
+	return headerEnd;
+}
+
+void SubscriptionMux::writeFilteredResult(const unsigned char *block, unsigned int length,
+										  const std::vector<unsigned char> &variables,
+										  tcpip::Storage &out)
+{
+	unsigned int headerEnd;
+	unsigned int starts[256];
+	unsigned int lengths[256] = { 0 };
+
+	try {
+		headerEnd = readResultHeader(block, length);
+
+		// Locate every variable (id, status and value)
+		int count = block[headerEnd];
+		unsigned int pos = headerEnd + 1;
+		for (int i=0; i < count; i++) {
+			if (pos + 2 > length) {
+				throw std::invalid_argument("Subscription result exceeds the message");
+			}
+			unsigned int valueLength = tcpip::typedValueLength(block + pos + 2,
+															   length - pos - 2);
+			starts[block[pos]] = pos;
+			lengths[block[pos]] = 2 + valueLength;
+			pos += 2 + valueLength;
+		}
+	}
+	catch (std::invalid_argument) {
+		out.writePacket(block, length);
+		return;
+	}
+
+	// Write the requested variables
+	unsigned int sizeLen = tcpip::commandSizeLength(block);
+	unsigned int size = headerEnd - sizeLen + 1;
+	unsigned char count = 0;
+
+	std::vector<unsigned char>::const_iterator var;
+	for (var=variables.begin(); var != variables.end(); var++) {
+		if (lengths[*var] > 0) {
+			size += lengths[*var];
+			count++;
+		}
+	}
+
+	tcpip::writeCommandSize(out, size);
+	out.writePacket(block + sizeLen, headerEnd - sizeLen);
+	out.writeUnsignedByte(count);
+
+	for (var=variables.begin(); var != variables.end(); var++) {
+		if (lengths[*var] > 0) {
+			out.writePacket(block + starts[*var], lengths[*var]);
+		}
+	}
+}
@@ -0,0 +1,223 @@
+#ifndef SUBSCRIPTIONMUX_H
+#define SUBSCRIPTIONMUX_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "tcpip/storage.h"
+
+class Client;
+
+/** \brief Merges the subscriptions of all clients to the same object.
+ *
+ * SUMO keeps a single subscription per domain and object, so the hub
+ * subscribes to the union of the variables requested by all clients,
+ * from the earliest begin to the latest end time.
+ *
+ * The subscription results received from SUMO are rebuilt into one
+ * result per client subscription, with only the variables (and within
+ * the time interval) that client requested, as if each subscription had
+ * been made separately. Each client only receives the results of its
+ * own subscriptions.
+ */
+class SubscriptionMux {
+
+ public:
+	SubscriptionMux();
+
+	virtual ~SubscriptionMux();
+
+	/** \brief Records a subscription from a client, until SUMO answers it.
+	 *
+	 * A subscription with no variables removes the client's subscription.
+	 * The change is kept if the answer (see rewriteSubscribeAnswer(const
+	 * Client*, const unsigned char*, unsigned int, tcpip::Storage&)) accepts
+	 * it and undone otherwise, so a subscription SUMO rejects isn't merged
+	 * into the ones made later.
+	 *
+	 * \param[in] client The client subscribing
+	 * \param[in] command The bytes of the CMD_SUBSCRIBE_* command, size included
+	 * \param[in] length Number of bytes in command
+	 * \param[out] upstream Receives the merged command to send to SUMO
+	 *
+	 * \throw std::invalid_argument If the command is malformed
+	 */
+	void subscribe(const Client *client, const unsigned char *command,
+				   unsigned int length, tcpip::Storage &upstream)
+		throw (std::invalid_argument);
+
+	/** \brief Rewrites the answer to a merged subscription for a client.
+	 *
+	 * The subscriptions of a client must be answered in the order they
+	 * were made. When SUMO rejects one, the subscription it replaced is
+	 * restored, and sent to SUMO again (see writeUpstream(tcpip::Storage&)).
+	 *
+	 * \param[in] client The client that sent the subscription
+	 * \param[in] answer The status and the response from SUMO
+	 * \param[in] length Number of bytes in answer
+	 * \param[out] out Receives the answer for the client
+	 */
+	void rewriteSubscribeAnswer(const Client *client, const unsigned char *answer,
+								unsigned int length, tcpip::Storage &out)
+		throw (std::invalid_argument);
+
+	/** \brief Locates the subscription results of a step answer.
+	 *
+	 * The answer is referenced (not copied) until the next call, and must
+	 * be kept unchanged while writeStepAnswer(const Client*, int,
+	 * tcpip::Storage&) is used.
+	 *
+	 * \param answer The SIMSTEP2 answer (status, count and results)
+	 * \param length Number of bytes in answer
+	 * \param statusLength Number of bytes of the status, already verified
+	 *
+	 * \throw std::invalid_argument If the answer is malformed
+	 */
+	void readStepAnswer(const unsigned char *answer, unsigned int length,
+						unsigned int statusLength) throw (std::invalid_argument);
+
+	/** \brief Writes the step answer for a client.
+	 *
+	 * Only results of the client's own subscriptions are written (and
+	 * results of subscriptions unknown to the hub), with the result
+	 * count adjusted accordingly.
+	 *
+	 * \param[in] client The client that receives the answer
+	 * \param[in] currentTime The time reached by the step
+	 * \param[out] out Receives the answer
+	 */
+	void writeStepAnswer(const Client *client, int currentTime, tcpip::Storage &out);
+
+	/** \brief Forgets all subscriptions from a client.
+	 *
+	 * The subscriptions it shared are merged again from the remaining
+	 * subscribers, and the ones nobody else made are removed (see
+	 * writeUpstream(tcpip::Storage&)). Until SUMO stops sending their
+	 * results, these are dropped rather than delivered to everyone.
+	 */
+	void removeClient(const Client *client);
+
+	/// Determines if there's any subscription
+	bool empty() const;
+
+	/// Determines if subscriptions must be sent to SUMO again
+	bool hasUpstream() const;
+
+	/** \brief Writes the subscriptions that must be sent to SUMO again.
+	 *
+	 * Each is merged from its current subscribers, or removed if there's
+	 * none left. Their answers are meant for the hub, not for the clients.
+	 *
+	 * \param[out] commands Receives the CMD_SUBSCRIBE_* commands
+	 */
+	void writeUpstream(tcpip::Storage &commands);
+
+ private:
+	/// Identifies a subscription: the command code and the object id
+	typedef std::pair<unsigned char, std::string> Key;
+
+	/// The subscription made by a single client
+	struct ClientSubscription {
+		const Client *client;
+		int begin;
+		int end;
+		std::vector<unsigned char> variables;
+	};
+
+	/// The bytes of a result: its position and length
+	typedef std::pair<unsigned int, unsigned int> ResultBytes;
+
+	/// The subscription made to SUMO
+	struct Subscription {
+		/// The client subscriptions, in the order they were made
+		std::vector<ClientSubscription> subscribers;
+
+		/// The union of all variables
+		std::vector<unsigned char> variables;
+
+		/// The result in myStepAnswer (with length 0 if there's none)
+		ResultBytes result;
+	};
+
+	/// All subscriptions made to SUMO
+	std::map<Key, Subscription> mySubscriptions;
+
+	/// The subscriptions of each client
+	std::map<const Client*, std::set<Key> > myClientKeys;
+
+	/// A change made by a subscription not answered yet
+	struct Change {
+		/// The client that subscribed (NULL once answered)
+		const Client *client;
+		Key key;
+
+		/// The client's subscription before the change, if it existed
+		bool existed;
+		ClientSubscription previous;
+	};
+
+	/// The changes not answered yet are [myFirstChange, end), in order
+	std::vector<Change> myChanges;
+	size_t myFirstChange;
+
+	/// The subscriptions to send to SUMO again
+	std::set<Key> myUpstream;
+
+	/// The subscriptions nobody makes anymore, whose results are dropped
+	std::set<Key> myOrphans;
+
+	/// The orphans whose results are in the step answer being read
+	std::set<Key> myOrphansLeft;
+
+	/// The last step answer (see readStepAnswer(const unsigned char*, unsigned int, unsigned int))
+	const unsigned char *myStepAnswer;
+
+	/// Length of the status in myStepAnswer
+	unsigned int myStepStatusLength;
+
+	/// The results in myStepAnswer not made through the hub
+	std::vector<ResultBytes> myUnknownResults;
+
+	/// The key of the result being read (kept to reuse its buffer)
+	Key myResultKey;
+
+	/// The results being written for a client (kept to reuse its buffer)
+	tcpip::Storage myClientResults;
+
+	/// Restores the subscription replaced by a change, which SUMO rejected
+	void undoChange(size_t index);
+
+	/// Writes the command subscribing to the union of the subscriptions to an object
+	void writeMergedCommand(const Key &key, tcpip::Storage &out);
+
+	/** \brief Writes a subscription result with only some variables.
+	 *
+	 * Copies the result unchanged if its values can't be parsed.
+	 *
+	 * \param block The subscription result, size included
+	 * \param length Number of bytes in block
+	 * \param variables The variables to write, in order
+	 * \param[out] out Receives the new result
+	 */
+	static void writeFilteredResult(const unsigned char *block, unsigned int length,
+									const std::vector<unsigned char> &variables,
+									tcpip::Storage &out);
+
+	/** \brief Locates the variable count of a subscription result.
+	 *
+	 * \return The length of the bytes before the variable count
+	 */
+	static unsigned int readResultHeader(const unsigned char *block, unsigned int length)
+		throw (std::invalid_argument);
+
+	/** \brief Reads the key from a subscription result.
+	 *
+	 * \return The length of the bytes before the variable count
+	 */
+	static unsigned int readResultKey(const unsigned char *block, unsigned int length,
+									  Key &key) throw (std::invalid_argument);
+};
+
+#endif /* SUBSCRIPTIONMUX_H */
@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <poll.h>
+#include <unistd.h>
+
+#include "TraCIConstants.h"
+#include "util.h"
+
+#include "SumoLog.h"
+
+namespace {
+
+	/// How often waiting for a connection checks whether to stop, in ms
+	const int STOP_CHECK_INTERVAL = 100;
+
+	/// Reads a 4 byte integer from the log, false if it ended
+	bool readInt(const std::vector<unsigned char> &log, size_t &position, unsigned int &value)
+	{
+		if (log.size() - position < 4) {
+			return false;
+		}
+		value = static_cast<unsigned int>(tcpip::readRawInt(&log[position]));
+		position += 4;
+		return true;
+	}
+
+}
+
+const char SumoRecorder::MAGIC[8] = { 'T', 'H', 'U', 'B', 'L', 'O', 'G', '1' };
+
+SumoRecorder::SumoRecorder() :
+	myOut(),
+	myLastAnswered(0)
+{
+	// No further initialization needed
+}
+
+SumoRecorder::~SumoRecorder()
+{
+	close();
+}
+
+
+bool SumoRecorder::open(const std::string &path)
+{
+	myOut.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!myOut) {
+		return false;
+	}
+
+	myOut.write(MAGIC, sizeof(MAGIC));
+	return true;
+}
+
+bool SumoRecorder::isOpen() const
+{
+	return myOut.is_open();
+}
+
+void SumoRecorder::record(const tcpip::Segment *request, int count,
+						  const tcpip::Storage &answer,
+						  unsigned long long sent, unsigned long long answered)
+{
+	if (!myOut.is_open()) {
+		return;
+	}
+
+	writeInt((myLastAnswered > 0 && sent > myLastAnswered)? sent - myLastAnswered : 0);
+	writeInt(answered - sent);
+	myLastAnswered = answered;
+
+	std::size_t length = 0;
+	for (int i=0; i < count; i++) {
+		length += request[i].length;
+	}
+	writeInt(length);
+	for (int i=0; i < count; i++) {
+		myOut.write(reinterpret_cast<const char*>(request[i].data),
+					static_cast<std::streamsize>(request[i].length));
+	}
+
+	writeInt(answer.size());
+	myOut.write(reinterpret_cast<const char*>(answer.data()),
+				static_cast<std::streamsize>(answer.size()));
+}
+
+void SumoRecorder::close()
+{
+	if (myOut.is_open()) {
+		myOut.close();
+	}
+}
+
+void SumoRecorder::writeInt(unsigned long long value)
+{
+	// Larger values are saturated (only times could be)
+	unsigned int saturated = (value > 0xffffffffULL)? 0xffffffffU
+		: static_cast<unsigned int>(value);
+
+	char bytes[4] = { static_cast<char>(saturated >> 24), static_cast<char>(saturated >> 16),
+					  static_cast<char>(saturated >> 8), static_cast<char>(saturated) };
+	myOut.write(bytes, sizeof(bytes));
+}
+
+
+SumoReplayer::SumoReplayer(const tcpip::Endpoint &endpoint) :
+	mySocket(endpoint),
+	myAnswers(),
+	myPaced(false),
+	myThread(),
+	myStarted(false),
+	myStopping(false),
+	myAnswered(0),
+	myMissing(0)
+{
+	// No further initialization needed
+}
+
+SumoReplayer::~SumoReplayer()
+{
+	stop();
+}
+
+
+bool SumoReplayer::load(const std::string &path, std::string &error)
+{
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if (!in) {
+		error = "can't open " + path;
+		return false;
+	}
+	std::vector<unsigned char> log((std::istreambuf_iterator<char>(in)),
+								   std::istreambuf_iterator<char>());
+
+	if (log.size() < sizeof(SumoRecorder::MAGIC)
+		|| memcmp(&log[0], SumoRecorder::MAGIC, sizeof(SumoRecorder::MAGIC)) != 0) {
+		error = path + " isn't a log of the exchanges with SUMO";
+		return false;
+	}
+
+	std::vector<tcpip::CommandSpan> commands, answers;
+	size_t position = sizeof(SumoRecorder::MAGIC);
+	while (position < log.size()) {
+		unsigned int gap, latency, length, answerLength;
+		if (!readInt(log, position, gap) || !readInt(log, position, latency)
+			|| !readInt(log, position, length) || log.size() - position < length) {
+			error = path + " ends in the middle of a request";
+			return false;
+		}
+		tcpip::Storage request(&log[position], static_cast<int>(length));
+		position += length;
+
+		if (!readInt(log, position, answerLength) || log.size() - position < answerLength) {
+			error = path + " ends in the middle of an answer";
+			return false;
+		}
+		tcpip::Storage answer(&log[position], static_cast<int>(answerLength));
+		position += answerLength;
+
+		// A single command is answered by the whole message (e.g. a step)
+		try {
+			tcpip::splitCommands(request, commands);
+			if (commands.size() == 1) {
+				add(request.data(), request.size(), answer.data(), answer.size(), latency);
+				continue;
+			}
+
+			tcpip::splitAnswers(answer, commands, answers);
+			for (size_t i=0; i < commands.size(); i++) {
+				add(request.data() + commands[i].offset, commands[i].length,
+					answer.data() + answers[i].offset, answers[i].length, latency);
+			}
+		}
+		catch (std::invalid_argument &e) {
+			error = path + " has an invalid exchange: " + e.what();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void SumoReplayer::setPaced(bool paced)
+{
+	myPaced = paced;
+}
+
+void SumoReplayer::start() throw( tcpip::SocketException )
+{
+	// Listening now, the hub may connect as soon as this returns
+	mySocket.set_blocking(false);
+	mySocket.accept();
+
+	int error = pthread_create(&myThread, NULL, &SumoReplayer::run, this);
+	if (error != 0) {
+		throw tcpip::SocketException(std::string("SumoReplayer::start() @ pthread_create: ")
+									 + strerror(error));
+	}
+	myStarted = true;
+}
+
+void SumoReplayer::stop()
+{
+	if (!myStarted) {
+		return;
+	}
+
+	myStopping = true;
+	pthread_join(myThread, NULL);
+	myStarted = false;
+}
+
+unsigned long SumoReplayer::answered() const
+{
+	return myAnswered;
+}
+
+unsigned long SumoReplayer::missing() const
+{
+	return myMissing;
+}
+
+
+void *SumoReplayer::run(void *replayer)
+{
+	static_cast<SumoReplayer*>(replayer)->serve();
+	return NULL;
+}
+
+void SumoReplayer::serve()
+{
+	try {
+		// Checks every now and then whether to give up
+		while (!mySocket.has_client_connection()) {
+			if (myStopping) {
+				return;
+			}
+
+			struct pollfd listener = { mySocket.server_fd(), POLLIN, 0 };
+			poll(&listener, 1, STOP_CHECK_INTERVAL);
+			mySocket.accept();
+		}
+		mySocket.set_blocking(true);
+
+		tcpip::Storage request, answers;
+		bool open = true;
+		while (open) {
+			mySocket.receiveExact(request);
+
+			unsigned long latency = 0;
+			open = answer(request, answers, latency);
+			if (myPaced && latency > 0) {
+				usleep(latency);
+			}
+			mySocket.sendExact(answers);
+		}
+	}
+	catch (tcpip::SocketException) {
+		// The hub is gone, nothing left to answer
+	}
+	mySocket.close();
+}
+
+bool SumoReplayer::answer(const tcpip::Storage &request, tcpip::Storage &answers,
+						  unsigned long &latency)
+{
+	answers.reset();
+
+	std::vector<tcpip::CommandSpan> commands;
+	try {
+		tcpip::splitCommands(request, commands);
+	}
+	catch (std::invalid_argument) {
+		commands.clear();
+	}
+
+	bool open = true;
+	std::string key;
+	std::vector<tcpip::CommandSpan>::const_iterator it;
+	for (it=commands.begin(); it != commands.end(); it++) {
+		key.assign(reinterpret_cast<const char*>(request.data()) + it->offset, it->length);
+
+		std::map<std::string, Entry>::iterator found = myAnswers.find(key);
+		if (found != myAnswers.end()) {
+			Entry &entry = found->second;
+			const Answer &recorded = entry.answers[entry.next];
+			if (entry.next + 1 < entry.answers.size()) {
+				entry.next++;
+			}
+
+			answers.writePacket(reinterpret_cast<const unsigned char*>(recorded.bytes.data()),
+								static_cast<int>(recorded.bytes.size()));
+			latency = std::max(latency, recorded.latency);
+			myAnswered++;
+			continue;
+		}
+
+		// Closing is never answered by SUMO while recorded
+		std::string description = "Not found in the replayed log";
+		int result = RTYPE_ERR;
+		if (it->code == CMD_CLOSE) {
+			description = "Goodbye";
+			result = RTYPE_OK;
+			open = false;
+		} else {
+			myMissing++;
+		}
+
+		answers.writeUnsignedByte(1 + 1 + 1 + 4 + static_cast<int>(description.length()));
+		answers.writeUnsignedByte(it->code);
+		answers.writeUnsignedByte(result);
+		answers.writeString(description);
+	}
+
+	return open;
+}
+
+void SumoReplayer::add(const unsigned char *command, unsigned int length,
+					   const unsigned char *answer, unsigned int answerLength,
+					   unsigned long latency)
+{
+	Entry &entry = myAnswers[std::string(reinterpret_cast<const char*>(command), length)];
+	if (entry.answers.empty()) {
+		entry.next = 0;
+	}
+
+	Answer recorded;
+	recorded.bytes.assign(reinterpret_cast<const char*>(answer), answerLength);
+	recorded.latency = latency;
+	entry.answers.push_back(recorded);
+}
@@ -0,0 +1,166 @@
+#ifndef SUMOLOG_H
+#define SUMOLOG_H
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "tcpip/socket.h"
+#include "tcpip/storage.h"
+
+/** \brief Records the messages exchanged with SUMO.
+ *
+ * The log starts with the 8 bytes "THUBLOG1", followed by a record for
+ * each exchange (integers in 4 bytes, big endian):
+ *   - microseconds between the previous answer and the request
+ *   - microseconds SUMO took to answer
+ *   - length and bytes of the request (the message without its length)
+ *   - length and bytes of the answer (the message without its length)
+ *
+ * See SumoReplayer, which answers from such a log.
+ */
+class SumoRecorder {
+
+ public:
+	/// The first bytes of every log
+	static const char MAGIC[8];
+
+	SumoRecorder();
+
+	/// Closes the log, if open
+	virtual ~SumoRecorder();
+
+	/// Starts writing a log, false if it can't be created
+	bool open(const std::string &path);
+
+	/// Determines if exchanges are recorded
+	bool isOpen() const;
+
+	/** \brief Records an exchange.
+	 *
+	 * \param request The segments of the request, as sent
+	 * \param count Number of segments
+	 * \param answer The answer received
+	 * \param sent,answered When the request was sent and the answer received,
+	 *     in us (see Metrics::now())
+	 */
+	void record(const tcpip::Segment *request, int count, const tcpip::Storage &answer,
+				unsigned long long sent, unsigned long long answered);
+
+	/// Writes what's buffered and closes the log
+	void close();
+
+ private:
+	std::ofstream myOut;
+
+	/// When the last answer was received (0 before the first)
+	unsigned long long myLastAnswered;
+
+	/// Writes a 4 byte integer
+	void writeInt(unsigned long long value);
+
+	// Not copyable (owns the file)
+	SumoRecorder(const SumoRecorder &);
+	SumoRecorder &operator=(const SumoRecorder &);
+};
+
+
+/** \brief A mock SUMO that answers from a log written by SumoRecorder.
+ *
+ * Listens on the endpoint where the hub expects SUMO, and serves a
+ * single connection from a thread of its own. Each command is answered
+ * with the answers recorded for the same bytes, in the order they were
+ * recorded (the last one is repeated once they run out), so a request
+ * doesn't need to be batched with the same commands as when recorded.
+ * Commands never recorded are answered with an error status: e.g. when
+ * subscriptions from several clients are merged in other batches than
+ * when recorded (see SubscriptionMux), which depends on their timing.
+ *
+ * SUMO doesn't run at all: unless paced, answers are sent right away,
+ * which leaves the hub as the only one doing work.
+ */
+class SumoReplayer {
+
+ public:
+	/// \param endpoint Where to listen, as SUMO would
+	SumoReplayer(const tcpip::Endpoint &endpoint);
+
+	/// Stops answering
+	virtual ~SumoReplayer();
+
+	/** \brief Reads a log written by SumoRecorder.
+	 *
+	 * \param[out] error Describes why the log couldn't be read
+	 *
+	 * \return true iff the log was read completely
+	 */
+	bool load(const std::string &path, std::string &error);
+
+	/// Waits as long as SUMO took before each answer (false by default)
+	void setPaced(bool paced);
+
+	/// Starts listening, and serves the connection in a thread
+	void start() throw( tcpip::SocketException );
+
+	/// Waits for the connection to end (stops listening if there's none yet)
+	void stop();
+
+	/// Number of commands answered from the log, and of commands not found in it
+	unsigned long answered() const;
+	unsigned long missing() const;
+
+ private:
+	/// An answer as recorded
+	struct Answer {
+		std::string bytes;
+
+		/// Microseconds SUMO took for the whole request
+		unsigned long latency;
+	};
+
+	/// The answers recorded for a command, and the next one to give
+	struct Entry {
+		std::vector<Answer> answers;
+		size_t next;
+	};
+
+	tcpip::Socket mySocket;
+
+	/// The answers of each command, by its bytes (size included)
+	std::map<std::string, Entry> myAnswers;
+
+	bool myPaced;
+
+	pthread_t myThread;
+	bool myStarted;
+
+	/// Set to stop waiting for a connection
+	volatile bool myStopping;
+
+	unsigned long myAnswered, myMissing;
+
+	/// Entry point of the thread
+	static void *run(void *replayer);
+
+	/// Waits for the connection, then answers its requests until it's closed
+	void serve();
+
+	/** \brief Composes the answers to a request.
+	 *
+	 * \return false if the request closes the connection
+	 */
+	bool answer(const tcpip::Storage &request, tcpip::Storage &answers,
+				unsigned long &latency);
+
+	/// Adds an answer recorded for a command
+	void add(const unsigned char *command, unsigned int length,
+			 const unsigned char *answer, unsigned int answerLength, unsigned long latency);
+
+	// Not copyable (owns the thread)
+	SumoReplayer(const SumoReplayer &);
+	SumoReplayer &operator=(const SumoReplayer &);
+};
+
+#endif /* SUMOLOG_H */
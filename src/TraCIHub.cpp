@@ -1,34 +1,123 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 
 #include "TraCIConstants.h"
+#include "HeapCounter.h"
 #include "util.h"
 
 #include "TraCIHub.h"
 
-TraCIHub::TraCIHub(std::string sumoHost, int sumoPort,
-				   const std::vector<int> &clientPorts, int stepLength) :
-	mySumoSocket(sumoHost, sumoPort),
+TraCIHub::TraCIHub(const tcpip::Endpoint &sumo,
+				   const std::vector<tcpip::Endpoint> &clients, int stepLength) :
+	mySumoSocket(sumo),
 	myClients(),
+	myConnected(),
+	myListeners(),
+	myWaitClients(clients.size()),
+	myReactor(),
+	myCache(),
+	myCaching(true),
+	mySubscriptions(),
+	myConnectAnswer(),
+	myIOThreads(0),
+	myWorkers(NULL),
+	myLabel(),
+	myStepAnswer(new SharedBuffer()),
+	myStepBuffers(1),
+	myBuffers(),
+	myReady(),
+	myCommands(),
+	myForwardedSpans(),
+	myAnswerSpans(),
+	mySegments(),
+	myRound(),
+	myRoundFds(),
+	myReturned(),
+	myBatch(),
+	myPartBatch(),
+	mySources(),
+	myBatchQueries(),
+	myCachedAnswers(),
+	myMetrics(),
+	mySumoTime(0),
+	myStatsFile(),
+	myStatsInterval(1),
+	myStatsSocket(NULL),
+	myTraceFile(),
+	myTracer(),
+	myRecordFile(),
+	myRecorder(),
+	myStepAllocations(0),
+	myStepDeadline(-1),
+	myDeadlinePolicy(DEADLINE_SKIP),
+	myDeadline(0),
+	myMissed(clients.size(), false),
+	mySkipped(clients.size(), false),
+	myStragglers(0),
+	mySteps(0),
+	myAllocatingSteps(0),
+	myLastAllocatingStep(0),
 	myTimestepLength(stepLength),
 	myCurrentTime(0)
 {
-	// Initialize all clients according to their ports
-	std::vector<int>::const_iterator it;
-	for (it=clientPorts.begin(); it != clientPorts.end(); it++) {
-		myClients.push_back(Client(*it));
+	// Initialize all clients according to their endpoints
+	std::vector<tcpip::Endpoint>::const_iterator it;
+	for (it=clients.begin(); it != clients.end(); it++) {
+		myClients.push_back(new Client(*it));
 	}
 }
 
 TraCIHub::~TraCIHub()
 {
+	delete myWorkers;
+	delete myStatsSocket;
 
+	std::vector<Client*>::iterator it;
+	for (it=myClients.begin(); it != myClients.end(); it++) {
+		delete *it;
+	}
+
+	myStepAnswer->release();
 }
 
 int TraCIHub::execute()
 {
 	int result = 0;
 
+	// Statistics can be asked for from the start
+	if (myStatsSocket != NULL) {
+		try {
+			myStatsSocket->set_blocking(false);
+			myStatsSocket->accept();
+		}
+		catch (tcpip::SocketException) {
+			Report(myLabel, std::cerr) << "Error: Couldn't listen for statistics on "
+									   << myStatsSocket->address();
+			return 1;
+		}
+	}
+
+	// The clients are on their own tracks
+	if (!myTraceFile.empty()) {
+		if (!myTracer.open(myTraceFile)) {
+			Report(myLabel, std::cerr) << "Error: Couldn't write the trace to " << myTraceFile;
+			return 1;
+		}
+		for (size_t i=0; i < myClients.size(); i++) {
+			myTracer.nameTrack(Tracer::clientTrack(i), "client on " + myClients[i]->address());
+			myClients[i]->setTracer(&myTracer, Tracer::clientTrack(i));
+		}
+	}
+
+	if (!myRecordFile.empty() && !myRecorder.open(myRecordFile)) {
+		Report(myLabel, std::cerr) << "Error: Couldn't record the exchanges to " << myRecordFile;
+		return 1;
+	}
+
 	// Open connections
 	if (!connectToSUMO()) {
 		return 1;
@@ -41,6 +130,12 @@ int TraCIHub::execute()
 
 	// Run all steps required
 	try {
+		if (myIOThreads > 0) {
+			myWorkers = new ClientWorkers(myClients, myIOThreads);
+			myWorkers->setSnapshots(!myStatsFile.empty() || myStatsSocket != NULL);
+			myReactor.add(myWorkers->fd(), myWorkers);
+			myWorkers->start();
+		}
 
 		bool active = true;
 		while (active) {
@@ -49,41 +144,286 @@ int TraCIHub::execute()
 	}
 	catch (tcpip::SocketException e) {
 		// Notify errors on the connection
-		std::cout << "Error communicating to SUMO: " << e.what() << std::endl;
+		Report(myLabel) << "Error communicating to SUMO: " << e.what();
 		result = 1;
 	}
 	catch (ProtocolException e) {
 		// Notify errors from the protocol
-		std::cout << "Error : " << e.what() << std::endl;
+		Report(myLabel) << "Error : " << e.what();
 		result = e.isFromClient()? 2 : 1;
 	}
 
 
-	// Clean up
+	// Clean up (the threads may be using the clients)
+	if (myWorkers != NULL) {
+		myWorkers->stop();
+	}
 	disconnectSUMO();
 	if (result == 0) {
-		std::cout << "Finished simulation and disconnected from SUMO" << std::endl;
+		Report(myLabel) << "Finished simulation and disconnected from SUMO";
 	} else {
 		closeClients();
 	}
 
+	if (myCaching) {
+		Report report(myLabel);
+		myCache.printStatistics(report.stream());
+	}
+
+	if (myStepDeadline >= 0) {
+		Report(myLabel) << "Step deadline: " << myMetrics.deadlineMisses()
+						<< " misses in " << mySteps << " steps";
+	}
+
+	/* Steps still allocate while the cache and the buffers grow to the
+	   working set, and when clients join or leave (the last step included) */
+	Report(myLabel) << "Memory: mostly allocation-free, " << myAllocatingSteps << " of "
+					<< mySteps << " steps allocated (the last one was step "
+					<< myLastAllocatingStep << ", with " << myStepAllocations
+					<< " allocations), " << myBuffers.created() << " message buffers, "
+					<< myStepBuffers << " step answer buffers";
+
+	if (!myStatsFile.empty()) {
+		writeStatsFile();
+	}
+	myTracer.close();
+	myRecorder.close();
+
 	return result;
 }
 
+void TraCIHub::setResponseCaching(bool enabled)
+{
+	myCaching = enabled;
+	myCache.invalidate();
+}
+
+void TraCIHub::setIOThreads(unsigned int threads)
+{
+	myIOThreads = threads;
+}
+
+void TraCIHub::setLabel(const std::string &label)
+{
+	myLabel = label;
+}
+
+unsigned long TraCIHub::steps() const
+{
+	return mySteps;
+}
+
+void TraCIHub::setWaitClients(unsigned int count)
+{
+	myWaitClients = std::min(static_cast<size_t>(count), myClients.size());
+}
+
+void TraCIHub::setStepDeadline(int deadline, DeadlinePolicy policy)
+{
+	myStepDeadline = deadline;
+	myDeadlinePolicy = policy;
+}
+
+void TraCIHub::setQueueLimit(std::size_t limit)
+{
+	std::vector<Client*>::iterator it;
+	for (it=myClients.begin(); it != myClients.end(); it++) {
+		(*it)->setQueueLimit(limit);
+	}
+}
+
+void TraCIHub::setStatsFile(const std::string &path, unsigned int interval)
+{
+	myStatsFile = path;
+	myStatsInterval = (interval > 0)? interval : 1;
+}
+
+void TraCIHub::setStatsSocket(const std::string &path)
+{
+	tcpip::Endpoint endpoint;
+	endpoint.port = 0;
+	endpoint.path = path;
+	endpoint.sharedMemory = false;
+
+	delete myStatsSocket;
+	myStatsSocket = new tcpip::Socket(endpoint);
+}
+
+void TraCIHub::setTraceFile(const std::string &path)
+{
+	myTraceFile = path;
+}
+
+void TraCIHub::setRecordFile(const std::string &path)
+{
+	myRecordFile = path;
+}
+
+void TraCIHub::writeStatistics(std::ostream &out) const
+{
+	out << "# Statistics after " << mySteps << " steps, at time " << myCurrentTime
+		<< " ms\n";
+	myMetrics.print(out);
+
+	out << "clients:\n";
+	for (size_t i=0; i < myClients.size(); i++) {
+		const Client &client = *myClients[i];
+		const ClientMetrics *metrics;
+		bool connected;
+
+		// A client that belongs to its thread is reported as it was handed over
+		if (myWorkers != NULL && myWorkers->slot(i).resumed) {
+			metrics = &myWorkers->slot(i).metrics;
+			connected = myWorkers->slot(i).connected;
+		} else {
+			metrics = &client.metrics();
+			connected = client.isConnected();
+		}
+
+		out << "  " << client.address() << (connected? "" : " (not connected)") << ":\n";
+		metrics->print(out, "    ");
+	}
+}
+
+void TraCIHub::publishStatistics()
+{
+	if (!myStatsFile.empty() && mySteps % myStatsInterval == 0) {
+		writeStatsFile();
+	}
+
+	if (myStatsSocket == NULL) {
+		return;
+	}
+
+	// Whoever connected receives the text, then the connection is closed
+	try {
+		myStatsSocket->accept();
+		if (myStatsSocket->has_client_connection()) {
+			std::ostringstream text;
+			writeStatistics(text);
+			std::string bytes = text.str();
+
+			// The step doesn't wait for a slow reader, who is dropped instead
+			tcpip::Segment segment = { reinterpret_cast<const unsigned char*>(bytes.data()),
+									   bytes.size() };
+			if (myStatsSocket->trySend(&segment, 1) < bytes.size()) {
+				Report(myLabel, std::cerr) << "Statistics reader dropped, it didn't take "
+										   << bytes.size() << " bytes at once";
+			}
+		}
+	}
+	catch (tcpip::SocketException e) {
+		Report(myLabel, std::cerr) << "Error answering for statistics: " << e.what();
+	}
+	myStatsSocket->close();
+}
+
+void TraCIHub::traceExchange(unsigned long long start)
+{
+	unsigned long long end = Metrics::now();
+	myTracer.span("exchange", Tracer::HUB_TRACK, start, end);
+
+	std::vector<ClientCommands>::const_iterator message;
+	for (message=myBatch.begin(); message != myBatch.end(); message++) {
+		message->client->trace("exchange", start, end);
+	}
+}
+
+int TraCIHub::deadlineTimeout() const
+{
+	if (myStepDeadline < 0) {
+		return -1;
+	}
+
+	unsigned long long now = Metrics::now();
+	if (now >= myDeadline) {
+		// Past it, only the clients still waited for are left
+		return (myDeadlinePolicy == DEADLINE_WAIT)? -1 : 0;
+	}
+	return static_cast<int>((myDeadline - now + 999) / 1000);
+}
+
+void TraCIHub::checkDeadline()
+{
+	if (myStepDeadline < 0 || Metrics::now() < myDeadline) {
+		return;
+	}
+
+	std::vector<size_t>::iterator it;
+	for (it=myConnected.begin(); it != myConnected.end(); it++) {
+		Client &client = *myClients[*it];
+		bool acting = (myWorkers != NULL)? myWorkers->slot(*it).resumed
+			: client.canAct(myCurrentTime);
+		if (!acting || mySkipped[*it]) {
+			continue;
+		}
+
+		if (!myMissed[*it]) {
+			myMissed[*it] = true;
+			myMetrics.recordDeadlineMiss();
+			client.missedDeadline();
+		}
+
+		if (myDeadlinePolicy == DEADLINE_WAIT) {
+			continue;
+		}
+
+		if (myDeadlinePolicy == DEADLINE_DETACH) {
+			Report(myLabel) << "Client on " << client.address()
+							<< " missed the step deadline at time " << myCurrentTime
+							<< ", detached";
+		}
+
+		// The thread gives it back once it sees the connection shut down
+		if (myWorkers != NULL) {
+			mySkipped[*it] = true;
+			myStragglers++;
+			if (myDeadlinePolicy == DEADLINE_DETACH) {
+				client.interrupt();
+			}
+			continue;
+		}
+
+		myReactor.remove(client.fd());
+		if (myDeadlinePolicy == DEADLINE_DETACH) {
+			client.closeConnection();
+		} else {
+			mySkipped[*it] = true;
+		}
+	}
+}
+
+void TraCIHub::writeStatsFile()
+{
+	// Written aside, then renamed over the previous one
+	std::string temporary = myStatsFile + ".tmp";
+	std::ofstream out(temporary.c_str());
+	writeStatistics(out);
+	out.close();
+
+	if (!out || std::rename(temporary.c_str(), myStatsFile.c_str()) != 0) {
+		Report(myLabel, std::cerr) << "Error writing statistics to " << myStatsFile;
+	}
+}
+
 bool TraCIHub::connectToSUMO()
 {
 	try {
 		// Connect through the socket
 		mySumoSocket.connect();
+
+		// Exchanges with SUMO still wait for the answers
+		mySumoSocket.set_blocking(false);
+		myReactor.add(mySumoSocket.fd(), NULL);
 	}
 	catch (tcpip::SocketException e) {
 		// Notify errors on the connection
-		std::cout << "Error: Couldn't connect to SUMO" << std::endl;
+		Report(myLabel) << "Error: Couldn't connect to SUMO";
 		return false;
 	}
 
 	// Notify success
-	std::cout << "Connected to SUMO on port " << mySumoSocket.port() << std::endl;
+	Report(myLabel) << "Connected to SUMO on " << mySumoSocket.address();
 	return true;
 }
 
@@ -94,6 +434,8 @@ void TraCIHub::disconnectSUMO()
 		return;
 	}
 
+	myReactor.remove(mySumoSocket.fd());
+
 	tcpip::Storage closeCmd;
 
 	// Compose the message
@@ -109,169 +451,924 @@ void TraCIHub::disconnectSUMO()
 
 bool TraCIHub::acceptClients()
 {
-	std::vector<Client>::iterator it;
+	std::vector<Client*>::iterator it;
 
 	try {
-		// Accepts connection in all clients
+		// Listens on all endpoints (messages are received as they arrive)
 		for (it=myClients.begin(); it != myClients.end(); it++) {
-			std::cout << "Waiting for connection on port " 
-					  << it->port() << std::endl;
-			it->acceptConnection();
+			Client &client = **it;
+			Report(myLabel) << "Waiting for connection on " << client.address();
+			client.setBlocking(false);
+			client.acceptConnection();
+			if (client.isConnected()) {
+				myConnected.push_back(it - myClients.begin());
+			} else {
+				myListeners.add(client.listenerFd(), &*it);
+			}
 		}
 	}
 	catch (tcpip::SocketException) {
 		// Notify any failure
-		std::cerr << "Error with client connection on port " 
-				  << it->port() << std::endl;
+		Report(myLabel, std::cerr) << "Error with client connection on " 
+								   << (*it)->address();
+		return false;
+	}
+
+	// Accepts connections until the clients required are there
+	try {
+		while (myConnected.size() < myWaitClients) {
+			admitClients(-1);
+		}
+	}
+	catch (tcpip::SocketException e) {
+		Report(myLabel, std::cerr) << "Error waiting for clients: " << e.what();
 		return false;
 	}
 
 	// Notify complete success
-	std::cout << "All clients finished connecting" << std::endl << std::endl;
+	if (myConnected.size() == myClients.size()) {
+		Report(myLabel) << "All clients finished connecting";
+	} else {
+		Report(myLabel) << myConnected.size() << " of " << myClients.size()
+						<< " clients connected, the others may join while running";
+	}
+	Report("");
 	return true;
 }
 
+void TraCIHub::admitClients(int timeout)
+{
+	myListeners.wait(myReady, timeout);
+
+	std::vector<void*>::iterator it;
+	for (it=myReady.begin(); it != myReady.end(); it++) {
+		Client **entry = static_cast<Client**>(*it);
+		Client &client = **entry;
+
+		try {
+			if (!client.acceptConnection()) {
+				continue;
+			}
+		}
+		catch (tcpip::SocketException) {
+			Report(myLabel, std::cerr) << "Error with client connection on "
+									   << client.address();
+			continue;
+		}
+
+		myListeners.remove(client.listenerFd());
+		myConnected.push_back(entry - &myClients[0]);
+
+		// The descriptor may be reused from one closed while watched
+		myReactor.remove(client.fd());
+
+		if (mySteps > 0) {
+			Report(myLabel) << "Client joined on " << client.address()
+							<< " at time " << myCurrentTime;
+		}
+	}
+	myReady.clear();
+}
+
+void TraCIHub::reapClients()
+{
+	// The clients still connected keep their order
+	size_t kept = 0;
+	for (size_t i=0; i < myConnected.size(); i++) {
+		// A client resumed (or skipped) belongs to its thread, it's reaped once given back
+		Client **entry = &myClients[myConnected[i]];
+		bool resumed = myWorkers != NULL && myWorkers->slot(myConnected[i]).resumed;
+		if (resumed || mySkipped[myConnected[i]] || (*entry)->isConnected()) {
+			myConnected[kept++] = myConnected[i];
+			continue;
+		}
+
+		mySubscriptions.removeClient(*entry);
+		myListeners.add((*entry)->listenerFd(), entry);
+	}
+	myConnected.resize(kept);
+}
+
 void TraCIHub::closeClients()
 {
-	std::vector<Client>::iterator it;
+	std::vector<Client*>::iterator it;
 
-	// Close the connection of all clients
+	// Close the connection of all clients (a last chance for the answers queued)
 	for (it=myClients.begin(); it != myClients.end(); it++) {
-		it->closeConnection();
+		(*it)->flush();
+		(*it)->closeConnection();
+	}
+}
+
+void TraCIHub::syncSubscriptions()
+{
+	PooledStorage message(myBuffers);
+	PooledStorage answer(myBuffers);
+	mySubscriptions.writeUpstream(*message);
+
+	unsigned long long sent = Metrics::now();
+	mySumoSocket.sendExact(*message);
+	mySumoSocket.receiveExact(*answer);
+	unsigned long long answered = Metrics::now();
+	mySumoTime += static_cast<unsigned long>(answered - sent);
+	if (myTracer.enabled()) {
+		myTracer.span("subscriptions", Tracer::SUMO_TRACK, sent, answered);
+	}
+	if (myRecorder.isOpen()) {
+		tcpip::Segment request = { message->data(), message->size() };
+		myRecorder.record(&request, 1, *answer, sent, answered);
+	}
+
+	// Nobody waits for these answers, refusals are only reported
+	std::vector<tcpip::CommandSpan> &commands = myForwardedSpans;
+	std::vector<tcpip::CommandSpan> &answers = myAnswerSpans;
+	try {
+		tcpip::splitCommands(*message, commands);
+		tcpip::splitAnswers(*answer, commands, answers);
+
+		for (size_t i=0; i < answers.size(); i++) {
+			tcpip::StatusResponse status = tcpip::readStatusResponse(
+				answer->data(), answers[i].offset, answer->size());
+			if (status.result != RTYPE_OK) {
+				Report(myLabel) << "SUMO refused to change a subscription: "
+								<< std::string(reinterpret_cast<const char*>(answer->data())
+											   + status.descriptionOffset,
+											   status.descriptionLength);
+			}
+		}
+	}
+	catch (std::invalid_argument &e) {
+		throw ProtocolException(e.what(), mySumoSocket.address());
 	}
 }
 
 void TraCIHub::runStep()
 {
-	tcpip::Storage message, answer;
+	PooledStorage message(myBuffers);
+
+	// Subscriptions changed by the hub reach SUMO before the step
+	if (mySubscriptions.hasUpstream()) {
+		syncSubscriptions();
+	}
+
+	// The last answer may still be queued for slow clients, then it's left to them
+	if (myStepAnswer->isShared()) {
+		myStepAnswer->release();
+		myStepAnswer = new SharedBuffer();
+		myStepBuffers++;
+	}
+	tcpip::Storage &answer = myStepAnswer->storage();
+	int targetTime = nextStepTime();
 
-	/* Compose and send the message */
-	message.writeByte(1+1+4);
-	message.writeChar(CMD_SIMSTEP2);
-	message.writeInt(0);
+	/* Compose and send the message (a target of 0 means a single step) */
+	message->writeByte(1+1+4);
+	message->writeChar(CMD_SIMSTEP2);
+	message->writeInt(targetTime == myCurrentTime + myTimestepLength? 0 : targetTime);
 
-	/* Execute the timestep */
-	mySumoSocket.sendExact(message);
+	/* Execute the timestep(s) */
+	unsigned long long sent = Metrics::now();
+	mySumoSocket.sendExact(*message);
 	mySumoSocket.receiveExact(answer);
-	myCurrentTime += myTimestepLength;
+	myCurrentTime = targetTime;
 
-	/* Obtain and verify the result */
-	tcpip::Storage modAnswer;
-	modAnswer.writeStorage(answer);
+	unsigned long long answered = Metrics::now();
+	unsigned long latency = static_cast<unsigned long>(answered - sent);
+	mySumoTime += latency;
+	myMetrics.recordCommand(CMD_SIMSTEP2, message->size(), answer.size(), latency);
+	if (myTracer.enabled()) {
+		myTracer.span("step", Tracer::SUMO_TRACK, sent, answered);
+	}
+	if (myRecorder.isOpen()) {
+		tcpip::Segment request = { message->data(), message->size() };
+		myRecorder.record(&request, 1, answer, sent, answered);
+	}
+
+	/* Queries must be answered again */
+	myCache.invalidate();
 
+	/* Obtain and verify the result (read in place, the answer is forwarded as is) */
+	tcpip::StatusResponse status;
 	std::string description;
-	bool success = verifyStatusResponse(modAnswer, CMD_SIMSTEP2, description);
+	bool success = verifyStatusResponse(answer, CMD_SIMSTEP2, description, status);
 
 	if (!success) {
-		std::cout << "Error on simulation step: " << description << std::endl;
+		Report(myLabel) << "Error on simulation step: " << description;
 	}
 
-	/* Notify the clients of the result */
-	std::vector<Client>::iterator it;
-	for (it=myClients.begin(); it != myClients.end(); it++) {
-		it->handleStepResult(myCurrentTime, success, answer);
+	/* Locate the results of each subscription */
+	bool filtering = success && !mySubscriptions.empty();
+	if (filtering) {
+		try {
+			mySubscriptions.readStepAnswer(answer.data(), answer.size(),
+										   status.span.length);
+		}
+		catch (std::invalid_argument &e) {
+			throw ProtocolException(e.what(), mySumoSocket.address());
+		}
+	}
+
+	/* Notify the clients of the result, each with its own subscriptions */
+	if (myWorkers != NULL) {
+		resumeStepResults(success, filtering);
+		return;
+	}
+
+	PooledStorage clientAnswer(myBuffers);
+
+	std::vector<size_t>::iterator it;
+	for (it=myConnected.begin(); it != myConnected.end(); it++) {
+		// A client skipped didn't ask for the step
+		if (mySkipped[*it]) {
+			continue;
+		}
+
+		Client &client = *myClients[*it];
+		if (filtering && client.usesStepResult(myCurrentTime, success)) {
+			clientAnswer->reset();
+			mySubscriptions.writeStepAnswer(&client, myCurrentTime, *clientAnswer);
+			client.handleStepResult(myCurrentTime, success, *clientAnswer);
+		} else {
+			client.handleStepResult(myCurrentTime, success, answer, myStepAnswer);
+		}
 	}
 }
 
-bool TraCIHub::handleStep()
+void TraCIHub::resumeStepResults(bool success, bool filtering)
 {
-	bool someConnected = false;
+	// The other clients just keep waiting (see Client::usesStepResult)
+	std::vector<size_t>::iterator it;
+	for (it=myConnected.begin(); it != myConnected.end(); it++) {
+		// A client skipped still belongs to its thread, and didn't ask for the step
+		if (mySkipped[*it]) {
+			continue;
+		}
 
-	std::vector<Client>::iterator it;
-	for (it=myClients.begin(); it != myClients.end(); it++) {
+		Client &client = *myClients[*it];
+		if (!client.isConnected() || !client.usesStepResult(myCurrentTime, success)) {
+			continue;
+		}
+
+		ClientWorkers::Slot &slot = myWorkers->slot(*it);
+		if (filtering) {
+			slot.buffer.reset();
+			mySubscriptions.writeStepAnswer(&client, myCurrentTime, slot.buffer);
+			slot.answers = &slot.buffer;
+		} else {
+			myStepAnswer->acquire();
+			slot.answers = &myStepAnswer->storage();
+			slot.shared = myStepAnswer;
+		}
+		slot.stepResult = true;
+		slot.stepSuccess = success;
+		myWorkers->resume(slot, myCurrentTime);
+	}
+}
+
+int TraCIHub::nextStepTime() const
+{
+	int singleStep = myCurrentTime + myTimestepLength;
+	int earliest = -1;
+
+	std::vector<size_t>::const_iterator it;
+	for (it=myConnected.begin(); it != myConnected.end(); it++) {
+		// A client skipped is treated as having asked for a single step
+		if (mySkipped[*it]) {
+			return singleStep;
+		}
+
+		const Client &client = *myClients[*it];
+		if (!client.isConnected() || client.isDraining()) {
+			continue;
+		}
 
-		// Handles connected clients
-		if (it->isConnected()) {
-			handleClient(*it);
-			someConnected = someConnected || it->isConnected();
+		// A single step is needed by someone, no need to look further
+		int target = client.targetTime();
+		if (target <= singleStep) {
+			return singleStep;
 		}
+
+		if (earliest < 0 || target < earliest) {
+			earliest = target;
+		}
+	}
+
+	if (earliest < 0) {
+		return singleStep;
+	}
+
+	// Only whole timesteps are taken
+	int steps = (earliest - myCurrentTime + myTimestepLength - 1) / myTimestepLength;
+	return myCurrentTime + steps * myTimestepLength;
+}
+
+bool TraCIHub::handleStep()
+{
+	unsigned long allocations = heapAllocations();
+	unsigned long long start = Metrics::now();
+	mySumoTime = 0;
+
+	// Every client has until the deadline to ask for this step, even the ones skipped before
+	if (myStepDeadline >= 0) {
+		myDeadline = start + myStepDeadline * 1000ULL;
+		myMissed.assign(myMissed.size(), false);
+		mySkipped.assign(mySkipped.size(), false);
+		myStragglers = 0;
 	}
 
+	// Clients join on a step boundary, in the slots of the threads too
+	if (myListeners.size() > 0) {
+		admitClients(0);
+	}
+
+	if (myWorkers != NULL) {
+		dispatchClients();
+	} else {
+		pollClients();
+	}
+	unsigned long long served = Metrics::now();
+
 	// After all clients were handled, runs a simulation step
 	runStep();
 
-	return someConnected;
+	reapClients();
+
+	unsigned long long end = Metrics::now();
+	myMetrics.recordStep(static_cast<unsigned long>(end - start),
+						 static_cast<unsigned long>(served - start - mySumoTime),
+						 static_cast<unsigned long>(mySumoTime));
+	if (myTracer.enabled()) {
+		myTracer.span("clients", Tracer::HUB_TRACK, start, served);
+		myTracer.span("runStep", Tracer::HUB_TRACK, served, end);
+	}
+
+	// Steps that allocate are the exception, once buffers have grown
+	unsigned long stepAllocations = heapAllocations() - allocations;
+	mySteps++;
+	if (stepAllocations > 0) {
+		myAllocatingSteps++;
+		myLastAllocatingStep = mySteps;
+		myStepAllocations = stepAllocations;
+	}
+
+	publishStatistics();
+
+	// Clients only sending their last answers don't keep the simulation going
+	std::vector<size_t>::const_iterator it;
+	for (it=myConnected.begin(); it != myConnected.end(); it++) {
+		// The clients resumed with the step result were connected, and aren't ours to look at
+		if (myWorkers != NULL && myWorkers->slot(*it).resumed) {
+			return true;
+		}
+		if (!myClients[*it]->isDraining()) {
+			return true;
+		}
+	}
+	return false;
 
 }
 
+void TraCIHub::pollClients()
+{
+	std::vector<size_t>::iterator it;
+
+	// Handles clients that already have commands (or answers queued), watches the others
+	myRound.clear();
+	for (it=myConnected.begin(); it != myConnected.end(); it++) {
+		Client *client = myClients[*it];
+		if (client->canAct(myCurrentTime) || client->hasOutput()) {
+			myRound.push_back(client);
+		}
+	}
+	serveClients(myRound);
+
+	// Handles the remaining clients as soon as their messages arrive
+	std::vector<void*>::iterator readyIt;
 
-void TraCIHub::handleClient(Client &client)
+	bool someActing = true;
+	while (someActing) {
+		someActing = false;
+		for (it=myConnected.begin(); it != myConnected.end(); it++) {
+			someActing = someActing
+				|| (!mySkipped[*it] && myClients[*it]->canAct(myCurrentTime));
+		}
+
+		if (someActing) {
+			myReactor.wait(myReady, deadlineTimeout());
+		}
+
+		// All clients ready at once are served together
+		myRound.clear();
+		for (readyIt=myReady.begin(); readyIt != myReady.end(); readyIt++) {
+			// SUMO never talks first, this means it hung up
+			if (*readyIt == NULL) {
+				throw tcpip::SocketException("connection closed by SUMO");
+			}
+
+			myRound.push_back(static_cast<Client*>(*readyIt));
+		}
+		myReady.clear();
+
+		serveClients(myRound);
+
+		// The clients served are past it, the others may be late
+		checkDeadline();
+	}
+}
+
+void TraCIHub::dispatchClients()
 {
-	tcpip::Storage message, answer;
+	// Resumes the clients that can act (the others were resumed by runStep)
+	std::vector<size_t>::iterator connected;
+	for (connected=myConnected.begin(); connected != myConnected.end(); connected++) {
+		ClientWorkers::Slot &slot = myWorkers->slot(*connected);
+		if (slot.resumed) {
+			continue;
+		}
+
+		// Answers left queued go on (the threads send them while they serve a client)
+		myClients[*connected]->flush();
+		if (myClients[*connected]->canAct(myCurrentTime)) {
+			slot.answers = NULL;
+			myWorkers->resume(slot, myCurrentTime);
+		}
+	}
+
+	std::vector<ClientWorkers::Slot*>::iterator it;
+	std::vector<void*>::iterator readyIt;
 
-	/* Exchange messages until the client cannot act
-	   (either asked for a timestep or termination) */
-	while (client.canAct(myCurrentTime)) {
+	// The clients skipped are left to their threads
+	while (myWorkers->resumed() > myStragglers) {
+		// All clients given back at once are served together
+		myReturned.clear();
+		ClientWorkers::Slot *returned;
+		while ((returned = myWorkers->take()) != NULL) {
+			myReturned.push_back(returned);
+		}
 
-		// Forward commands to SUMO
-		message.reset();
-		client.getCommands(message, myCurrentTime);
+		if (myReturned.empty()) {
+			if (myWorkers->sleep()) {
+				myReactor.wait(myReady, deadlineTimeout());
+				myWorkers->wake();
+			}
+			checkDeadline();
 
-		if (message.size() > 0) {
-			mySumoSocket.sendExact(message);
+			// SUMO never talks first, this means it hung up
+			for (readyIt=myReady.begin(); readyIt != myReady.end(); readyIt++) {
+				if (*readyIt == NULL) {
+					throw tcpip::SocketException("connection closed by SUMO");
+				}
+			}
+			myReady.clear();
+			continue;
+		}
+
+		// Forward the commands of all messages at once
+		myBatch.clear();
+		myCommands.clear();
+		for (it=myReturned.begin(); it != myReturned.end(); it++) {
+			ClientWorkers::Slot &slot = **it;
+			if (mySkipped[slot.index]) {
+				mySkipped[slot.index] = false;
+				myStragglers--;
+			}
+
+			if (slot.error != NULL) {
+				ProtocolException error(*slot.error);
+				delete slot.error;
+				slot.error = NULL;
+				throw error;
+			}
+
+			if (!slot.commands.empty()) {
+				ClientCommands message;
+				message.client = slot.client;
+				message.bytes = slot.bytes;
+				message.first = myCommands.size();
+				message.count = slot.commands.size();
+				message.answers = &slot.buffer;
+				myCommands.insert(myCommands.end(), slot.commands.begin(),
+								  slot.commands.end());
+				myBatch.push_back(message);
+			}
+		}
 
-			// Forward answers to Client
-			answer.reset();
-			mySumoSocket.receiveExact(answer);
-			client.putAnswers(answer);
+		// Traced before the answers are sent, the spans of a client never overlap
+		if (!myBatch.empty()) {
+			unsigned long long start = myTracer.enabled()? Metrics::now() : 0;
+			exchangeCommands(myBatch, myCommands);
+			if (myTracer.enabled()) {
+				traceExchange(start);
+			}
 		}
+
+		// Clients that can still act receive their answers from their threads
+		for (it=myReturned.begin(); it != myReturned.end(); it++) {
+			ClientWorkers::Slot &slot = **it;
+			Client &client = *slot.client;
+			bool answered = !slot.commands.empty();
+
+			if (client.canAct(myCurrentTime)) {
+				slot.answers = answered? &slot.buffer : NULL;
+				slot.stepResult = false;
+				myWorkers->resume(slot, myCurrentTime);
+			} else if (answered) {
+				client.putAnswers(slot.buffer);
+			}
+		}
+
+		// The clients resumed again may be late
+		checkDeadline();
 	}
 }
 
+void TraCIHub::serveClients(const std::vector<Client*> &clients)
+{
+	// Descriptors are gone once a client disconnects
+	myRoundFds.clear();
+	std::vector<Client*>::const_iterator it;
+	for (it=clients.begin(); it != clients.end(); it++) {
+		myRoundFds.push_back((*it)->fd());
+		(*it)->flush();
+	}
+
+	handleClients(clients);
+
+	// Avoid wakeups from clients that cannot act (e.g. pipelining)
+	for (size_t i=0; i < clients.size(); i++) {
+		if (!clients[i]->isConnected()) {
+			myReactor.remove(myRoundFds[i]);
+		} else {
+			watchClient(clients[i]);
+		}
+	}
+}
+
+void TraCIHub::watchClient(Client *client)
+{
+	int events = 0;
+	if (client->canAct(myCurrentTime) && !client->isBackedUp()) {
+		events |= Reactor::INPUT;
+	}
+	if (client->hasOutput()) {
+		events |= client->flushesOnInput()? Reactor::INPUT : Reactor::OUTPUT;
+	}
+
+	if (events == 0) {
+		myReactor.remove(client->fd());
+	} else {
+		myReactor.add(client->fd(), client, events);
+	}
+}
+
+
+void TraCIHub::handleClients(const std::vector<Client*> &clients)
+{
+	/* Exchange messages until no client can act (either asked
+	   for a timestep or termination) or has a complete message */
+	bool someMessage = true;
+	while (someMessage) {
+		someMessage = false;
+		myBatch.clear();
+		myCommands.clear();
+
+		// Take a message from each client, forwarding all commands at once
+		std::vector<Client*>::const_iterator it;
+		for (it=clients.begin(); it != clients.end(); it++) {
+			Client &client = **it;
+			if (!client.canAct(myCurrentTime) || !client.hasInput()) {
+				continue;
+			}
+			someMessage = true;
+
+			ClientCommands message;
+			message.client = &client;
+			message.first = myCommands.size();
+			client.getCommands(myCommands, myCurrentTime);
+			message.bytes = client.commandBytes();
+			message.count = myCommands.size() - message.first;
+
+			if (message.count > 0) {
+				message.answers = myBuffers.acquire();
+				myBatch.push_back(message);
+			}
+		}
+
+		if (myBatch.empty()) {
+			continue;
+		}
+		unsigned long long start = myTracer.enabled()? Metrics::now() : 0;
+		exchangeCommands(myBatch, myCommands);
+		if (myTracer.enabled()) {
+			traceExchange(start);
+		}
+
+		// Forward answers to each client
+		std::vector<ClientCommands>::const_iterator message;
+		for (message=myBatch.begin(); message != myBatch.end(); message++) {
+			message->client->putAnswers(*message->answers);
+			myBuffers.release(message->answers);
+		}
+	}
+}
 
-bool TraCIHub::verifyStatusResponse(tcpip::Storage &answer, int cmdCode,
-									std::string &description)
+void TraCIHub::exchangeCommands(const std::vector<ClientCommands> &batch,
+								const std::vector<tcpip::CommandSpan> &spans)
 	throw (ProtocolException)
 {
-	// Verify the command size
-	int size;
-	try {
-		size = tcpip::readCommandSize(answer);
+	bool known = true;
+	std::vector<ClientCommands>::const_iterator message;
+	for (message=batch.begin(); message != batch.end(); message++) {
+		message->answers->reset();
+		for (size_t i=message->first; i < message->first + message->count; i++) {
+			known = known && tcpip::hasKnownAnswer(spans[i].code);
+		}
 	}
-	catch (std::invalid_argument) {
+
+	if (known) {
+		exchangeBatch(batch, spans);
+		return;
 	}
 
-	if (size < 6) {
-		std::ostringstream err;
-		err << "Invalid status response for command " << cmdCode
-			<< ": " << size << " bytes is too short.";
-		throw ProtocolException(err.str(), mySumoSocket.port());
+	/* The answer to an unknown command can't be split from the others, it's
+	   exchanged alone and the commands around it are batched as usual */
+	std::vector<ClientCommands> &part = myPartBatch;
+	part.clear();
+	for (message=batch.begin(); message != batch.end(); message++) {
+		ClientCommands current = *message;
+		current.count = 0;
+
+		for (size_t i=message->first; i < message->first + message->count; i++) {
+			if (tcpip::hasKnownAnswer(spans[i].code)) {
+				current.count++;
+				continue;
+			}
+
+			if (current.count > 0) {
+				part.push_back(current);
+			}
+			if (!part.empty()) {
+				exchangeBatch(part, spans);
+				part.clear();
+			}
+			exchangeAlone(*message, spans[i]);
+
+			current.first = i + 1;
+			current.count = 0;
+		}
+
+		if (current.count > 0) {
+			part.push_back(current);
+		}
 	}
 
-	// Verify the command code
-	int actualCmdCode;
-	try {
-		actualCmdCode = answer.readChar();
+	if (!part.empty()) {
+		exchangeBatch(part, spans);
 	}
-	catch (std::invalid_argument) {
-		throw ProtocolException("Message too short: couldn't read command"
-								" code", mySumoSocket.port());
+}
+
+void TraCIHub::exchangeAlone(const ClientCommands &message, const tcpip::CommandSpan &span)
+	throw (ProtocolException)
+{
+	tcpip::Segment command = { message.bytes + span.offset, span.length };
+	PooledStorage received(myBuffers);
+
+	unsigned long long sent = Metrics::now();
+	mySumoSocket.sendExact(&command, 1);
+	mySumoSocket.receiveExact(*received);
+	unsigned long long answered = Metrics::now();
+	unsigned long latency = static_cast<unsigned long>(answered - sent);
+	mySumoTime += latency;
+	if (myTracer.enabled()) {
+		myTracer.span("commands", Tracer::SUMO_TRACK, sent, answered);
 	}
+	if (myRecorder.isOpen()) {
+		myRecorder.record(&command, 1, *received, sent, answered);
+	}
+	unsigned int length = static_cast<unsigned int>(received->size());
+	myMetrics.recordCommand(span.code, span.length, length, latency);
 
-	if (actualCmdCode != cmdCode) {
-		std::ostringstream err;
-		err << "Received status response for command " << actualCmdCode
-			<< " when expecting " << cmdCode;
-		throw ProtocolException(err.str(), mySumoSocket.port());
+	// The whole answer belongs to the command, which may have changed anything
+	message.answers->writePacket(received->data(), static_cast<int>(length));
+	myCache.invalidate();
+}
+
+void TraCIHub::exchangeBatch(const std::vector<ClientCommands> &batch,
+							 const std::vector<tcpip::CommandSpan> &spans)
+	throw (ProtocolException)
+{
+	std::vector<tcpip::CommandSpan> &forwardedSpans = myForwardedSpans;
+	std::vector<tcpip::CommandSpan> &answerSpans = myAnswerSpans;
+	forwardedSpans.clear();
+	answerSpans.clear();
+
+	/* Answer what's possible from the cache, forward the rest (queries after
+	   a command that changes the simulation can't use older answers) */
+	std::vector<std::vector<unsigned char> > &cached = myCachedAnswers;
+	if (cached.size() < spans.size()) {
+		cached.resize(spans.size());
 	}
 
-	// Obtain the result code and description
-	bool success;
-	try {
-		success = answer.readUnsignedByte() == RTYPE_OK;
+	// The answer of each command: cached (-1) or the index in answerSpans
+	std::vector<int> &sources = mySources;
+	sources.assign(spans.size(), -1);
+
+	// Queries forwarded since the last change, answered once per batch
+	std::vector<BatchQuery> &queries = myBatchQueries;
+	queries.clear();
+
+	// The merged subscriptions, the other commands are sent from the messages
+	PooledStorage forwarded(myBuffers);
+	std::vector<tcpip::Segment> &segments = mySegments;
+	segments.clear();
+
+	// Adjacent commands of a message are sent as a single segment
+	std::vector<ClientCommands>::const_iterator message;
+	for (message=batch.begin(); message != batch.end(); message++) {
+		const unsigned char *bytes = message->bytes;
+		unsigned int runStart = 0, runEnd = 0;
+
+		for (size_t i=message->first; i < message->first + message->count; i++) {
+			const tcpip::CommandSpan &span = spans[i];
+			unsigned int sizeLen = tcpip::commandSizeLength(bytes + span.offset);
+
+			if (myCaching && tcpip::isGetCommand(span.code)) {
+				BatchQuery current = { bytes + span.offset + sizeLen,
+									   span.length - sizeLen, i };
+
+				std::vector<BatchQuery>::const_iterator query;
+				for (query=queries.begin(); query != queries.end(); query++) {
+					if (query->length == current.length
+						&& memcmp(query->command, current.command, current.length) == 0) {
+						break;
+					}
+				}
+				if (query != queries.end()) {
+					sources[i] = sources[query->index];
+					myCache.countHit();
+					myMetrics.recordCached(span.code);
+					continue;
+				}
+
+				if (myCache.lookup(current.command, current.length, cached[i])) {
+					myMetrics.recordCached(span.code);
+					continue;
+				}
+				queries.push_back(current);
+			}
+
+			if (tcpip::changesState(span.code)) {
+				myCache.invalidate();
+				queries.clear();
+			}
+
+			sources[i] = forwardedSpans.size();
+			forwardedSpans.push_back(span);
+
+			if (!tcpip::isSubscribeCommand(span.code) && span.offset == runEnd
+				&& runEnd > runStart) {
+				runEnd += span.length;
+				continue;
+			}
+
+			if (runEnd > runStart) {
+				tcpip::Segment run = { bytes + runStart, runEnd - runStart };
+				segments.push_back(run);
+			}
+			runStart = runEnd = span.offset;
+
+			if (tcpip::isSubscribeCommand(span.code)) {
+				// Located once forwarded is complete (it may move while written)
+				tcpip::Segment merged = { NULL, forwarded->size() };
+				try {
+					mySubscriptions.subscribe(message->client, bytes + span.offset,
+											  span.length, *forwarded);
+				}
+				catch (std::invalid_argument &e) {
+					throw ProtocolException(e.what(), message->client->address(), true);
+				}
+				merged.length = forwarded->size() - merged.length;
+				segments.push_back(merged);
+			} else {
+				runEnd += span.length;
+			}
+		}
+
+		if (runEnd > runStart) {
+			tcpip::Segment run = { bytes + runStart, runEnd - runStart };
+			segments.push_back(run);
+		}
 	}
-	catch (std::invalid_argument) {
-		throw ProtocolException("Message too short: couldn't read result"
-								" code", mySumoSocket.port());
+
+	unsigned int mergedOffset = 0;
+	std::vector<tcpip::Segment>::iterator segment;
+	for (segment=segments.begin(); segment != segments.end(); segment++) {
+		if (segment->data == NULL) {
+			segment->data = forwarded->data() + mergedOffset;
+			mergedOffset += segment->length;
+		}
 	}
 
+	PooledStorage received(myBuffers);
+	if (!segments.empty()) {
+		unsigned long long sent = Metrics::now();
+		mySumoSocket.sendExact(&segments[0], static_cast<int>(segments.size()));
+		mySumoSocket.receiveExact(*received);
+		unsigned long long answered = Metrics::now();
+		unsigned long latency = static_cast<unsigned long>(answered - sent);
+		mySumoTime += latency;
+		if (myTracer.enabled()) {
+			myTracer.span("commands", Tracer::SUMO_TRACK, sent, answered);
+		}
+		if (myRecorder.isOpen()) {
+			myRecorder.record(&segments[0], static_cast<int>(segments.size()), *received,
+							  sent, answered);
+		}
+
+		try {
+			tcpip::splitAnswers(*received, forwardedSpans, answerSpans);
+		}
+		catch (std::invalid_argument &e) {
+			throw ProtocolException(e.what(), mySumoSocket.address());
+		}
+
+		// Each command has its share of the round trip (the first ones get the remainder)
+		unsigned long commands = static_cast<unsigned long>(forwardedSpans.size());
+		for (size_t i=0; i < forwardedSpans.size(); i++) {
+			unsigned long share = latency / commands + (i < latency % commands? 1 : 0);
+			myMetrics.recordCommand(forwardedSpans[i].code, forwardedSpans[i].length,
+									answerSpans[i].length, share);
+		}
+	} else if (myCaching) {
+		myCache.countSavedExchange();
+	}
+
+	/* Compose the answers of each client in order, recording the new ones */
+	for (message=batch.begin(); message != batch.end(); message++) {
+		const unsigned char *bytes = message->bytes;
+		tcpip::Storage *answers = message->answers;
+
+		for (size_t i=message->first; i < message->first + message->count; i++) {
+			const tcpip::CommandSpan &span = spans[i];
+
+			if (sources[i] < 0) {
+				answers->writePacket(cached[i]);
+				continue;
+			}
+
+			const tcpip::CommandSpan &answerSpan = answerSpans[sources[i]];
+			const unsigned char *answer = received->data() + answerSpan.offset;
+
+			if (tcpip::isSubscribeCommand(span.code)) {
+				try {
+					mySubscriptions.rewriteSubscribeAnswer(message->client, answer,
+														   answerSpan.length, *answers);
+				}
+				catch (std::invalid_argument &e) {
+					throw ProtocolException(e.what(), mySumoSocket.address());
+				}
+			} else {
+				answers->writePacket(answer, answerSpan.length);
+			}
+
+			if (myCaching && tcpip::isGetCommand(span.code)) {
+				unsigned int sizeLen = tcpip::commandSizeLength(bytes + span.offset);
+				myCache.store(bytes + span.offset + sizeLen, span.length - sizeLen,
+							  answer, answerSpan.length);
+			} else if (tcpip::changesState(span.code)) {
+				myCache.invalidate();
+			}
+		}
+	}
+}
+
+bool TraCIHub::verifyStatusResponse(const tcpip::Storage &answer, int cmdCode,
+									std::string &description,
+									tcpip::StatusResponse &status)
+	throw (ProtocolException)
+{
+	// Verify the size and locate the fields
 	try {
-		description = answer.readString();
+		status = tcpip::readStatusResponse(answer.data(), answer.position(),
+										   answer.size());
 	}
-	catch (std::invalid_argument) {
-		throw ProtocolException("Message too short: couldn't read result"
-								" description", mySumoSocket.port());
+	catch (std::invalid_argument &e) {
+		std::ostringstream err;
+		err << "Invalid status response for command " << cmdCode
+			<< ": " << e.what();
+		throw ProtocolException(err.str(), mySumoSocket.address());
+	}
+
+	// Verify the command code
+	if (status.span.code != cmdCode) {
+		std::ostringstream err;
+		err << "Received status response for command " << static_cast<int>(status.span.code)
+			<< " when expecting " << cmdCode;
+		throw ProtocolException(err.str(), mySumoSocket.address());
 	}
 
-	return success;
+	// Obtain the result code and description
+	description.assign(reinterpret_cast<const char*>(answer.data()) + status.descriptionOffset,
+					   status.descriptionLength);
+
+	return status.result == RTYPE_OK;
 }
@@ -1,19 +1,41 @@
+#ifndef TRACIHUB_H
+#define TRACIHUB_H
+
 
 #include "tcpip/socket.h"
 #include "tcpip/storage.h"
 
 #include "Client.h"
+#include "ClientWorkers.h"
+#include "Metrics.h"
+#include "Reactor.h"
+#include "ResponseCache.h"
+#include "SharedBuffer.h"
+#include "StoragePool.h"
+#include "SumoLog.h"
+#include "SubscriptionMux.h"
+#include "Tracer.h"
 
 class TraCIHub {
 
  public:
+  /// What happens to a client that misses the deadline of a step
+  enum DeadlinePolicy {
+	/// The step waits for it anyway, the miss is only counted
+	DEADLINE_WAIT,
+	/// The step is taken without it: its request is served on the next one
+	DEADLINE_SKIP,
+	/// It is disconnected (its endpoint listens again)
+	DEADLINE_DETACH
+  };
+
   /**
-   * \param sumoHost The host where the SUMO server will be located
-   * \param sumoPort The port to which the SUMO server will be listening
-   * \param clientPorts All ports to which we will listen for a single client
+   * \param sumo Where the SUMO server will be listening (host and port, or Unix socket)
+   * \param clients All endpoints on which we will listen for a single client each
    * \param stepLength The time in ms each timestep represents
    */
-	TraCIHub(std::string sumoHost, int sumoPort, const std::vector<int> &clientPorts, int stepLength=1000);
+	TraCIHub(const tcpip::Endpoint &sumo, const std::vector<tcpip::Endpoint> &clients,
+			 int stepLength=1000);
 
   /// Destructor
   virtual ~TraCIHub();
@@ -21,6 +43,97 @@ class TraCIHub {
   /// Initialize the connections and execute the simulation
   int execute();
 
+  /** \brief Enables or disables answering repeated queries from the cache.
+   *
+   * Enabled by default. See ResponseCache.
+   */
+  void setResponseCaching(bool enabled);
+
+  /** \brief Sets the number of threads exchanging messages with the clients.
+   *
+   * With 0 (the default) all messages are exchanged by the thread that
+   * calls execute(). Otherwise see ClientWorkers: that thread only talks
+   * to SUMO. Must be set before execute().
+   */
+  void setIOThreads(unsigned int threads);
+
+  /// Sets the prefix of every line written by the hub (empty by default)
+  void setLabel(const std::string &label);
+
+  /// Number of steps run so far
+  unsigned long steps() const;
+
+  /** \brief Sets how many clients must connect before the first step.
+   *
+   * By default, all of them. The endpoints of the others (and of the
+   * clients that disconnect) keep listening, and the clients that
+   * connect to them join the simulation on the next step (see
+   * admitClients(int)). Must be set before execute().
+   */
+  void setWaitClients(unsigned int count);
+
+  /** \brief Bounds the time the clients have to ask for each step.
+   *
+   * Each step, the clients that can act have until the deadline (counted
+   * from when the previous step was handed out) to ask for the next one.
+   * Those that didn't are counted (see Metrics and ClientMetrics), and
+   * dealt with according to the policy. A skipped client doesn't receive
+   * the step it didn't ask for. Must be set before execute().
+   *
+   * \param deadline The time in ms, -1 for none (the default)
+   */
+  void setStepDeadline(int deadline, DeadlinePolicy policy);
+
+  /** \brief Sets the bytes of answers queued for a client before it's held back.
+   *
+   * Answers are never sent blocking: what a client doesn't take at once
+   * is queued, and while more than the limit is, its requests aren't read
+   * (see Client). It may then miss the step deadline, if one is set.
+   */
+  void setQueueLimit(std::size_t limit);
+
+  /** \brief Writes the statistics to a file every few steps.
+   *
+   * The file is replaced at once (readers never see part of it), and
+   * written one last time when the simulation ends. See
+   * writeStatistics(std::ostream&). Must be set before execute().
+   *
+   * \param interval Number of steps between writes
+   */
+  void setStatsFile(const std::string &path, unsigned int interval);
+
+  /** \brief Answers the connections to a Unix domain socket with the statistics.
+   *
+   * Each connection receives the text of writeStatistics(std::ostream&)
+   * and is closed. Connections are answered between steps, without
+   * waiting: a reader that doesn't take the whole text at once is
+   * dropped. Must be set before execute().
+   */
+  void setStatsSocket(const std::string &path);
+
+  /** \brief Writes a timeline of the run to a file, as trace-event JSON (see Tracer).
+   *
+   * Spans show the steps, each exchange of the hub with the clients
+   * (also on the track of each client), each round trip to SUMO, and
+   * the messages sent to each client. Must be set before execute().
+   */
+  void setTraceFile(const std::string &path);
+
+  /** \brief Records every exchange with SUMO to a file (see SumoRecorder).
+   *
+   * The log can be answered from later instead of running SUMO (see
+   * SumoReplayer). Must be set before execute().
+   */
+  void setRecordFile(const std::string &path);
+
+  /** \brief Writes the metrics of the steps, of each command code and of each client.
+   *
+   * Durations are in microseconds. Each step is split into the time
+   * serving the clients, exchanging messages with SUMO, and handing the
+   * results to the clients (fan-out).
+   */
+  void writeStatistics(std::ostream &out) const;
+
  protected:
   /** \brief Open the connection with SUMO.
    *
@@ -34,66 +147,358 @@ class TraCIHub {
   /// Close the connection with SUMO
   void disconnectSUMO();
 
-  /** \brief Wait for incoming connections from all clients.
+  /** \brief Wait for incoming connections from the first clients.
    *
-   * Notifies the user of the connections and in
-   * case of failure on some attempt.
+   * Starts listening on all endpoints, and waits until as many clients
+   * as set by setWaitClients(unsigned int) are connected. Notifies the
+   * user of the connections and in case of failure on some attempt.
    *
-   * \return true iff all connections were successful.
+   * \return true iff all endpoints are listening.
    */
   bool acceptClients();
 
+  /** \brief Admits the clients that connected to endpoints without a client.
+   *
+   * The clients join at the current time, and are served with the others
+   * from then on. A client whose connection fails is only reported, its
+   * endpoint keeps listening.
+   *
+   * \param timeout Maximum time to wait for a connection in ms (-1 waits
+   *     indefinitely, 0 only admits the pending ones)
+   */
+  void admitClients(int timeout);
+
+  /** \brief Removes the clients that disconnected from the connected ones.
+   *
+   * Their subscriptions are dropped and their endpoints listen again.
+   */
+  void reapClients();
+
+  /// Writes the statistics file and answers the stats socket, when it's time
+  void publishStatistics();
+
+  /// Replaces the statistics file
+  void writeStatsFile();
+
+  /// Records the exchange with SUMO of the batch in myBatch, started at the given time
+  void traceExchange(unsigned long long start);
+
+  /// The time until the step deadline, as a timeout for Reactor::wait (-1 if none)
+  int deadlineTimeout() const;
+
+  /** \brief Deals with the clients still acting once the step deadline passed.
+   *
+   * Each is counted once per step, and waited for, skipped or detached
+   * according to the policy. Clients that belong to their thread (see
+   * ClientWorkers) are left there when skipped, and interrupted when
+   * detached. Does nothing before the deadline.
+   */
+  void checkDeadline();
+
 
   /// Close the connections to all the clients.
   void closeClients();
 
 
-  /// Requests a single step from SUMO
+  /// Sends SUMO the subscriptions the hub changed (see SubscriptionMux::writeUpstream)
+  void syncSubscriptions();
+
+  /** \brief Requests a step from SUMO.
+   *
+   * When all clients are waiting for later times, SUMO is asked to run
+   * until the earliest of them in a single request.
+   */
   void runStep();
 
+  /** \brief Hands the step result to the clients that use it, through myWorkers.
+   *
+   * \param success Whether the step succeeded
+   * \param filtering Whether each client receives only its own subscriptions
+   */
+  void resumeStepResults(bool success, bool filtering);
+
+  /** \brief Obtains the time the next step should reach.
+   *
+   * \return The earliest target time among the connected clients, rounded
+   *     up to a whole number of timesteps (at least one timestep ahead).
+   */
+  int nextStepTime() const;
+
   /** \brief Lets all clients run their steps, then request a step from SUMO.
    *
-   * \return true if some client is still connected */
+   * Clients are served in the order their messages arrive, so a slow
+   * client doesn't delay the ones that are already waiting. Clients
+   * whose messages arrive together are served together (see
+   * handleClients(const std::vector<Client*>&)).
+   *
+   * Clients that connected meanwhile are admitted first, and the ones
+   * that disconnected are reaped after the step.
+   *
+   * \return true if some client is still connected (and not only
+   *     sending its last answers) */
   bool handleStep();
 
-  /** \brief Handles commands from client until a step or end request.
+  /// Serves the clients from this thread until none of them can act
+  void pollClients();
+
+  /** \brief Serves the clients through myWorkers until none of them can act.
+   *
+   * Clients that can act are resumed, and the commands of all clients
+   * given back together are forwarded at once, like in handleClients().
+   */
+  void dispatchClients();
+
+  /** \brief Handles the clients reported ready by the reactor at once.
    *
-   * Redirects all handled commands to SUMO, redirecting
-   * answers back to the client.
+   * Sends their queued answers first. Stops watching clients that cannot
+   * act anymore (they are watched again when they can), or that were
+   * disconnected, unless answers are still queued for them.
+   */
+  void serveClients(const std::vector<Client*> &clients);
+
+  /** \brief Watches a client for what it waits for, in myReactor.
+   *
+   * For input if it can act (and isn't held back), for output while
+   * answers are queued. Stops watching it if neither.
+   */
+  void watchClient(Client *client);
+
+  /** \brief Handles commands from clients until a step or end request.
+   *
+   * Takes a message from each client at a time, and redirects all
+   * their commands to SUMO in a single message, redirecting the
+   * answers back to each client.
    *
    * Whenever there's a step request, saves the unhandled
-   * commands and freezes the until the requested time.
+   * commands and freezes the client until the requested time.
    *
    * Whenever there's an end request, terminates the client.
+   *
+   * Never blocks waiting for a client: returns as soon as no
+   * client that can act has a complete message.
    */
-  void handleClient(Client &client);
+  void handleClients(const std::vector<Client*> &clients);
+
+  /// The commands of a message from a client, within a batch
+  struct ClientCommands {
+	/// The client that sent the message
+	Client *client;
+
+	/// The message with the commands
+	const unsigned char *bytes;
+
+	/// The commands of the message within the batch
+	size_t first, count;
+
+	/// Receives the answers to the commands
+	tcpip::Storage *answers;
+  };
+
+  /** \brief Obtains from SUMO the answers to the commands of several clients.
+   *
+   * All commands are sent in a single message, in the order of the
+   * batch, and the answers of each message are written in the order
+   * of its commands (not delivered to the client).
+   *
+   * When caching is enabled, queries already answered in this timestep
+   * (or asked earlier in the batch) are answered from the cache and not
+   * forwarded.
+   *
+   * Subscriptions are merged with the ones from other clients (see
+   * SubscriptionMux).
+   *
+   * Commands are sent straight from the clients' messages, without being
+   * copied, adjacent ones as a single segment.
+   *
+   * Commands the hub doesn't know how SUMO answers (see
+   * tcpip::hasKnownAnswer(int)) are exchanged alone, the whole answer
+   * going to the client untouched, as without batching. The commands
+   * before and after them are batched apart.
+   *
+   * \param[in] batch The messages, in the order their commands are sent
+   * \param[in] commands The commands of all messages, each within its message
+   *
+   * \throw ProtocolException Indicates an invalid answer
+   */
+  void exchangeCommands(const std::vector<ClientCommands> &batch,
+						const std::vector<tcpip::CommandSpan> &commands)
+	throw (ProtocolException);
+
+  /// Exchanges commands whose answers are all known, appending the answers (see exchangeCommands)
+  void exchangeBatch(const std::vector<ClientCommands> &batch,
+					 const std::vector<tcpip::CommandSpan> &commands)
+	throw (ProtocolException);
+
+  /// Exchanges a single command of a message, appending the whole answer to the message's
+  void exchangeAlone(const ClientCommands &message, const tcpip::CommandSpan &command)
+	throw (ProtocolException);
 
 
   /** \brief Verifies the integrity of the given status response
    *
    * Checks for correct size, matching commands and success or failure.
+   * The answer is read in place, its position is left unchanged.
    *
-   * \param answer The storage that contains the response as the first bytes
+   * \param answer The storage that contains the response as the next bytes to read
    * \param cmdCode The code of the expected command
    * \param[out] description String to receive the result description (especially
    *                           in case of error)
+   * \param[out] status Receives the location of the response within answer
    *
    * \return true iff the result code indicated success
    * \throw ProtocolException Indicates an error in the message, making it invalid
    *                (not the communication of an error, an error in the communication)
    */
-  bool verifyStatusResponse(tcpip::Storage &answer, int cmdCode, std::string &description) throw (ProtocolException);
+  bool verifyStatusResponse(const tcpip::Storage &answer, int cmdCode, std::string &description,
+							tcpip::StatusResponse &status) throw (ProtocolException);
 
  private:
   /// The socket for connecting to SUMO
   tcpip::Socket mySumoSocket;
 
-  /// Information about all clients
-  std::vector<Client> myClients;
+  /// Information about all clients, one per endpoint (owned, never moved)
+  std::vector<Client*> myClients;
+
+  /// The indexes in myClients of the clients connected, in the order they joined
+  std::vector<size_t> myConnected;
+
+  /** \brief Watches the endpoints without a client
+   *
+   * Each is registered with the pointer to its entry in myClients.
+   */
+  Reactor myListeners;
+
+  /// Number of clients to wait for before the first step
+  size_t myWaitClients;
+
+  /** \brief Watches the clients that may act and the SUMO connection
+   *
+   * SUMO is registered with a NULL pointer: it should only become
+   * readable while we wait for clients if the connection is lost.
+   */
+  Reactor myReactor;
+
+  /// Answers to queries in the current timestep
+  ResponseCache myCache;
+
+  /// Whether myCache is used
+  bool myCaching;
+
+  /// The subscriptions of all clients
+  SubscriptionMux mySubscriptions;
 
   /// The message SUMO sent confirming the connection
   tcpip::Storage myConnectAnswer;
 
+  /// Number of threads for the clients (0 to use none)
+  unsigned int myIOThreads;
+
+  /// Exchanges the messages of the clients (NULL when myIOThreads is 0)
+  ClientWorkers *myWorkers;
+
+  /// The prefix of every line written
+  std::string myLabel;
+
+  /** \brief The last step answer, shared by the clients until they sent it.
+   *
+   * Reused for the next step, unless some client still references it
+   * (see OutboundQueue). Buffers created so far in myStepBuffers.
+   */
+  SharedBuffer *myStepAnswer;
+  unsigned long myStepBuffers;
+
+  /** \brief The buffers for messages.
+   *
+   * Together with the containers below (cleared and reused by each call),
+   * a step doesn't allocate memory once they have grown to the size of
+   * the messages exchanged.
+   */
+  StoragePool myBuffers;
+
+  /// Clients reported ready by myReactor
+  std::vector<void*> myReady;
+
+  /// The commands of the client messages in a batch
+  std::vector<tcpip::CommandSpan> myCommands;
+
+  /// The commands sent to SUMO by exchangeCommands, and their answers
+  std::vector<tcpip::CommandSpan> myForwardedSpans, myAnswerSpans;
+
+  /// The parts of the message sent to SUMO by exchangeCommands
+  std::vector<tcpip::Segment> mySegments;
+
+  /// The clients being served together, and their descriptors
+  std::vector<Client*> myRound;
+  std::vector<int> myRoundFds;
+
+  /// The clients given back together by myWorkers
+  std::vector<ClientWorkers::Slot*> myReturned;
+
+  /// The client messages whose commands are sent together
+  std::vector<ClientCommands> myBatch;
+
+  /// Part of myBatch between commands exchanged alone (see exchangeCommands)
+  std::vector<ClientCommands> myPartBatch;
+
+  /// Where exchangeCommands finds the answer of each command
+  std::vector<int> mySources;
+
+  /// A query forwarded by exchangeCommands
+  struct BatchQuery {
+	/// The bytes of the command, after its size
+	const unsigned char *command;
+	unsigned int length;
+
+	/// Its index in the batch
+	size_t index;
+  };
+
+  /// The queries forwarded since the last change to the simulation
+  std::vector<BatchQuery> myBatchQueries;
+
+  /// The answers found in myCache by exchangeCommands (only grows)
+  std::vector<std::vector<unsigned char> > myCachedAnswers;
+
+  /// Instrumentation of the commands and steps (the clients keep their own)
+  Metrics myMetrics;
+
+  /// Time spent exchanging messages with SUMO in the current step, in us
+  unsigned long long mySumoTime;
+
+  /// Where the statistics are written (empty if nowhere), and every how many steps
+  std::string myStatsFile;
+  unsigned int myStatsInterval;
+
+  /// Answers the connections with the statistics (NULL if none)
+  tcpip::Socket *myStatsSocket;
+
+  /// Where the timeline is written (empty if nowhere), and what writes it
+  std::string myTraceFile;
+  Tracer myTracer;
+
+  /// Where the exchanges with SUMO are recorded (empty if nowhere), and what records them
+  std::string myRecordFile;
+  SumoRecorder myRecorder;
+
+  /// Heap allocations made by the hub's thread in the last step that allocated (not by myWorkers)
+  unsigned long myStepAllocations;
+
+  /// Time the clients have to ask for each step in ms (-1 for no limit), and what happens after
+  int myStepDeadline;
+  DeadlinePolicy myDeadlinePolicy;
+
+  /// When the current step's deadline passes (see Metrics::now())
+  unsigned long long myDeadline;
+
+  /// The clients that missed the current step's deadline, and the ones skipped (by index)
+  std::vector<bool> myMissed, mySkipped;
+
+  /// Number of clients skipped that still belong to their thread
+  unsigned int myStragglers;
+
+  /// Number of steps run, how many of them allocated memory, and the last one that did
+  unsigned long mySteps, myAllocatingSteps, myLastAllocatingStep;
+
   /// The incremented time for each timestep
   int myTimestepLength;
 
@@ -101,3 +506,5 @@ class TraCIHub {
   int myCurrentTime;
 
 };
+
+#endif /* TRACIHUB_H */
@@ -0,0 +1,123 @@
+#include "Tracer.h"
+
+namespace {
+
+	/// Spans buffered before they are written
+	const size_t BUFFERED_EVENTS = 4096;
+
+	/// Writes a string as a JSON string
+	void writeString(std::ostream &out, const std::string &text)
+	{
+		out << '"';
+		for (size_t i=0; i < text.size(); i++) {
+			if (text[i] == '"' || text[i] == '\\') {
+				out << '\\';
+			}
+			out << text[i];
+		}
+		out << '"';
+	}
+
+}
+
+Tracer::Tracer() :
+	myOut(),
+	myEnabled(false),
+	myEvents(),
+	myWritten(false)
+{
+	pthread_mutex_init(&myLock, NULL);
+}
+
+Tracer::~Tracer()
+{
+	close();
+	pthread_mutex_destroy(&myLock);
+}
+
+
+int Tracer::clientTrack(size_t index)
+{
+	return HUB_TRACK + 1 + static_cast<int>(index);
+}
+
+bool Tracer::open(const std::string &path)
+{
+	myOut.open(path.c_str());
+	if (!myOut) {
+		return false;
+	}
+
+	myEvents.reserve(BUFFERED_EVENTS);
+	myOut << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+	myEnabled = true;
+
+	nameTrack(SUMO_TRACK, "SUMO");
+	nameTrack(HUB_TRACK, "hub");
+	return true;
+}
+
+void Tracer::nameTrack(int track, const std::string &name)
+{
+	if (!myEnabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&myLock);
+	separate();
+	myOut << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << track
+		  << ", \"args\": {\"name\": ";
+	writeString(myOut, name);
+	myOut << "}}";
+	pthread_mutex_unlock(&myLock);
+}
+
+void Tracer::span(const char *name, int track, unsigned long long start,
+				  unsigned long long end)
+{
+	if (!myEnabled) {
+		return;
+	}
+
+	Event event = { name, track, start, (end > start)? end - start : 0 };
+
+	pthread_mutex_lock(&myLock);
+	if (myEvents.size() == myEvents.capacity()) {
+		flush();
+	}
+	myEvents.push_back(event);
+	pthread_mutex_unlock(&myLock);
+}
+
+void Tracer::close()
+{
+	if (!myEnabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&myLock);
+	flush();
+	myOut << "\n]}\n";
+	myOut.close();
+	myEnabled = false;
+	pthread_mutex_unlock(&myLock);
+}
+
+
+void Tracer::flush()
+{
+	std::vector<Event>::const_iterator it;
+	for (it=myEvents.begin(); it != myEvents.end(); it++) {
+		separate();
+		myOut << "{\"name\": \"" << it->name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+			  << it->track << ", \"ts\": " << it->start << ", \"dur\": " << it->duration
+			  << "}";
+	}
+	myEvents.clear();
+}
+
+void Tracer::separate()
+{
+	myOut << (myWritten? ",\n" : "\n");
+	myWritten = true;
+}
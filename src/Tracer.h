@@ -0,0 +1,96 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+/** \brief Writes a timeline of spans as trace-event JSON.
+ *
+ * The file can be opened in chrome://tracing or Perfetto. Spans are
+ * laid out on tracks: one for SUMO, one for the hub, and one per client
+ * (see clientTrack(size_t)).
+ *
+ * Events are buffered and written in blocks. Spans may be recorded from
+ * any thread. Until open(const std::string&) succeeds nothing is
+ * recorded, and callers are expected to check enabled() before even
+ * taking the timestamps.
+ */
+class Tracer {
+
+ public:
+	/// The track of the exchanges with SUMO, and of the hub's own work
+	static const int SUMO_TRACK = 0;
+	static const int HUB_TRACK = 1;
+
+	Tracer();
+
+	/// Ends the file, if open
+	virtual ~Tracer();
+
+	/// The track of the client at the given index
+	static int clientTrack(size_t index);
+
+	/// Starts writing the file, false if it can't be created
+	bool open(const std::string &path);
+
+	/// Determines if spans are recorded
+	bool enabled() const;
+
+	/// Names a track, as shown next to its spans
+	void nameTrack(int track, const std::string &name);
+
+	/** \brief Records a span.
+	 *
+	 * \param name What happened, a string that is never freed (e.g. a literal)
+	 * \param track Where it's shown
+	 * \param start,end The span, in us (see Metrics::now())
+	 */
+	void span(const char *name, int track, unsigned long long start,
+			  unsigned long long end);
+
+	/// Writes the buffered spans and ends the file
+	void close();
+
+ private:
+	/// A span, as buffered
+	struct Event {
+		const char *name;
+		int track;
+		unsigned long long start;
+		unsigned long long duration;
+	};
+
+	std::ofstream myOut;
+
+	/// Whether the file is open
+	bool myEnabled;
+
+	/// Spans not written yet (never more than its capacity)
+	std::vector<Event> myEvents;
+
+	/// Whether some event was written (they are separated by commas)
+	bool myWritten;
+
+	/// Serializes the threads recording spans
+	pthread_mutex_t myLock;
+
+	/// Writes the buffered spans (with the lock held)
+	void flush();
+
+	/// Writes the separator before an event
+	void separate();
+
+	// Not copyable (owns the file)
+	Tracer(const Tracer &);
+	Tracer &operator=(const Tracer &);
+};
+
+
+inline bool Tracer::enabled() const
+{
+	return myEnabled;
+}
+
+#endif /* TRACER_H */
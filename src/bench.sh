@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Benchmarks the hub between a mock SUMO and synthetic clients (see
+# mocksumo.cpp and loadgen.cpp), from the directory where they were built.
+#
+# Run through "make bench". The settings come from the environment, e.g.
+#   make bench BENCH_CLIENTS=100 BENCH_QUERIES=10 BENCH_STEP_TIME=500
+#
+# BENCH_CLIENTS            clients, 1 to 1000 [10]
+# BENCH_STEPS              steps each client takes [1000]
+# BENCH_QUERIES            queries per client and step [2]
+# BENCH_CHANGES            changes per client and step [0]
+# BENCH_SUBSCRIPTIONS      objects each client subscribes to [1]
+# BENCH_VARIABLES          variables per subscription [2]
+# BENCH_OBJECTS            distinct objects, shared by the clients [10]
+# BENCH_THINK              microseconds a client takes between steps [0]
+# BENCH_STEP_TIME          microseconds SUMO takes per step [0]
+# BENCH_ANSWER_SIZE        bytes in each query answer [8]
+# BENCH_SUBSCRIPTION_SIZE  bytes in each subscribed value [8]
+# BENCH_HUB_OPTIONS        further options for the hub, e.g. "--io-threads 4"
+# BENCH_PORT               port of the mock SUMO, the clients use the next ones [28000]
+
+clients=${BENCH_CLIENTS:-10}
+port=${BENCH_PORT:-28000}
+
+./mocksumo --step-time "${BENCH_STEP_TIME:-0}" \
+	--answer-size "${BENCH_ANSWER_SIZE:-8}" \
+	--subscription-size "${BENCH_SUBSCRIPTION_SIZE:-8}" \
+	"$port" &
+sumo=$!
+
+client_ports=
+i=1
+while [ "$i" -le "$clients" ]; do
+	client_ports="$client_ports $((port + i))"
+	i=$((i + 1))
+done
+
+# The hub connects to SUMO right away, give it time to listen
+sleep 1
+./tracihub $BENCH_HUB_OPTIONS "$port" $client_ports > bench.log 2>&1 &
+hub=$!
+
+./loadgen --clients "$clients" \
+	--steps "${BENCH_STEPS:-1000}" \
+	--queries "${BENCH_QUERIES:-2}" \
+	--changes "${BENCH_CHANGES:-0}" \
+	--subscriptions "${BENCH_SUBSCRIPTIONS:-1}" \
+	--variables "${BENCH_VARIABLES:-2}" \
+	--objects "${BENCH_OBJECTS:-10}" \
+	--think "${BENCH_THINK:-0}" \
+	--hub-pid "$hub" \
+	$((port + 1))
+result=$?
+
+if [ "$result" -ne 0 ]; then
+	kill "$hub" "$sumo" 2> /dev/null
+	echo "The output of the hub is in bench.log" >&2
+fi
+wait "$hub"
+wait "$sumo"
+exit $result
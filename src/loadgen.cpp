@@ -0,0 +1,554 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tcpip/socket.h"
+#include "tcpip/storage.h"
+#include "Metrics.h"
+#include "TraCIConstants.h"
+#include "util.h"
+
+#define CLIENTS 1
+#define HOST 2
+#define STEPS 3
+#define QUERIES 4
+#define CHANGES 5
+#define SUBSCRIPTIONS 6
+#define VARIABLES 7
+#define OBJECTS 8
+#define THINK 9
+#define HUB_PID 10
+
+#define MAX_CLIENTS 1000
+
+/** \brief Synthetic clients, for benchmarking the hub.
+ *
+ * Each client connects to its own port of the hub, subscribes once and
+ * then, every step, sends its queries and changes along with the step.
+ * The objects queried are shared by all clients, as they would be by
+ * clients of the same simulation. Reports the steps per second, the
+ * percentiles of the time a client waits for its step, and the CPU time
+ * the hub spent per step.
+ */
+
+namespace {
+
+	/// Tries to connect while the hub isn't listening yet
+	const int CONNECT_ATTEMPTS = 500;
+	const useconds_t CONNECT_INTERVAL = 20000;
+
+	/// Stack of each client thread (there may be a thousand)
+	const size_t CLIENT_STACK = 256 * 1024;
+
+}
+
+std::string argv0 = "loadgen";
+
+std::string host = "localhost";
+int firstPort = 0;
+
+int clients = 1;
+int steps = 1000;
+
+/// The command mix of each client: per step, and subscribed once
+int queries = 0;
+int changes = 0;
+int subscriptions = 0;
+int variables = 1;
+
+/// Distinct objects the commands refer to
+int objects = 10;
+
+/// Microseconds each client takes between its steps
+unsigned long think = 0;
+
+/// The hub process, to measure its CPU time (0 if not measured)
+int hubPid = 0;
+
+/// Synchronizes the clients before stepping, and the start of the measure
+pthread_barrier_t startBarrier;
+unsigned long long startTime = 0;
+
+
+/// What a client measured
+struct ClientResult {
+	/// Time waited for each step, in us
+	std::vector<unsigned long> latencies;
+	/// Steps answered with an error, or not answered
+	unsigned long errors;
+	std::string failure;
+};
+
+struct ClientContext {
+	int index;
+	ClientResult result;
+};
+
+
+void printUsage(std::ostream &out);
+void parseOptions(int argc, char **argv);
+void resolveHost();
+void *runClient(void *context);
+void connect(tcpip::Socket *&socket, int port);
+void writeCommand(tcpip::Storage &message, int code, const tcpip::Storage &content);
+std::string objectId(int object);
+void writeSubscriptions(tcpip::Storage &message, int client);
+void writeStep(tcpip::Storage &message, int client, int step);
+bool isStepAnswered(const tcpip::Storage &answers);
+bool readCpuTime(int pid, unsigned long long &ticks);
+unsigned long percentile(const std::vector<unsigned long> &sorted, double fraction);
+
+int main(int argc, char **argv)
+{
+	if (argc >= 1) {
+		argv0 = std::string(argv[0]);
+	}
+	parseOptions(argc, argv);
+	resolveHost();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// Everyone joins the barrier: the clients, and this thread to start the measure
+	pthread_barrier_init(&startBarrier, NULL, clients + 1);
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setstacksize(&attributes, CLIENT_STACK);
+
+	std::vector<ClientContext> contexts(clients);
+	std::vector<pthread_t> threads(clients);
+	for (int i=0; i < clients; i++) {
+		contexts[i].index = i;
+		contexts[i].result.errors = 0;
+		int error = pthread_create(&threads[i], &attributes, &runClient, &contexts[i]);
+		if (error != 0) {
+			std::cerr << "Error starting client " << i << ": " << strerror(error) << std::endl;
+			exit(1);
+		}
+	}
+	pthread_attr_destroy(&attributes);
+
+	pthread_barrier_wait(&startBarrier);
+	unsigned long long hubStart = 0;
+	bool measuringHub = hubPid > 0 && readCpuTime(hubPid, hubStart);
+
+	for (int i=0; i < clients; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	unsigned long long elapsed = Metrics::now() - startTime;
+	unsigned long long hubEnd = 0;
+	measuringHub = measuringHub && readCpuTime(hubPid, hubEnd);
+	pthread_barrier_destroy(&startBarrier);
+
+	std::vector<unsigned long> latencies;
+	unsigned long errors = 0;
+	int failed = 0;
+	for (int i=0; i < clients; i++) {
+		const ClientResult &result = contexts[i].result;
+		latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+		errors += result.errors;
+		if (!result.failure.empty()) {
+			std::cerr << "Client " << i << ": " << result.failure << std::endl;
+			failed++;
+		}
+	}
+	std::sort(latencies.begin(), latencies.end());
+
+	// Every client takes part in every step, the first one stands for all
+	unsigned long stepped = contexts[0].result.latencies.size();
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "Clients: " << clients << ", " << queries << " queries, " << changes
+			  << " changes per step, " << subscriptions << " subscriptions of "
+			  << variables << " variables" << std::endl;
+	std::cout << "Steps: " << stepped << " in " << elapsed / 1000.0 << " ms, "
+			  << (elapsed > 0 ? stepped * 1e6 / elapsed : 0.0) << " steps/s" << std::endl;
+	if (!latencies.empty()) {
+		std::cout << "Step latency (us): p50 " << percentile(latencies, 0.5)
+				  << ", p90 " << percentile(latencies, 0.9)
+				  << ", p99 " << percentile(latencies, 0.99)
+				  << ", p99.9 " << percentile(latencies, 0.999)
+				  << ", max " << latencies.back() << std::endl;
+	}
+	if (measuringHub && stepped > 0) {
+		double cpu = (hubEnd - hubStart) * 1e6 / sysconf(_SC_CLK_TCK);
+		std::cout << "Hub CPU per step (us): " << cpu / stepped << " ("
+				  << cpu * 100.0 / elapsed << "% of the time)" << std::endl;
+	}
+	if (errors > 0 || failed > 0) {
+		std::cout << "Errors: " << errors << " steps not answered well, "
+				  << failed << " clients failed" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+void printUsage(std::ostream &out)
+{
+	out << "   Usage:\t" << argv0 << " [options] first_port" << std::endl;
+	out << std::endl;
+	out << "   Client i connects to the port first_port + i of the hub." << std::endl;
+	out << std::endl;
+	out << "Options:" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--clients NUM"
+		<< "Clients to run, up to " << MAX_CLIENTS << ". [default 1]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--host HOST"
+		<< "The host where the hub is located. [default: localhost]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--steps NUM"
+		<< "Steps each client takes. [default 1000]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--queries NUM"
+		<< "Queries each client sends per step. [default 0]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--changes NUM"
+		<< "Changes each client sends per step. [default 0]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--subscriptions NUM"
+		<< "Objects each client subscribes to. [default 0]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--variables NUM"
+		<< "Variables in each subscription. [default 1]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--objects NUM"
+		<< "Distinct objects, shared by the clients. [default 10]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--think NUM"
+		<< "Microseconds a client takes between steps. [default 0]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--hub-pid PID"
+		<< "Measure the CPU time of the hub process PID." << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--help -h"
+		<< "Display this message." << std::endl;
+}
+
+void parseOptions(int argc, char **argv)
+{
+	int c;
+	static struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"clients", required_argument, NULL, CLIENTS},
+		{"host", required_argument, NULL, HOST},
+		{"steps", required_argument, NULL, STEPS},
+		{"queries", required_argument, NULL, QUERIES},
+		{"changes", required_argument, NULL, CHANGES},
+		{"subscriptions", required_argument, NULL, SUBSCRIPTIONS},
+		{"variables", required_argument, NULL, VARIABLES},
+		{"objects", required_argument, NULL, OBJECTS},
+		{"think", required_argument, NULL, THINK},
+		{"hub-pid", required_argument, NULL, HUB_PID},
+		{NULL, 0, NULL, 0}
+	};
+
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, "h", long_options, &option_index)) != -1) {
+		int *count = NULL;
+		int minimum = 0;
+		int maximum = 0x7fffffff;
+		switch (c) {
+		case CLIENTS:
+			count = &clients;
+			minimum = 1;
+			maximum = MAX_CLIENTS;
+			break;
+
+		case HOST:
+			host = std::string(optarg);
+			break;
+
+		case STEPS:
+			count = &steps;
+			minimum = 1;
+			break;
+
+		case QUERIES:
+			count = &queries;
+			break;
+
+		case CHANGES:
+			count = &changes;
+			break;
+
+		case SUBSCRIPTIONS:
+			count = &subscriptions;
+			break;
+
+		case VARIABLES:
+			count = &variables;
+			minimum = 1;
+			maximum = 255;
+			break;
+
+		case OBJECTS:
+			count = &objects;
+			minimum = 1;
+			break;
+
+		case THINK:
+			if (sscanf(optarg, "%lu", &think) < 1) {
+				std::cerr << "Error parsing think time \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case HUB_PID:
+			count = &hubPid;
+			minimum = 1;
+			break;
+
+		case 'h':
+			printUsage(std::cout);
+			exit(0);
+			break;
+
+		default:
+			printUsage(std::cerr);
+			exit(1);
+		}
+
+		if (count != NULL && (sscanf(optarg, "%d", count) < 1
+							  || *count < minimum || *count > maximum)) {
+			std::cerr << "Error parsing " << long_options[option_index].name
+					  << " value \"" << optarg << '"' << std::endl;
+			printUsage(std::cerr);
+			exit(1);
+		}
+	}
+
+	if (optind == argc || sscanf(argv[optind], "%d", &firstPort) < 1) {
+		std::cerr << "Missing the first port of the hub." << std::endl;
+		printUsage(std::cerr);
+		exit(1);
+	}
+}
+
+void resolveHost()
+{
+	// Once, here: the clients then connect to the address, without a lookup each
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *result = NULL;
+	int error = getaddrinfo(host.c_str(), NULL, &hints, &result);
+	if (error != 0 || result == NULL) {
+		std::cerr << "Error resolving " << host << ": " << gai_strerror(error) << std::endl;
+		exit(1);
+	}
+
+	char address[INET_ADDRSTRLEN];
+	const struct sockaddr_in *resolved = reinterpret_cast<struct sockaddr_in*>(result->ai_addr);
+	if (inet_ntop(AF_INET, &resolved->sin_addr, address, sizeof(address)) != NULL) {
+		host = address;
+	}
+	freeaddrinfo(result);
+}
+
+void *runClient(void *context)
+{
+	ClientContext &client = *static_cast<ClientContext*>(context);
+	ClientResult &result = client.result;
+	result.latencies.reserve(steps);
+
+	tcpip::Socket *socket = NULL;
+	tcpip::Storage message, answers;
+	bool ready = false;
+	try {
+		connect(socket, firstPort + client.index);
+		if (subscriptions > 0) {
+			message.reset();
+			writeSubscriptions(message, client.index);
+			socket->sendExact(message);
+			socket->receiveExact(answers);
+		}
+		ready = true;
+	}
+	catch (tcpip::SocketException e) {
+		result.failure = std::string("can't start: ") + e.what();
+	}
+
+	// The measure starts when every client is ready (or failed to)
+	if (pthread_barrier_wait(&startBarrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+		startTime = Metrics::now();
+	}
+	if (!ready) {
+		delete socket;
+		return NULL;
+	}
+
+	try {
+		for (int step=0; step < steps; step++) {
+			message.reset();
+			writeStep(message, client.index, step);
+
+			unsigned long long sent = Metrics::now();
+			socket->sendExact(message);
+			socket->receiveExact(answers);
+			result.latencies.push_back(static_cast<unsigned long>(Metrics::now() - sent));
+
+			if (!isStepAnswered(answers)) {
+				result.errors++;
+			}
+			if (think > 0) {
+				usleep(think);
+			}
+		}
+
+		message.reset();
+		writeCommand(message, CMD_CLOSE, tcpip::Storage());
+		socket->sendExact(message);
+		socket->receiveExact(answers);
+	}
+	catch (tcpip::SocketException e) {
+		result.failure = std::string("lost the hub: ") + e.what();
+	}
+
+	socket->close();
+	delete socket;
+	return NULL;
+}
+
+void connect(tcpip::Socket *&socket, int port)
+{
+	for (int attempt=1; ; attempt++) {
+		socket = new tcpip::Socket(host, port);
+		try {
+			socket->connect();
+			return;
+		}
+		catch (tcpip::SocketException) {
+			delete socket;
+			socket = NULL;
+			if (attempt == CONNECT_ATTEMPTS) {
+				throw;
+			}
+		}
+		usleep(CONNECT_INTERVAL);
+	}
+}
+
+void writeCommand(tcpip::Storage &message, int code, const tcpip::Storage &content)
+{
+	tcpip::writeCommandSize(message, 1 + static_cast<int>(content.size()));
+	message.writeUnsignedByte(code);
+	message.writePacket(content.data(), static_cast<int>(content.size()));
+}
+
+/// The name of an object, the same for every client
+std::string objectId(int object)
+{
+	std::ostringstream id;
+	id << "veh" << object % objects;
+	return id.str();
+}
+
+void writeSubscriptions(tcpip::Storage &message, int client)
+{
+	tcpip::Storage content;
+	for (int i=0; i < subscriptions; i++) {
+		content.reset();
+		content.writeInt(0);
+		content.writeInt(0x7fffffff);
+		content.writeString(objectId(client + i));
+		content.writeUnsignedByte(variables);
+		for (int v=0; v < variables; v++) {
+			content.writeUnsignedByte(0x40 + v);
+		}
+		writeCommand(message, CMD_SUBSCRIBE_VEHICLE_VARIABLE, content);
+	}
+}
+
+void writeStep(tcpip::Storage &message, int client, int step)
+{
+	tcpip::Storage content;
+	for (int i=0; i < queries; i++) {
+		content.reset();
+		content.writeUnsignedByte(0x40 + i % 16);
+		content.writeString(objectId(step + i));
+		writeCommand(message, CMD_GET_VEHICLE_VARIABLE, content);
+	}
+
+	for (int i=0; i < changes; i++) {
+		content.reset();
+		content.writeUnsignedByte(0x40);
+		content.writeString(objectId(client + i));
+		content.writeUnsignedByte(TYPE_DOUBLE);
+		content.writeDouble(13.9);
+		writeCommand(message, CMD_SET_VEHICLE_VARIABLE, content);
+	}
+
+	content.reset();
+	content.writeInt(0);
+	writeCommand(message, CMD_SIMSTEP2, content);
+}
+
+bool isStepAnswered(const tcpip::Storage &answers)
+{
+	// Every answer comes before the step's, each a status possibly followed by a response
+	const unsigned char *bytes = answers.data();
+	unsigned int size = static_cast<unsigned int>(answers.size());
+	unsigned int offset = 0;
+	try {
+		while (offset < size) {
+			tcpip::StatusResponse status = tcpip::readStatusResponse(bytes, offset, size);
+			if (status.result != RTYPE_OK) {
+				return false;
+			}
+			if (status.span.code == CMD_SIMSTEP2) {
+				return true;
+			}
+
+			offset += status.span.length;
+			if (tcpip::hasResponseCommand(status.span.code)) {
+				offset += tcpip::readCommandSpan(bytes, offset, size).length;
+			}
+		}
+	}
+	catch (std::invalid_argument) {
+		// Not even the step was answered
+	}
+	return false;
+}
+
+bool readCpuTime(int pid, unsigned long long &ticks)
+{
+	std::ostringstream path;
+	path << "/proc/" << pid << "/stat";
+	std::ifstream in(path.str().c_str());
+	std::string stat;
+	if (!std::getline(in, stat)) {
+		return false;
+	}
+
+	// The command name may contain spaces, the fields are counted after it
+	size_t end = stat.rfind(')');
+	if (end == std::string::npos) {
+		return false;
+	}
+	std::istringstream fields(stat.substr(end + 1));
+	std::string field;
+	for (int i=3; i < 14; i++) {
+		fields >> field;
+	}
+
+	unsigned long long user, system;
+	if (!(fields >> user >> system)) {
+		return false;
+	}
+	ticks = user + system;
+	return true;
+}
+
+unsigned long percentile(const std::vector<unsigned long> &sorted, double fraction)
+{
+	size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
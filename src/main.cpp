@@ -1,28 +1,81 @@
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ostream>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <getopt.h>
 
+#include "Ensemble.h"
+#include "SumoLog.h"
 #include "TraCIHub.h"
 
 #define STEP_LENGTH 7
 #define SUMO_HOST 8
+#define NO_CACHE 9
+#define IO_THREADS 10
+#define WAIT_CLIENTS 11
+#define STATS_FILE 12
+#define STATS_INTERVAL 13
+#define STATS_SOCKET 14
+#define TRACE 15
+#define RECORD 16
+#define REPLAY 17
+#define REPLAY_PACED 18
+#define STEP_DEADLINE 19
+#define DEADLINE_POLICY 20
+#define QUEUE_LIMIT 21
+
+#define SHARED_MEMORY_PREFIX "shm:"
+#define REPLICA_SEPARATOR "+"
 
 std::string argv0 = "tracihub";
 
 std::string sumoHost = "localhost";
-int sumoPort;
 
-std::vector<int> clientPorts;
+/// One SUMO endpoint and one group of client endpoints per replica
+std::vector<tcpip::Endpoint> sumoEndpoints;
+std::vector<std::vector<tcpip::Endpoint> > clientEndpoints;
 
 int stepLength = 1000;
 
+bool caching = true;
+
+int ioThreads = 0;
+
+/// Clients to wait for before the first step (0 for all)
+int waitClients = 0;
+
+/// Milliseconds each client has to ask for a step (negative for no limit)
+int stepDeadline = -1;
+TraCIHub::DeadlinePolicy deadlinePolicy = TraCIHub::DEADLINE_SKIP;
+
+/// Bytes of answers queued for a client before its requests are held back
+unsigned long queueLimit = OutboundQueue::DEFAULT_LIMIT;
+
+/// Where the statistics are written and answered (empty if nowhere)
+std::string statsFile;
+int statsInterval = 100;
+std::string statsSocket;
+
+/// Where the timeline is written (empty if nowhere)
+std::string traceFile;
+
+/// Where the exchanges with SUMO are recorded, or replayed from (empty if not)
+std::string recordFile;
+std::string replayFile;
+bool replayPaced = false;
+
 
 void printUsage(std::ostream &out);
 void parseOptions(int argc, char **argv);
+void parseReplica(int argc, char **argv);
+bool parseEndpoint(const char *arg, tcpip::Endpoint &endpoint);
+std::string replicaPath(const std::string &path, size_t replica);
+void startReplay(std::vector<SumoReplayer*> &replayers);
+void stopReplay(std::vector<SumoReplayer*> &replayers);
 
 int main(int argc, char **argv)
 {
@@ -31,14 +84,68 @@ int main(int argc, char **argv)
 	}
 	parseOptions(argc, argv);
 
-	TraCIHub hub(sumoHost, sumoPort, clientPorts, stepLength);
-	return hub.execute();
+	// Whoever hangs up (a client, a reader of the statistics) is seen as a send error
+	signal(SIGPIPE, SIG_IGN);
+
+	Ensemble ensemble;
+	for (size_t i=0; i < sumoEndpoints.size(); i++) {
+		sumoEndpoints[i].host = sumoHost;
+
+		TraCIHub &hub = ensemble.addReplica(sumoEndpoints[i], clientEndpoints[i], stepLength);
+		hub.setResponseCaching(caching);
+		hub.setIOThreads(ioThreads);
+		hub.setQueueLimit(queueLimit);
+		if (waitClients > 0) {
+			hub.setWaitClients(waitClients);
+		}
+		if (stepDeadline >= 0) {
+			hub.setStepDeadline(stepDeadline, deadlinePolicy);
+		}
+		if (!statsFile.empty()) {
+			hub.setStatsFile(replicaPath(statsFile, i), statsInterval);
+		}
+		if (!statsSocket.empty()) {
+			hub.setStatsSocket(replicaPath(statsSocket, i));
+		}
+		if (!traceFile.empty()) {
+			hub.setTraceFile(replicaPath(traceFile, i));
+		}
+		if (!recordFile.empty()) {
+			hub.setRecordFile(replicaPath(recordFile, i));
+		}
+	}
+
+	// SUMO is replaced by answers from the log, on the endpoints where it's expected
+	std::vector<SumoReplayer*> replayers;
+	if (!replayFile.empty()) {
+		startReplay(replayers);
+	}
+
+	int result = ensemble.execute();
+
+	std::vector<SumoReplayer*>::iterator it;
+	for (it=replayers.begin(); it != replayers.end(); it++) {
+		(*it)->stop();
+		std::cout << "Replay: " << (*it)->answered() << " commands answered from the log, "
+				  << (*it)->missing() << " not found in it" << std::endl;
+	}
+	stopReplay(replayers);
+	return result;
 }
 
 void printUsage(std::ostream &out)
 {
 	out << "   Usage:\t" << argv0 << " [options] sumo_port"
 		<< " client_port [client_port ...]" << std::endl;
+	out << "\t\t[" REPLICA_SEPARATOR " sumo_port client_port [client_port ...] ...]" << std::endl;
+	out << std::endl;
+	out << "   Each group after a '" REPLICA_SEPARATOR "' is another SUMO replica with its own clients,"
+		<< std::endl;
+	out << "   all replicas are stepped concurrently (ensemble mode)." << std::endl;
+	out << "   Ports given as paths (with a '/') are Unix domain sockets." << std::endl;
+	out << "   Client ports given as shm:PATH exchange messages through shared memory,"
+		<< std::endl;
+	out << "   set up through the Unix domain socket at PATH." << std::endl;
 	out << std::endl;
 	out << "Options:" << std::endl;
 	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--sumo-host HOST"
@@ -46,6 +153,48 @@ void printUsage(std::ostream &out)
 	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--step-length NUM"
 		<< "The time (in ms) a timestep is supposed to represent. [default 1000]" 
 		<< std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--no-cache"
+		<< "Forward every query to SUMO, even if answered in the same timestep."
+		<< std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--io-threads NUM"
+		<< "Threads exchanging messages with the clients, 0 for none. [default 0]"
+		<< std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--wait-clients NUM"
+		<< "Clients to wait for before the first step, the others (and new ones"
+		<< std::endl;
+	out << '\t' << std::setw(30) << ""
+		<< "once a client leaves) join while running. [default: all]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--step-deadline MS"
+		<< "Milliseconds each client has to ask for a step. [default: no limit]"
+		<< std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--deadline-policy POLICY"
+		<< "What happens to a client late for a step: wait for it, skip it for"
+		<< std::endl;
+	out << '\t' << std::setw(30) << ""
+		<< "the step or detach it from the hub. [default: skip]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--queue-limit BYTES"
+		<< "Answers queued for a slow client before its requests are held back."
+		<< std::endl;
+	out << '\t' << std::setw(30) << ""
+		<< "[default " << OutboundQueue::DEFAULT_LIMIT << "]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--stats-file FILE"
+		<< "Write statistics (latencies, bytes, step phases) to FILE." << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--stats-interval NUM"
+		<< "Steps between writes of the statistics file. [default 100]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--stats-socket PATH"
+		<< "Answer connections to the Unix socket PATH with the statistics." << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--trace FILE"
+		<< "Write a timeline of the run to FILE (for chrome://tracing or Perfetto)."
+		<< std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--record FILE"
+		<< "Record every exchange with SUMO to FILE." << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--replay FILE"
+		<< "Don't use SUMO: answer from a FILE recorded before, on its port." << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--replay-paced"
+		<< "Take as long as SUMO took to answer when replaying." << std::endl;
+	out << '\t' << std::setw(30) << ""
+		<< "With several replicas, FILE and PATH get the replica as a suffix (.0, .1 ...)"
+		<< std::endl;
 	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--help -h"
 		<< "Display this message." << std::endl;
 }
@@ -59,6 +208,19 @@ void parseOptions(int argc, char **argv)
 		{"help", no_argument, NULL, 'h'},
 		{"step-length", required_argument, NULL, STEP_LENGTH},
 		{"sumo-host", required_argument, NULL, SUMO_HOST},
+		{"no-cache", no_argument, NULL, NO_CACHE},
+		{"io-threads", required_argument, NULL, IO_THREADS},
+		{"wait-clients", required_argument, NULL, WAIT_CLIENTS},
+		{"step-deadline", required_argument, NULL, STEP_DEADLINE},
+		{"deadline-policy", required_argument, NULL, DEADLINE_POLICY},
+		{"queue-limit", required_argument, NULL, QUEUE_LIMIT},
+		{"stats-file", required_argument, NULL, STATS_FILE},
+		{"stats-interval", required_argument, NULL, STATS_INTERVAL},
+		{"stats-socket", required_argument, NULL, STATS_SOCKET},
+		{"trace", required_argument, NULL, TRACE},
+		{"record", required_argument, NULL, RECORD},
+		{"replay", required_argument, NULL, REPLAY},
+		{"replay-paced", no_argument, NULL, REPLAY_PACED},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -76,6 +238,91 @@ void parseOptions(int argc, char **argv)
 			sumoHost = std::string(optarg);
 			break;
 
+		case NO_CACHE:
+			caching = false;
+			break;
+
+		case IO_THREADS:
+			if (sscanf(optarg, "%d", &ioThreads) < 1 || ioThreads < 0) {
+				std::cerr << "Error parsing number of threads \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case WAIT_CLIENTS:
+			if (sscanf(optarg, "%d", &waitClients) < 1 || waitClients < 1) {
+				std::cerr << "Error parsing number of clients \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case STEP_DEADLINE:
+			if (sscanf(optarg, "%d", &stepDeadline) < 1 || stepDeadline < 0) {
+				std::cerr << "Error parsing step deadline \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case DEADLINE_POLICY:
+			if (strcmp(optarg, "wait") == 0) {
+				deadlinePolicy = TraCIHub::DEADLINE_WAIT;
+			}
+			else if (strcmp(optarg, "skip") == 0) {
+				deadlinePolicy = TraCIHub::DEADLINE_SKIP;
+			}
+			else if (strcmp(optarg, "detach") == 0) {
+				deadlinePolicy = TraCIHub::DEADLINE_DETACH;
+			}
+			else {
+				std::cerr << "Unknown deadline policy \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case QUEUE_LIMIT:
+			if (sscanf(optarg, "%lu", &queueLimit) < 1) {
+				std::cerr << "Error parsing queue limit \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case STATS_FILE:
+			statsFile = std::string(optarg);
+			break;
+
+		case STATS_INTERVAL:
+			if (sscanf(optarg, "%d", &statsInterval) < 1 || statsInterval < 1) {
+				std::cerr << "Error parsing statistics interval \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case STATS_SOCKET:
+			statsSocket = std::string(optarg);
+			break;
+
+		case TRACE:
+			traceFile = std::string(optarg);
+			break;
+
+		case RECORD:
+			recordFile = std::string(optarg);
+			break;
+
+		case REPLAY:
+			replayFile = std::string(optarg);
+			break;
+
+		case REPLAY_PACED:
+			replayPaced = true;
+			break;
+
 		case 'h':
 			printUsage(std::cout);
 			exit(0);
@@ -90,9 +337,19 @@ void parseOptions(int argc, char **argv)
 		}
 	}
 
+	/* Obtains each replica, its SUMO server followed by its clients */
+	do {
+		parseReplica(argc, argv);
+	} while (optind < argc && strcmp(argv[optind++], REPLICA_SEPARATOR) == 0);
+}
+
+void parseReplica(int argc, char **argv)
+{
+	tcpip::Endpoint sumoEndpoint;
+
 	/* Obtains the port of the SUMO server */
 	if (optind < argc) {
-		if (sscanf(argv[optind], "%d", &sumoPort) < 1) {
+		if (!parseEndpoint(argv[optind], sumoEndpoint) || sumoEndpoint.sharedMemory) {
 			std::cerr << "Cannot parse SUMO server port \""
 					  << argv[optind] << '"' << std::endl;
 			printUsage(std::cerr);
@@ -107,21 +364,92 @@ void parseOptions(int argc, char **argv)
 	}
 
 	/* Obtains the ports of the SUMO clients */
-	if (optind == argc) {
+	std::vector<tcpip::Endpoint> clients;
+	if (optind == argc || strcmp(argv[optind], REPLICA_SEPARATOR) == 0) {
 		std::cerr << "Missing port for at least one client." << std::endl;
 		printUsage(std::cerr);
 		exit(1);
 	}
 
-	while(optind < argc) {
-		int port;
-		if (sscanf(argv[optind], "%d", &port) < 1) {
+	while(optind < argc && strcmp(argv[optind], REPLICA_SEPARATOR) != 0) {
+		tcpip::Endpoint endpoint;
+		if (!parseEndpoint(argv[optind], endpoint)) {
 			std::cerr << "Cannot parse client port \""
 					  << argv[optind] << '"' << std::endl;
 			printUsage(std::cerr);
 			exit(1);
 		}
 		optind++;
-		clientPorts.push_back(port);
+		clients.push_back(endpoint);
+	}
+
+	sumoEndpoints.push_back(sumoEndpoint);
+	clientEndpoints.push_back(clients);
+}
+
+bool parseEndpoint(const char *arg, tcpip::Endpoint &endpoint)
+{
+	endpoint.port = 0;
+	endpoint.path = "";
+	endpoint.sharedMemory = false;
+
+	// Shared memory is set up through a Unix domain socket
+	if (strncmp(arg, SHARED_MEMORY_PREFIX, strlen(SHARED_MEMORY_PREFIX)) == 0) {
+		arg += strlen(SHARED_MEMORY_PREFIX);
+		endpoint.sharedMemory = true;
+		endpoint.path = arg;
+		return strchr(arg, '/') != NULL;
+	}
+
+	if (strchr(arg, '/') != NULL) {
+		endpoint.path = arg;
+		return true;
+	}
+
+	return sscanf(arg, "%d", &endpoint.port) == 1;
+}
+
+std::string replicaPath(const std::string &path, size_t replica)
+{
+	if (sumoEndpoints.size() == 1) {
+		return path;
+	}
+
+	std::ostringstream replicaPath;
+	replicaPath << path << '.' << replica;
+	return replicaPath.str();
+}
+
+void startReplay(std::vector<SumoReplayer*> &replayers)
+{
+	for (size_t i=0; i < sumoEndpoints.size(); i++) {
+		SumoReplayer *replayer = new SumoReplayer(sumoEndpoints[i]);
+		replayers.push_back(replayer);
+
+		std::string error;
+		if (!replayer->load(replicaPath(replayFile, i), error)) {
+			std::cerr << "Error loading the replay: " << error << std::endl;
+			stopReplay(replayers);
+			exit(1);
+		}
+		replayer->setPaced(replayPaced);
+
+		try {
+			replayer->start();
+		}
+		catch (tcpip::SocketException e) {
+			std::cerr << "Error replaying SUMO: " << e.what() << std::endl;
+			stopReplay(replayers);
+			exit(1);
+		}
+	}
+}
+
+void stopReplay(std::vector<SumoReplayer*> &replayers)
+{
+	std::vector<SumoReplayer*>::iterator it;
+	for (it=replayers.begin(); it != replayers.end(); it++) {
+		delete *it;
 	}
+	replayers.clear();
 }
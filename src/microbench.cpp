@@ -0,0 +1,665 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tcpip/socket.h"
+#include "tcpip/storage.h"
+#include "Client.h"
+#include "TraCIConstants.h"
+#include "util.h"
+
+#define TIME 1
+#define FILTER 2
+
+/** \brief Microbenchmarks of the message primitives.
+ *
+ * Measures the Storage primitives, the framing helpers of util.h and the
+ * handling of client commands (Client::getCommands, which calls
+ * Client::handleCommand for each command), on messages from a status
+ * reply to several megabytes. Each case is repeated for a minimum time,
+ * and reported in ns per operation and MB/s.
+ */
+
+namespace {
+
+	const size_t KB = 1024;
+	const size_t MB = 1024 * 1024;
+
+	/// Tries to connect while the client endpoint isn't listening yet
+	const int CONNECT_ATTEMPTS = 500;
+	const useconds_t CONNECT_INTERVAL = 10000;
+
+	/// Nanoseconds from an arbitrary point (a monotonic clock)
+	unsigned long long nanoseconds()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return static_cast<unsigned long long>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+	}
+
+	/// Keeps the values read from being optimized away
+	volatile unsigned long sink = 0;
+
+	/// A string of \p length bytes
+	std::string text(size_t length)
+	{
+		return std::string(length, 'x');
+	}
+
+	/// Describes a size in bytes, in the largest unit that divides it
+	std::string describeSize(size_t bytes)
+	{
+		std::ostringstream description;
+		if (bytes >= MB && bytes % MB == 0) {
+			description << bytes / MB << " MB";
+		} else if (bytes >= KB && bytes % KB == 0) {
+			description << bytes / KB << " KB";
+		} else {
+			description << bytes << " B";
+		}
+		return description.str();
+	}
+
+}
+
+std::string argv0 = "microbench";
+
+/// Minimum time each case is repeated for, in ms
+int minimumTime = 200;
+
+/// Only the cases whose name contains it are run (all if empty)
+std::string filter;
+
+
+/** \brief A case: the same operations, run as many times as measuring takes.
+ *
+ * Anything run() prepares before the operations, such as a copy of the
+ * input, is left out of the time it returns.
+ */
+class Benchmark {
+
+ public:
+	/**
+	 * \param name What is measured
+	 * \param size The size of each operation's input, as reported
+	 * \param operations Number of operations in each run
+	 * \param bytes Bytes handled in each run
+	 */
+	Benchmark(const std::string &name, size_t size, unsigned long operations,
+			  unsigned long long bytes) :
+		myName(name),
+		mySize(size),
+		myOperations(operations),
+		myBytes(bytes)
+	{
+		// No further initialization needed
+	}
+
+	virtual ~Benchmark() {}
+
+	/// Runs the operations once, returning the nanoseconds they took
+	virtual unsigned long long run() = 0;
+
+	/// Repeats the operations for the minimum time and reports them
+	void measure();
+
+ protected:
+	std::string myName;
+	size_t mySize;
+	unsigned long myOperations;
+	unsigned long long myBytes;
+};
+
+void Benchmark::measure()
+{
+	if (!filter.empty() && myName.find(filter) == std::string::npos) {
+		return;
+	}
+
+	// The first run warms up the caches and allocations
+	run();
+
+	unsigned long long elapsed = 0;
+	unsigned long runs = 0;
+	while (elapsed < minimumTime * 1000000ULL) {
+		elapsed += run();
+		runs++;
+	}
+
+	double operations = static_cast<double>(myOperations) * runs;
+	double bytes = static_cast<double>(myBytes) * runs;
+	std::cout << std::setiosflags(std::ios::left) << std::setw(36) << myName
+			  << std::resetiosflags(std::ios::left)
+			  << std::setw(8) << describeSize(mySize)
+			  << std::setw(12) << elapsed / operations
+			  << std::setw(12) << bytes * 1000.0 / elapsed << std::endl;
+}
+
+
+/// Writes integers into a storage
+class WriteInts : public Benchmark {
+
+ public:
+	WriteInts(unsigned long count) :
+		Benchmark("Storage::writeInt", 4, count, 4ULL * count),
+		myStorage()
+	{
+		myStorage.reserve(4 * count);
+	}
+
+	unsigned long long run()
+	{
+		myStorage.reset();
+		unsigned long long start = nanoseconds();
+		for (unsigned long i=0; i < myOperations; i++) {
+			myStorage.writeInt(static_cast<int>(i));
+		}
+		return nanoseconds() - start;
+	}
+
+ private:
+	tcpip::Storage myStorage;
+};
+
+
+/// Reads what was written into a storage (from a fresh copy each run)
+class ReadStorage : public Benchmark {
+
+ public:
+	ReadStorage(const std::string &name, size_t size, unsigned long count,
+				const tcpip::Storage &input) :
+		Benchmark(name, size, count, input.size()),
+		myInput(input),
+		myStorage()
+	{
+		// No further initialization needed
+	}
+
+	unsigned long long run()
+	{
+		myStorage = myInput;
+		unsigned long long start = nanoseconds();
+		read();
+		return nanoseconds() - start;
+	}
+
+ protected:
+	/// Reads each of the operations
+	virtual void read() = 0;
+
+	tcpip::Storage myInput;
+	tcpip::Storage myStorage;
+};
+
+class ReadInts : public ReadStorage {
+
+ public:
+	ReadInts(unsigned long count) :
+		ReadStorage("Storage::readInt", 4, count, prepare(count))
+	{
+		// No further initialization needed
+	}
+
+ private:
+	static tcpip::Storage prepare(unsigned long count)
+	{
+		tcpip::Storage input;
+		for (unsigned long i=0; i < count; i++) {
+			input.writeInt(static_cast<int>(i));
+		}
+		return input;
+	}
+
+	void read()
+	{
+		unsigned long sum = 0;
+		for (unsigned long i=0; i < myOperations; i++) {
+			sum += myStorage.readInt();
+		}
+		sink = sum;
+	}
+};
+
+class ReadDoubles : public ReadStorage {
+
+ public:
+	ReadDoubles(unsigned long count) :
+		ReadStorage("Storage::readDouble", 8, count, prepare(count))
+	{
+		// No further initialization needed
+	}
+
+ private:
+	static tcpip::Storage prepare(unsigned long count)
+	{
+		tcpip::Storage input;
+		for (unsigned long i=0; i < count; i++) {
+			input.writeDouble(i * 0.5);
+		}
+		return input;
+	}
+
+	void read()
+	{
+		double sum = 0;
+		for (unsigned long i=0; i < myOperations; i++) {
+			sum += myStorage.readDouble();
+		}
+		sink = static_cast<unsigned long>(sum);
+	}
+};
+
+class ReadStrings : public ReadStorage {
+
+ public:
+	ReadStrings(size_t length, unsigned long count) :
+		ReadStorage("Storage::readString", length, count, prepare(length, count))
+	{
+		// No further initialization needed
+	}
+
+ private:
+	static tcpip::Storage prepare(size_t length, unsigned long count)
+	{
+		tcpip::Storage input;
+		for (unsigned long i=0; i < count; i++) {
+			input.writeString(text(length));
+		}
+		return input;
+	}
+
+	void read()
+	{
+		unsigned long sum = 0;
+		for (unsigned long i=0; i < myOperations; i++) {
+			sum += myStorage.readString().size();
+		}
+		sink = sum;
+	}
+};
+
+/// Lists of 16 strings of 16 bytes, as the IDs of the vehicles on a lane
+class ReadStringLists : public ReadStorage {
+
+ public:
+	ReadStringLists(unsigned long count) :
+		ReadStorage("Storage::readStringList", 4 + 16 * (4 + 16), count, prepare(count))
+	{
+		// No further initialization needed
+	}
+
+ private:
+	static tcpip::Storage prepare(unsigned long count)
+	{
+		std::vector<std::string> list(16, text(16));
+		tcpip::Storage input;
+		for (unsigned long i=0; i < count; i++) {
+			input.writeStringList(list);
+		}
+		return input;
+	}
+
+	void read()
+	{
+		unsigned long sum = 0;
+		for (unsigned long i=0; i < myOperations; i++) {
+			sum += myStorage.readStringList().size();
+		}
+		sink = sum;
+	}
+};
+
+class ReadCommandSizes : public ReadStorage {
+
+ public:
+	/// Commands of \p size bytes take 1 byte for it up to 255, 5 after
+	ReadCommandSizes(size_t size, unsigned long count) :
+		ReadStorage("tcpip::readCommandSize", size, count, prepare(size, count))
+	{
+		// No further initialization needed
+	}
+
+ private:
+	static tcpip::Storage prepare(size_t size, unsigned long count)
+	{
+		tcpip::Storage input;
+		for (unsigned long i=0; i < count; i++) {
+			tcpip::writeCommandSize(input, static_cast<int>(size));
+		}
+		return input;
+	}
+
+	void read()
+	{
+		unsigned long sum = 0;
+		for (unsigned long i=0; i < myOperations; i++) {
+			sum += tcpip::readCommandSize(myStorage);
+		}
+		sink = sum;
+	}
+};
+
+
+class WriteCommandSizes : public Benchmark {
+
+ public:
+	WriteCommandSizes(size_t size, unsigned long count) :
+		Benchmark("tcpip::writeCommandSize", size, count, (size < 255 ? 1ULL : 5ULL) * count),
+		myStorage()
+	{
+		myStorage.reserve(5 * count);
+	}
+
+	unsigned long long run()
+	{
+		myStorage.reset();
+		unsigned long long start = nanoseconds();
+		for (unsigned long i=0; i < myOperations; i++) {
+			tcpip::writeCommandSize(myStorage, static_cast<int>(mySize));
+		}
+		return nanoseconds() - start;
+	}
+
+ private:
+	tcpip::Storage myStorage;
+};
+
+
+/// Appends answers (from a status to a large subscription result) to a message
+class WriteStorages : public Benchmark {
+
+ public:
+	WriteStorages(size_t size, unsigned long count) :
+		Benchmark("Storage::writeStorage", size, count, static_cast<unsigned long long>(size) * count),
+		myAnswer(),
+		myStorage()
+	{
+		memset(myAnswer.append(static_cast<unsigned int>(size)), 'x', size);
+		myStorage.reserve(size * count);
+	}
+
+	unsigned long long run()
+	{
+		myStorage.reset();
+		unsigned long long start = nanoseconds();
+		for (unsigned long i=0; i < myOperations; i++) {
+			myStorage.writeStorage(myAnswer);
+		}
+		return nanoseconds() - start;
+	}
+
+ private:
+	tcpip::Storage myAnswer;
+	tcpip::Storage myStorage;
+};
+
+
+/** \brief Messages of commands from a client, as handled by the hub.
+ *
+ * Another thread sends the messages over a Unix domain socket, so the
+ * time includes receiving them (into the buffer of the socket, from
+ * where they are handled without copies).
+ */
+class HandleCommands : public Benchmark {
+
+ public:
+	/**
+	 * \param commands The commands in each message
+	 * \param length The length of each command (at least 6 bytes)
+	 * \param messages The messages sent in each run
+	 */
+	HandleCommands(unsigned long commands, size_t length, unsigned long messages);
+
+	~HandleCommands();
+
+	unsigned long long run();
+
+ private:
+	tcpip::Endpoint myEndpoint;
+	Client *myClient;
+	tcpip::Socket *mySender;
+	tcpip::Storage myMessage;
+	unsigned long myMessages;
+	bool myFailed;
+
+	static void *connect(void *benchmark);
+	static void *send(void *benchmark);
+
+	/// The name of the case, with the commands in each message
+	static std::string describeCommands(unsigned long commands);
+
+	/// Starts a thread, or gives up on the benchmark
+	void start(pthread_t &thread, void *(*routine)(void*));
+};
+
+HandleCommands::HandleCommands(unsigned long commands, size_t length, unsigned long messages) :
+	Benchmark(describeCommands(commands), length, commands * messages,
+			  (length * commands + 4ULL) * messages),
+	myEndpoint(),
+	myClient(NULL),
+	mySender(NULL),
+	myMessage(),
+	myMessages(messages),
+	myFailed(false)
+{
+	// Queries of a vehicle variable, padded to the length with its ID
+	size_t header = (length < 256)? 1 : 5;
+	std::string id = text(length - header - 1 - 1 - 4);
+	for (unsigned long i=0; i < commands; i++) {
+		tcpip::writeCommandSize(myMessage, static_cast<int>(length - header));
+		myMessage.writeUnsignedByte(CMD_GET_VEHICLE_VARIABLE);
+		myMessage.writeUnsignedByte(0x40);
+		myMessage.writeString(id);
+	}
+
+	std::ostringstream path;
+	path << "/tmp/microbench." << getpid();
+	myEndpoint.path = path.str();
+	myEndpoint.port = 0;
+	myEndpoint.sharedMemory = false;
+	myClient = new Client(myEndpoint);
+
+	pthread_t connector;
+	start(connector, &HandleCommands::connect);
+	try {
+		myClient->acceptConnection();
+	}
+	catch (tcpip::SocketException e) {
+		std::cerr << "Error accepting the connection: " << e.what() << std::endl;
+		exit(1);
+	}
+	pthread_join(connector, NULL);
+	if (myFailed) {
+		exit(1);
+	}
+}
+
+HandleCommands::~HandleCommands()
+{
+	myClient->closeConnection();
+	mySender->close();
+	delete mySender;
+	delete myClient;
+	unlink(myEndpoint.path.c_str());
+}
+
+unsigned long long HandleCommands::run()
+{
+	std::vector<tcpip::CommandSpan> commands;
+	commands.reserve(myOperations / myMessages);
+
+	pthread_t sender;
+	unsigned long long start = nanoseconds();
+	this->start(sender, &HandleCommands::send);
+	for (unsigned long i=0; i < myMessages; i++) {
+		commands.clear();
+		if (!myClient->getCommands(commands, 0)) {
+			std::cerr << "Error handling the commands" << std::endl;
+			exit(1);
+		}
+		sink = commands.size();
+	}
+	unsigned long long elapsed = nanoseconds() - start;
+	pthread_join(sender, NULL);
+	return elapsed;
+}
+
+void *HandleCommands::connect(void *benchmark)
+{
+	HandleCommands &self = *static_cast<HandleCommands*>(benchmark);
+	for (int attempt=1; ; attempt++) {
+		self.mySender = new tcpip::Socket(self.myEndpoint);
+		try {
+			self.mySender->connect();
+			return NULL;
+		}
+		catch (tcpip::SocketException e) {
+			delete self.mySender;
+			self.mySender = NULL;
+			if (attempt == CONNECT_ATTEMPTS) {
+				std::cerr << "Error connecting to the client endpoint: "
+						  << e.what() << std::endl;
+				self.myFailed = true;
+				return NULL;
+			}
+		}
+		usleep(CONNECT_INTERVAL);
+	}
+}
+
+void *HandleCommands::send(void *benchmark)
+{
+	HandleCommands &self = *static_cast<HandleCommands*>(benchmark);
+	try {
+		for (unsigned long i=0; i < self.myMessages; i++) {
+			self.mySender->sendExact(self.myMessage);
+		}
+	}
+	catch (tcpip::SocketException e) {
+		std::cerr << "Error sending the commands: " << e.what() << std::endl;
+		exit(1);
+	}
+	return NULL;
+}
+
+std::string HandleCommands::describeCommands(unsigned long commands)
+{
+	std::ostringstream name;
+	name << "Client::handleCommand (" << commands << "/msg)";
+	return name.str();
+}
+
+void HandleCommands::start(pthread_t &thread, void *(*routine)(void*))
+{
+	int error = pthread_create(&thread, NULL, routine, this);
+	if (error != 0) {
+		std::cerr << "Error starting a thread: " << strerror(error) << std::endl;
+		exit(1);
+	}
+}
+
+
+void printUsage(std::ostream &out);
+void parseOptions(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+	if (argc >= 1) {
+		argv0 = std::string(argv[0]);
+	}
+	parseOptions(argc, argv);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setiosflags(std::ios::left) << std::setw(36) << "Benchmark"
+			  << std::resetiosflags(std::ios::left) << std::setw(8) << "Size"
+			  << std::setw(12) << "ns/op" << std::setw(12) << "MB/s" << std::endl;
+
+	// Each run handles about a megabyte, or a single operation when larger
+	WriteInts(256 * KB).measure();
+	ReadInts(256 * KB).measure();
+	ReadDoubles(128 * KB).measure();
+	ReadStrings(8, 64 * KB).measure();
+	ReadStrings(KB, KB).measure();
+	ReadStrings(4 * MB, 1).measure();
+	ReadStringLists(2 * KB).measure();
+
+	ReadCommandSizes(16, MB).measure();
+	ReadCommandSizes(KB, 256 * KB).measure();
+	WriteCommandSizes(16, MB).measure();
+	WriteCommandSizes(KB, 256 * KB).measure();
+
+	WriteStorages(7, 128 * KB).measure();
+	WriteStorages(KB, KB).measure();
+	WriteStorages(64 * KB, 16).measure();
+	WriteStorages(4 * MB, 1).measure();
+
+	// A query alone, a client's queries for a step, and a large change
+	HandleCommands(1, 16, 16 * KB).measure();
+	HandleCommands(64, 16, KB).measure();
+	HandleCommands(4 * KB, 16, 16).measure();
+	HandleCommands(1, 4 * MB, 1).measure();
+
+	return 0;
+}
+
+void printUsage(std::ostream &out)
+{
+	out << "   Usage:\t" << argv0 << " [options]" << std::endl;
+	out << std::endl;
+	out << "Options:" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--time NUM"
+		<< "Minimum time (in ms) each case is repeated for. [default 200]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--filter TEXT"
+		<< "Run only the cases whose name contains TEXT." << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--help -h"
+		<< "Display this message." << std::endl;
+}
+
+void parseOptions(int argc, char **argv)
+{
+	int c;
+	static struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"time", required_argument, NULL, TIME},
+		{"filter", required_argument, NULL, FILTER},
+		{NULL, 0, NULL, 0}
+	};
+
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, "h", long_options, &option_index)) != -1) {
+		switch (c) {
+		case TIME:
+			if (sscanf(optarg, "%d", &minimumTime) < 1 || minimumTime < 1) {
+				std::cerr << "Error parsing time \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case FILTER:
+			filter = std::string(optarg);
+			break;
+
+		case 'h':
+			printUsage(std::cout);
+			exit(0);
+			break;
+
+		default:
+			printUsage(std::cerr);
+			exit(1);
+		}
+	}
+}
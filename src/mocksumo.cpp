@@ -0,0 +1,329 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "tcpip/socket.h"
+#include "tcpip/storage.h"
+#include "Metrics.h"
+#include "TraCIConstants.h"
+#include "util.h"
+
+#define STEP_TIME 1
+#define BUSY 2
+#define ANSWER_SIZE 3
+#define SUBSCRIPTION_SIZE 4
+#define STEP_LENGTH 5
+
+/** \brief A stand-in for SUMO, for benchmarking the hub.
+ *
+ * Serves a single connection, like SUMO. Steps take a configurable time,
+ * queries are answered with a string of a configurable size and every
+ * subscribed variable is answered each step with such a string too.
+ * Changes are acknowledged and forgotten.
+ */
+
+std::string argv0 = "mocksumo";
+
+tcpip::Endpoint endpoint;
+
+/// Microseconds a step takes, spent sleeping or computing
+unsigned long stepTime = 0;
+bool busy = false;
+
+/// Bytes in the value of each query answer, and of each subscribed variable
+int answerSize = 8;
+int subscriptionSize = 8;
+
+int stepLength = 1000;
+
+/// The variables subscribed for each object, by command and object
+std::map<std::pair<int, std::string>, std::vector<int> > subscriptions;
+
+int currentTime = 0;
+
+
+void printUsage(std::ostream &out);
+void parseOptions(int argc, char **argv);
+void serve(tcpip::Socket &socket);
+bool answer(tcpip::Storage &request, tcpip::Storage &answers);
+void step(int target, tcpip::Storage &answers);
+void writeStatus(tcpip::Storage &answers, int code, int result, const std::string &description);
+void writeSubscription(tcpip::Storage &answers, int code, const std::string &id,
+					   const std::vector<int> &variables);
+void writeValue(tcpip::Storage &answers, int size);
+
+int main(int argc, char **argv)
+{
+	if (argc >= 1) {
+		argv0 = std::string(argv[0]);
+	}
+	parseOptions(argc, argv);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	tcpip::Socket socket(endpoint);
+	try {
+		socket.accept();
+	}
+	catch (tcpip::SocketException e) {
+		std::cerr << "Error waiting for the hub: " << e.what() << std::endl;
+		return 1;
+	}
+
+	int result = 0;
+	try {
+		serve(socket);
+	}
+	catch (tcpip::SocketException) {
+		// The hub is gone without closing, nothing left to answer
+	}
+	catch (std::invalid_argument e) {
+		std::cerr << "Error reading a request: " << e.what() << std::endl;
+		result = 1;
+	}
+	socket.close();
+	return result;
+}
+
+void printUsage(std::ostream &out)
+{
+	out << "   Usage:\t" << argv0 << " [options] port" << std::endl;
+	out << std::endl;
+	out << "   A port given as a path (with a '/') is a Unix domain socket." << std::endl;
+	out << std::endl;
+	out << "Options:" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--step-time NUM"
+		<< "Microseconds each step takes. [default 0]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--busy"
+		<< "Spend the step time computing instead of sleeping." << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--answer-size NUM"
+		<< "Bytes in the value answering each query. [default 8]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--subscription-size NUM"
+		<< "Bytes in each subscribed value, per step. [default 8]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--step-length NUM"
+		<< "The time (in ms) a timestep represents. [default 1000]" << std::endl;
+	out << '\t' << std::setiosflags(std::ios::left) << std::setw(30) << "--help -h"
+		<< "Display this message." << std::endl;
+}
+
+void parseOptions(int argc, char **argv)
+{
+	int c;
+	static struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"step-time", required_argument, NULL, STEP_TIME},
+		{"busy", no_argument, NULL, BUSY},
+		{"answer-size", required_argument, NULL, ANSWER_SIZE},
+		{"subscription-size", required_argument, NULL, SUBSCRIPTION_SIZE},
+		{"step-length", required_argument, NULL, STEP_LENGTH},
+		{NULL, 0, NULL, 0}
+	};
+
+	int option_index = 0;
+	while ((c = getopt_long(argc, argv, "h", long_options, &option_index)) != -1) {
+		switch (c) {
+		case STEP_TIME:
+			if (sscanf(optarg, "%lu", &stepTime) < 1) {
+				std::cerr << "Error parsing step time \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case BUSY:
+			busy = true;
+			break;
+
+		case ANSWER_SIZE:
+			if (sscanf(optarg, "%d", &answerSize) < 1 || answerSize < 0) {
+				std::cerr << "Error parsing answer size \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case SUBSCRIPTION_SIZE:
+			if (sscanf(optarg, "%d", &subscriptionSize) < 1 || subscriptionSize < 0) {
+				std::cerr << "Error parsing subscription size \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case STEP_LENGTH:
+			if (sscanf(optarg, "%d", &stepLength) < 1 || stepLength < 1) {
+				std::cerr << "Error parsing step length \"" << optarg << '"' << std::endl;
+				printUsage(std::cerr);
+				exit(1);
+			}
+			break;
+
+		case 'h':
+			printUsage(std::cout);
+			exit(0);
+			break;
+
+		default:
+			printUsage(std::cerr);
+			exit(1);
+		}
+	}
+
+	endpoint.port = 0;
+	endpoint.sharedMemory = false;
+	if (optind == argc) {
+		std::cerr << "Missing port." << std::endl;
+		printUsage(std::cerr);
+		exit(1);
+	}
+	if (strchr(argv[optind], '/') != NULL) {
+		endpoint.path = argv[optind];
+	}
+	else if (sscanf(argv[optind], "%d", &endpoint.port) < 1) {
+		std::cerr << "Cannot parse port \"" << argv[optind] << '"' << std::endl;
+		printUsage(std::cerr);
+		exit(1);
+	}
+}
+
+void serve(tcpip::Socket &socket)
+{
+	tcpip::Storage request, answers;
+	bool open = true;
+	while (open) {
+		socket.receiveExact(request);
+		open = answer(request, answers);
+		socket.sendExact(answers);
+	}
+}
+
+bool answer(tcpip::Storage &request, tcpip::Storage &answers)
+{
+	answers.reset();
+
+	std::vector<tcpip::CommandSpan> commands;
+	tcpip::splitCommands(request, commands);
+
+	std::vector<tcpip::CommandSpan>::const_iterator it;
+	for (it=commands.begin(); it != commands.end(); it++) {
+		tcpip::Storage command(request.data() + it->offset, static_cast<int>(it->length));
+		command.skip(tcpip::commandSizeLength(command.data()) + 1);
+
+		int code = it->code;
+		if (code == CMD_SIMSTEP2) {
+			step(command.readInt(), answers);
+		}
+		else if (code == CMD_CLOSE) {
+			writeStatus(answers, code, RTYPE_OK, "");
+			return false;
+		}
+		else if (tcpip::isGetCommand(code)) {
+			int variable = command.readUnsignedByte();
+			std::string id = command.readString();
+
+			writeStatus(answers, code, RTYPE_OK, "");
+			tcpip::writeCommandSize(answers, 1 + 1 + 4 + static_cast<int>(id.length())
+									+ 1 + 4 + answerSize);
+			answers.writeUnsignedByte(code + 0x10);
+			answers.writeUnsignedByte(variable);
+			answers.writeString(id);
+			writeValue(answers, answerSize);
+		}
+		else if (tcpip::isSubscribeCommand(code)) {
+			command.readInt();
+			command.readInt();
+			std::string id = command.readString();
+			int count = command.readUnsignedByte();
+
+			std::vector<int> variables;
+			for (int i=0; i < count; i++) {
+				variables.push_back(command.readUnsignedByte());
+			}
+
+			writeStatus(answers, code, RTYPE_OK, "");
+			if (variables.empty()) {
+				subscriptions.erase(std::make_pair(code, id));
+			}
+			else {
+				subscriptions[std::make_pair(code, id)] = variables;
+				writeSubscription(answers, code, id, variables);
+			}
+		}
+		else if (tcpip::changesState(code)) {
+			writeStatus(answers, code, RTYPE_OK, "");
+		}
+		else {
+			writeStatus(answers, code, RTYPE_NOTIMPLEMENTED, "Not implemented by the mock");
+		}
+	}
+	return true;
+}
+
+void step(int target, tcpip::Storage &answers)
+{
+	if (stepTime > 0) {
+		if (busy) {
+			unsigned long long until = Metrics::now() + stepTime;
+			while (Metrics::now() < until) {
+				// Computing the step
+			}
+		}
+		else {
+			usleep(stepTime);
+		}
+	}
+
+	do {
+		currentTime += stepLength;
+	} while (currentTime < target);
+
+	writeStatus(answers, CMD_SIMSTEP2, RTYPE_OK, "");
+	answers.writeInt(static_cast<int>(subscriptions.size()));
+
+	std::map<std::pair<int, std::string>, std::vector<int> >::const_iterator it;
+	for (it=subscriptions.begin(); it != subscriptions.end(); it++) {
+		writeSubscription(answers, it->first.first, it->first.second, it->second);
+	}
+}
+
+void writeStatus(tcpip::Storage &answers, int code, int result, const std::string &description)
+{
+	answers.writeUnsignedByte(1 + 1 + 1 + 4 + static_cast<int>(description.length()));
+	answers.writeUnsignedByte(code);
+	answers.writeUnsignedByte(result);
+	answers.writeString(description);
+}
+
+void writeSubscription(tcpip::Storage &answers, int code, const std::string &id,
+					   const std::vector<int> &variables)
+{
+	int size = 1 + 4 + static_cast<int>(id.length()) + 1
+		+ static_cast<int>(variables.size()) * (1 + 1 + 1 + 4 + subscriptionSize);
+	tcpip::writeCommandSize(answers, size);
+	answers.writeUnsignedByte(code + 0x10);
+	answers.writeString(id);
+	answers.writeUnsignedByte(static_cast<int>(variables.size()));
+
+	std::vector<int>::const_iterator it;
+	for (it=variables.begin(); it != variables.end(); it++) {
+		answers.writeUnsignedByte(*it);
+		answers.writeUnsignedByte(RTYPE_OK);
+		writeValue(answers, subscriptionSize);
+	}
+}
+
+void writeValue(tcpip::Storage &answers, int size)
+{
+	// A string, so that any size can be answered
+	answers.writeUnsignedByte(TYPE_STRING);
+	answers.writeInt(size);
+	memset(answers.append(static_cast<unsigned int>(size)), 'x', static_cast<size_t>(size));
+}
@@ -26,12 +26,16 @@
 	#include <errno.h>
 	#include <fcntl.h>
 	#include <unistd.h>
+	#include <sys/uio.h>
+	#include <sys/un.h>
+	#include <poll.h>
 #else
 	#ifdef ERROR
 		#undef ERROR
 	#endif
 
 	#include <winsock2.h>
+	#include <ws2tcpip.h>
 
 	#ifndef vsnprintf
 		#define vsnprintf _vsnprintf
@@ -46,6 +50,7 @@
 #include <string>
 #include <vector>
 #include <string>
+#include <sstream>
 #include <algorithm>
 #include <string.h>
 
@@ -62,6 +67,7 @@ using namespace std;
 namespace tcpip
 {
 	const int Socket::lengthLen = 4;
+	const size_t Socket::RECV_BUFFER_SIZE = 65536;
 
 #ifdef WIN32
 	bool Socket::init_windows_sockets_ = true;
@@ -74,9 +80,13 @@ namespace tcpip
 		Socket(std::string host, int port) 
 		: host_( host ),
 		port_( port ),
+		path_(""),
 		socket_(-1),
 		server_socket_(-1),
 		blocking_(true),
+		recv_buffer_(),
+		recv_begin_(0),
+		recv_end_(0),
 		verbose_(false)
 	{
 		init();
@@ -87,9 +97,30 @@ namespace tcpip
 		Socket(int port) 
 		: host_(""),
 		port_( port ),
+		path_(""),
 		socket_(-1),
 		server_socket_(-1),
 		blocking_(true),
+		recv_buffer_(),
+		recv_begin_(0),
+		recv_end_(0),
+		verbose_(false)
+	{
+		init();
+	}
+
+	// ----------------------------------------------------------------------
+	Socket::
+		Socket(const Endpoint &endpoint) 
+		: host_( endpoint.host ),
+		port_( endpoint.port ),
+		path_( endpoint.path ),
+		socket_(-1),
+		server_socket_(-1),
+		blocking_(true),
+		recv_buffer_(),
+		recv_begin_(0),
+		recv_end_(0),
 		verbose_(false)
 	{
 		init();
@@ -130,6 +161,9 @@ namespace tcpip
 			::closesocket( server_socket_ );
 #else
 			::close( server_socket_ );
+
+			if( !path_.empty() )
+				::unlink( path_.c_str() );
 #endif
 			server_socket_ = -1;
 		}
@@ -166,12 +200,41 @@ namespace tcpip
 	}
 
 
+	// ----------------------------------------------------------------------
+	std::string
+		Socket::
+		address()
+		const
+	{
+		if( !path_.empty() )
+			return path_;
+
+		std::ostringstream out;
+		out << "port " << port_;
+		return out.str();
+	}
+
+
 	// ----------------------------------------------------------------------
 	bool 
 		Socket::
 		datawaiting(int sock) 
 		const throw()
 	{
+#ifndef WIN32
+		// poll() takes descriptors beyond FD_SETSIZE, which select() doesn't
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		int r = poll( &pfd, 1, 0 );
+
+		if (r < 0)
+			BailOnSocketError("tcpip::Socket::datawaiting @ poll");
+
+		return r > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+#else
 		fd_set fds;
 		FD_ZERO( &fds );
 		FD_SET( sock, &fds );
@@ -189,6 +252,7 @@ namespace tcpip
 			return true;
 		else
 			return false;
+#endif
 	}
 
 	// ----------------------------------------------------------------------
@@ -196,7 +260,6 @@ namespace tcpip
 		Socket::
 		atoaddr( std::string address, struct in_addr& addr)
 	{
-		struct hostent* host;
 		struct in_addr saddr;
 
 		// First try nnn.nnn.nnn.nnn form
@@ -207,13 +270,41 @@ namespace tcpip
 			return true;
 		}
 
-		host = gethostbyname(address.c_str());
-		if( host ) {
-			addr = *((struct in_addr*)host->h_addr_list[0]);
-			return true;
+		// Unlike gethostbyname, getaddrinfo may be called by several threads at once
+		struct addrinfo hints;
+		memset( &hints, 0, sizeof(hints) );
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+
+		struct addrinfo* result = NULL;
+		if( getaddrinfo(address.c_str(), NULL, &hints, &result) != 0 || result == NULL )
+			return false;
+
+		addr = reinterpret_cast<struct sockaddr_in*>(result->ai_addr)->sin_addr;
+		freeaddrinfo(result);
+		return true;
+	}
+
+	// ----------------------------------------------------------------------
+	bool
+		Socket::
+		unixaddr( struct sockaddr_un& addr )
+		const
+	{
+#ifndef WIN32
+		if( path_.length() >= sizeof(addr.sun_path) )
+		{
+			errno = ENAMETOOLONG;
+			return false;
 		}
 
+		memset( &addr, 0, sizeof(addr) );
+		addr.sun_family = AF_UNIX;
+		strcpy( addr.sun_path, path_.c_str() );
+		return true;
+#else
 		return false;
+#endif
 	}
 
 
@@ -233,6 +324,33 @@ namespace tcpip
 		socklen_t addrlen = sizeof(client_addr);
 #endif
 
+#ifndef WIN32
+		if( server_socket_ < 0 && !path_.empty() )
+		{
+			struct sockaddr_un self;
+			if( !unixaddr( self ) )
+				BailOnSocketError("tcpip::Socket::accept() @ Invalid socket path");
+
+			server_socket_ = static_cast<int>(socket( AF_UNIX, SOCK_STREAM, 0 ));
+			if( server_socket_ < 0 )
+				BailOnSocketError("tcpip::Socket::accept() @ socket");
+
+			// A socket left by an earlier run would make bind fail
+			::unlink( path_.c_str() );
+
+			if ( bind(server_socket_, (struct sockaddr*)&self, sizeof(self)) != 0 )
+				BailOnSocketError("tcpip::Socket::accept() Unable to create listening socket");
+
+			if ( listen(server_socket_, 10) == -1 )
+				BailOnSocketError("tcpip::Socket::accept() Unable to listen on server socket");
+
+			set_blocking(blocking_);
+		}
+#else
+		if( !path_.empty() )
+			BailOnSocketError("tcpip::Socket::accept() @ Unix domain sockets are not supported");
+#endif
+
 		if( server_socket_ < 0 )
 		{
 			struct sockaddr_in self;
@@ -277,8 +395,12 @@ namespace tcpip
 
 		if( socket_ >= 0 )
 		{
-			int x = 1;
-			setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, (const char*)&x, sizeof(x));
+			if( path_.empty() )
+			{
+				int x = 1;
+				setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, (const char*)&x, sizeof(x));
+			}
+			applyBlocking(socket_);
 		}
 	}
 
@@ -291,23 +413,66 @@ namespace tcpip
 		blocking_ = blocking;
 
 		if( server_socket_ > 0 )
-		{
+			applyBlocking(server_socket_);
+
+		if( socket_ >= 0 )
+			applyBlocking(socket_);
+	}
+
+	// ----------------------------------------------------------------------
+	void 
+		Socket::
+		applyBlocking(int sock) 
+		throw(SocketException )
+	{
 #ifdef WIN32
-			ULONG NonBlock = blocking_ ? 0 : 1;
-		    if (ioctlsocket(server_socket_, FIONBIO, &NonBlock) == SOCKET_ERROR)
-				BailOnSocketError("tcpip::Socket::set_blocking() Unable to initialize non blocking I/O");
+		ULONG NonBlock = blocking_ ? 0 : 1;
+	    if (ioctlsocket(sock, FIONBIO, &NonBlock) == SOCKET_ERROR)
+			BailOnSocketError("tcpip::Socket::set_blocking() Unable to initialize non blocking I/O");
 #else
-			long arg = fcntl(server_socket_, F_GETFL, NULL);
-			if (blocking_)
-			{
-				arg &= ~O_NONBLOCK;
-			} else {
-				arg |= O_NONBLOCK;
-			}
-			fcntl(server_socket_, F_SETFL, arg);
-#endif
+		long arg = fcntl(sock, F_GETFL, NULL);
+		if (blocking_)
+		{
+			arg &= ~O_NONBLOCK;
+		} else {
+			arg |= O_NONBLOCK;
 		}
-	
+		fcntl(sock, F_SETFL, arg);
+#endif
+	}
+
+	// ----------------------------------------------------------------------
+	void 
+		Socket::
+		waitReady(bool write) 
+		const
+	{
+#ifndef WIN32
+		struct pollfd pfd;
+		pfd.fd = socket_;
+		pfd.events = write? POLLOUT : POLLIN;
+		pfd.revents = 0;
+
+		int r;
+		do {
+			r = poll( &pfd, 1, -1 );
+		} while( r < 0 && errno == EINTR );
+
+		if (r < 0)
+			BailOnSocketError("tcpip::Socket::waitReady @ poll");
+#else
+		fd_set fds;
+		FD_ZERO( &fds );
+		FD_SET( socket_, &fds );
+
+		int r;
+		do {
+			r = select( socket_+1, write? NULL : &fds, write? &fds : NULL, NULL, NULL );
+		} while( r < 0 && errno == EINTR );
+
+		if (r < 0)
+			BailOnSocketError("tcpip::Socket::waitReady @ select");
+#endif
 	}
 
 	// ----------------------------------------------------------------------
@@ -316,6 +481,12 @@ namespace tcpip
 		connect()
 		throw( SocketException )
 	{
+		if( !path_.empty() )
+		{
+			connectUnix();
+			return;
+		}
+
 		in_addr addr;
 		if( !atoaddr( host_.c_str(), addr) )
 			BailOnSocketError("tcpip::Socket::connect() @ Invalid network address");
@@ -337,10 +508,41 @@ namespace tcpip
 		{
 			int x = 1;
 			setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, (const char*)&x, sizeof(x));
+			applyBlocking(socket_);
 		}
 
     }
 
+	// ----------------------------------------------------------------------
+	void 
+		Socket::
+		connectUnix()
+		throw( SocketException )
+	{
+#ifndef WIN32
+		struct sockaddr_un address;
+		if( !unixaddr( address ) )
+			BailOnSocketError("tcpip::Socket::connect() @ Invalid socket path");
+
+		socket_ = static_cast<int>(socket( AF_UNIX, SOCK_STREAM, 0 ));
+		if( socket_ < 0 )
+			BailOnSocketError("tcpip::Socket::connect() @ socket");
+
+		if( ::connect( socket_, (sockaddr const*)&address, sizeof(address) ) < 0 )
+		{
+			int error = errno;
+			::close( socket_ );
+			socket_ = -1;
+			errno = error;
+			BailOnSocketError("tcpip::Socket::connect() @ connect");
+		}
+
+		applyBlocking(socket_);
+#else
+		BailOnSocketError("tcpip::Socket::connect() @ Unix domain sockets are not supported");
+#endif
+	}
+
 	// ----------------------------------------------------------------------
 	void 
 		Socket::
@@ -357,6 +559,8 @@ namespace tcpip
 
 			socket_ = -1;
 		}
+
+		recv_begin_ = recv_end_ = 0;
 	}
 
 	// ----------------------------------------------------------------------
@@ -368,10 +572,26 @@ namespace tcpip
 		if( socket_ < 0 )
 			return;
 
-		printBufferOnVerbose(buffer, "Send");
+		if( buffer.empty() )
+			return;
+
+		send(&buffer[0], buffer.size());
+	}
+
 
-		size_t numbytes = buffer.size();
-		unsigned char const *bufPtr = &buffer[0];
+	// ----------------------------------------------------------------------
+	void 
+		Socket::
+		send( const unsigned char *buffer, std::size_t length)
+		throw( SocketException )
+	{
+		if( socket_ < 0 )
+			return;
+
+		printBufferOnVerbose(buffer, length, "Send");
+
+		size_t numbytes = length;
+		unsigned char const *bufPtr = buffer;
 		while( numbytes > 0 )
 		{
 #ifdef WIN32
@@ -380,7 +600,15 @@ namespace tcpip
 			int bytesSent = ::send( socket_, bufPtr, numbytes, 0 );
 #endif
 			if( bytesSent < 0 )
+			{
+				// Non-blocking sockets wait for room in the send buffer
+				if( !blocking_ && (errno == EAGAIN || errno == EWOULDBLOCK) )
+				{
+					waitReady(true);
+					continue;
+				}
 				BailOnSocketError( "send failed" );
+			}
 
 			numbytes -= bytesSent;
 			bufPtr += bytesSent;
@@ -396,17 +624,181 @@ namespace tcpip
 		sendExact( const Storage &b)
 		throw( SocketException )
 	{
-		int length = static_cast<int>(b.size());
-		Storage length_storage;
-		length_storage.writeInt(lengthLen + length);
+		Segment body = { b.data(), b.size() };
+		sendExact(&body, 1);
+	}
 
-		// Sending length_storage and b independently would probably be possible and
-		// avoid some copying here, but both parts would have to go through the
-		// TCP/IP stack on their own which probably would cost more performance.
-		vector<unsigned char> msg;
-		msg.insert(msg.end(), length_storage.begin(), length_storage.end());
-		msg.insert(msg.end(), b.begin(), b.end());
-		send(msg);
+
+	// ----------------------------------------------------------------------
+	void
+		Socket::
+		sendExact( const Segment *segments, int count )
+		throw( SocketException )
+	{
+		if( socket_ < 0 )
+			return;
+
+		std::size_t length = lengthLen;
+		for( int i = 0; i < count; ++i )
+			length += segments[i].length;
+
+		unsigned char header[4];
+		header[0] = static_cast<unsigned char>(length >> 24);
+		header[1] = static_cast<unsigned char>(length >> 16);
+		header[2] = static_cast<unsigned char>(length >> 8);
+		header[3] = static_cast<unsigned char>(length);
+
+#ifdef WIN32
+		const bool gather = false;
+#else
+		const bool gather = !verbose_;
+#endif
+		if( !gather )
+		{
+			// send_buffer_ keeps its capacity, so this doesn't allocate once
+			// it has grown to the size of the messages.
+			send_buffer_.assign(header, header + lengthLen);
+			for( int i = 0; i < count; ++i )
+				send_buffer_.insert(send_buffer_.end(), segments[i].data,
+									segments[i].data + segments[i].length);
+			send(&send_buffer_[0], send_buffer_.size());
+			return;
+		}
+
+#ifndef WIN32
+		// Segment -1 is the header; done counts the bytes of current already sent
+		int current = -1;
+		std::size_t done = 0;
+
+		while( current < count )
+		{
+			struct iovec iov[64];
+			int n = 0;
+			for( int i = current; i < count && n < 64; ++i )
+			{
+				const unsigned char *data = (i < 0)? header : segments[i].data;
+				std::size_t len = (i < 0)? lengthLen : segments[i].length;
+				if( i == current )
+				{
+					data += done;
+					len -= done;
+				}
+				if( len == 0 )
+					continue;
+
+				iov[n].iov_base = const_cast<unsigned char*>(data);
+				iov[n].iov_len = len;
+				++n;
+			}
+			if( n == 0 )
+				break;
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = n;
+
+			ssize_t bytesSent = ::sendmsg( socket_, &msg, 0 );
+			if( bytesSent < 0 )
+			{
+				// Non-blocking sockets wait for room in the send buffer
+				if( !blocking_ && (errno == EAGAIN || errno == EWOULDBLOCK) )
+				{
+					waitReady(true);
+					continue;
+				}
+				BailOnSocketError( "send failed" );
+			}
+
+			// Skip the segments sent, maybe stopping inside one
+			std::size_t sent = static_cast<std::size_t>(bytesSent);
+			while( current < count )
+			{
+				std::size_t left = ((current < 0)? lengthLen : segments[current].length) - done;
+				if( sent < left )
+				{
+					done += sent;
+					break;
+				}
+				sent -= left;
+				++current;
+				done = 0;
+			}
+		}
+#endif
+	}
+
+
+	// ----------------------------------------------------------------------
+	std::size_t
+		Socket::
+		trySend( const Segment *segments, int count )
+		throw( SocketException )
+	{
+		if( socket_ < 0 )
+			return 0;
+
+		std::size_t total = 0;
+#ifdef WIN32
+		// Only used on non-blocking sockets there
+		for( int i = 0; i < count; ++i )
+		{
+			const unsigned char *data = segments[i].data;
+			std::size_t left = segments[i].length;
+			while( left > 0 )
+			{
+				int bytesSent = ::send( socket_, (const char*)data, static_cast<int>(left), 0 );
+				if( bytesSent < 0 )
+				{
+					if( WSAGetLastError() == WSAEWOULDBLOCK )
+						return total;
+					BailOnSocketError( "send failed" );
+				}
+				data += bytesSent;
+				left -= bytesSent;
+				total += bytesSent;
+			}
+		}
+#else
+		// Up to 64 segments per call, until the send buffer is full
+		int first = 0;
+		while( first < count )
+		{
+			struct iovec iov[64];
+			int n = 0;
+			std::size_t batch = 0;
+			for( ; first + n < count && n < 64; ++n )
+			{
+				iov[n].iov_base = const_cast<unsigned char*>(segments[first + n].data);
+				iov[n].iov_len = segments[first + n].length;
+				batch += segments[first + n].length;
+			}
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = n;
+
+			ssize_t bytesSent;
+			do
+			{
+				bytesSent = ::sendmsg( socket_, &msg, MSG_DONTWAIT );
+			} while( bytesSent < 0 && errno == EINTR );
+
+			if( bytesSent < 0 )
+			{
+				if( errno == EAGAIN || errno == EWOULDBLOCK )
+					return total;
+				BailOnSocketError( "send failed" );
+			}
+
+			total += static_cast<std::size_t>(bytesSent);
+			if( static_cast<std::size_t>(bytesSent) < batch )
+				return total;
+			first += n;
+		}
+#endif
+		return total;
 	}
 
 
@@ -419,7 +811,14 @@ namespace tcpip
 #ifdef WIN32
 		const int bytesReceived = recv( socket_, (char*)buffer, static_cast<int>(len), 0 );
 #else
-		const int bytesReceived = static_cast<int>(recv( socket_, buffer, len, 0 ));
+		int bytesReceived = static_cast<int>(recv( socket_, buffer, len, 0 ));
+
+		// Non-blocking sockets wait for data to arrive
+		while( bytesReceived < 0 && !blocking_ && (errno == EAGAIN || errno == EWOULDBLOCK) )
+		{
+			waitReady(false);
+			bytesReceived = static_cast<int>(recv( socket_, buffer, len, 0 ));
+		}
 #endif
 		if( bytesReceived == 0 )
 			throw SocketException( "tcpip::Socket::recvAndCheck @ recv: peer shutdown" );
@@ -448,21 +847,31 @@ namespace tcpip
 	// ----------------------------------------------------------------------
 	void
 		Socket::
-		printBufferOnVerbose(const std::vector<unsigned char> buffer, const std::string &label)
+		printBufferOnVerbose(const unsigned char *buffer, std::size_t length, const char *label)
 		const
 	{
 		if (verbose_)
 		{
-			cerr << label << " " << buffer.size() <<  " bytes via tcpip::Socket: [";
-			// cache end iterator for performance
-			const vector<unsigned char>::const_iterator end = buffer.end();
-			for (vector<unsigned char>::const_iterator it = buffer.begin(); end != it; ++it)
-				cerr << " " << static_cast<int>(*it) << " ";
+			cerr << label << " " << length <<  " bytes via tcpip::Socket: [";
+			for (std::size_t i = 0; i < length; ++i)
+				cerr << " " << static_cast<int>(buffer[i]) << " ";
 			cerr << "]" << endl;
 		}
 	}
 
 
+	// ----------------------------------------------------------------------
+	int
+		Socket::
+		messageLength(const unsigned char *header)
+	{
+		return static_cast<int>((static_cast<unsigned int>(header[0]) << 24)
+								| (static_cast<unsigned int>(header[1]) << 16)
+								| (static_cast<unsigned int>(header[2]) << 8)
+								| static_cast<unsigned int>(header[3]));
+	}
+
+
 	// ----------------------------------------------------------------------
 	vector<unsigned char> 
 		Socket::
@@ -482,7 +891,8 @@ namespace tcpip
 
 		buffer.resize(bytesReceived);
 
-		printBufferOnVerbose(buffer, "Rcvd");
+		if( !buffer.empty() )
+			printBufferOnVerbose(&buffer[0], buffer.size(), "Rcvd");
 
 		return buffer;
 	}
@@ -495,33 +905,181 @@ namespace tcpip
 		receiveExact( Storage &msg )
 		throw( SocketException )
 	{
-		// buffer for received bytes
-		// According to the C++ standard elements of a std::vector are stored
-		// contiguously. Explicitly &buffer[n] == &buffer[0] + n for 0 <= n < buffer.size().
-		vector<unsigned char> buffer(lengthLen);
+		// receive length of TraCI message (with whatever follows it)
+		while( recv_end_ - recv_begin_ < static_cast<size_t>(lengthLen) )
+			fillBuffer(true);
+		const size_t totalLen = bufferedLength();
 
-		// receive length of TraCI message
-		receiveComplete(&buffer[0], lengthLen);
-		Storage length_storage(&buffer[0], lengthLen);
-		const int totalLen = length_storage.readInt();
-		assert(totalLen > lengthLen);
+		msg.reset();
 
-		// extent buffer
-		buffer.resize(totalLen);
+		// large messages not yet buffered are received straight into the passed Storage
+		if( recv_end_ - recv_begin_ < totalLen && totalLen > RECV_BUFFER_SIZE )
+		{
+			const size_t buffered = recv_end_ - recv_begin_ - lengthLen;
+			unsigned char *body = msg.append(static_cast<unsigned int>(totalLen - lengthLen));
+			memcpy(body, &recv_buffer_[recv_begin_ + lengthLen], buffered);
+			recv_begin_ = recv_end_ = 0;
+
+			receiveComplete(body + buffered, totalLen - lengthLen - buffered);
+			printBufferOnVerbose(msg.data(), msg.size(), "Rcvd Storage with");
+			return true;
+		}
+
+		const unsigned char *data;
+		size_t length;
+		receiveView(data, length);
+		msg.writePacket(data, static_cast<int>(length));
+
+		return true;
+	}
 
-		// receive remaining TraCI message
-		receiveComplete(&buffer[lengthLen], totalLen - lengthLen);
+
+	// ----------------------------------------------------------------------
+	bool
+		Socket::
+		tryReceiveExact( Storage &msg )
+		throw( SocketException )
+	{
+		const unsigned char *data;
+		size_t length;
+		if( !tryReceiveView(data, length) )
+			return false;
 
 		// copy message content into passed Storage
 		msg.reset();
-		msg.writePacket(&buffer[lengthLen], totalLen - lengthLen);
-		
-		printBufferOnVerbose(buffer, "Rcvd Storage with");
+		msg.writePacket(data, static_cast<int>(length));
+		return true;
+	}
 
+
+	// ----------------------------------------------------------------------
+	void
+		Socket::
+		receiveView( const unsigned char *&data, std::size_t &length )
+		throw( SocketException )
+	{
+		while( !takeBufferedMessage(data, length) )
+			fillBuffer(true);
+	}
+
+
+	// ----------------------------------------------------------------------
+	bool
+		Socket::
+		tryReceiveView( const unsigned char *&data, std::size_t &length )
+		throw( SocketException )
+	{
+		while( !takeBufferedMessage(data, length) )
+		{
+			if( !fillBuffer(false) )
+				return false;
+		}
 		return true;
 	}
-	
-	
+
+
+	// ----------------------------------------------------------------------
+	size_t
+		Socket::
+		bufferedLength()
+		const throw( SocketException )
+	{
+		const int totalLen = messageLength(&recv_buffer_[recv_begin_]);
+		if( totalLen <= lengthLen )
+			throw SocketException( "tcpip::Socket: invalid message length" );
+		return static_cast<size_t>(totalLen);
+	}
+
+
+	// ----------------------------------------------------------------------
+	bool
+		Socket::
+		takeBufferedMessage( const unsigned char *&data, std::size_t &length )
+		throw( SocketException )
+	{
+		const size_t buffered = recv_end_ - recv_begin_;
+		if( buffered < static_cast<size_t>(lengthLen) )
+			return false;
+
+		const size_t totalLen = bufferedLength();
+		if( buffered < totalLen )
+			return false;
+
+		data = &recv_buffer_[recv_begin_ + lengthLen];
+		length = totalLen - lengthLen;
+		recv_begin_ += totalLen;
+
+		printBufferOnVerbose(data, length, "Rcvd Storage with");
+		return true;
+	}
+
+
+	// ----------------------------------------------------------------------
+	bool
+		Socket::
+		fillBuffer( bool wait )
+		throw( SocketException )
+	{
+		// Move the unread bytes to the front, making room for the whole message
+		if( recv_begin_ > 0 )
+		{
+			if( recv_end_ > recv_begin_ )
+				memmove(&recv_buffer_[0], &recv_buffer_[recv_begin_], recv_end_ - recv_begin_);
+			recv_end_ -= recv_begin_;
+			recv_begin_ = 0;
+		}
+
+		size_t wanted = std::max(recv_end_ + 1, RECV_BUFFER_SIZE);
+		if( recv_end_ >= static_cast<size_t>(lengthLen) )
+			wanted = std::max(wanted, bufferedLength());
+		if( recv_buffer_.size() < wanted )
+			recv_buffer_.resize(wanted);
+
+		unsigned char *room = &recv_buffer_[recv_end_];
+		const size_t roomLen = recv_buffer_.size() - recv_end_;
+
+		if( wait )
+		{
+			recv_end_ += recvAndCheck(room, roomLen);
+			return true;
+		}
+
+#ifdef WIN32
+		if( !datawaiting(socket_) )
+			return false;
+		const int bytesReceived = recv( socket_, (char*)room, static_cast<int>(roomLen), 0 );
+#else
+		const int bytesReceived = static_cast<int>(recv( socket_, room, roomLen, MSG_DONTWAIT ));
+		if( bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+			return false;
+#endif
+		if( bytesReceived == 0 )
+			throw SocketException( "tcpip::Socket::tryReceiveExact @ recv: peer shutdown" );
+		if( bytesReceived < 0 )
+			BailOnSocketError( "tcpip::Socket::tryReceiveExact @ recv" );
+
+		recv_end_ += static_cast<size_t>(bytesReceived);
+		return true;
+	}
+
+	// ----------------------------------------------------------------------
+	int 
+		Socket::
+		fd() 
+		const
+	{
+		return socket_;
+	}
+
+	// ----------------------------------------------------------------------
+	int 
+		Socket::
+		server_fd() 
+		const
+	{
+		return server_socket_;
+	}
+
 	// ----------------------------------------------------------------------
 	bool 
 		Socket::
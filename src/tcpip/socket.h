@@ -52,6 +52,7 @@
 
 
 struct in_addr;
+struct sockaddr_un;
 
 namespace tcpip
 {
@@ -75,6 +76,24 @@ namespace tcpip
 		~SocketException() throw() {}
 	};
 
+	/// Bytes sent as a part of a message (see Socket::sendExact(const Segment*, int))
+	struct Segment
+	{
+		const unsigned char *data;
+		std::size_t length;
+	};
+
+	/// Where a Socket connects or listens: a TCP host and port, or a Unix domain socket
+	struct Endpoint
+	{
+		std::string host;
+		int port;
+		/// Path of the Unix domain socket (TCP is used if empty)
+		std::string path;
+		/// Messages go through shared memory, the socket only sets it up (ignored by Socket)
+		bool sharedMemory;
+	};
+
 	class Socket
 	{
 		friend class Response;
@@ -85,23 +104,74 @@ namespace tcpip
 		/// Constructor that prepare for accepting a connection on given port
 		Socket(int port);
 
+		/** \brief Constructor that prepare to connect to, or accept a connection on, an endpoint
+		 *
+		 * With a path, a Unix domain socket is used (only where available). A
+		 * listening socket replaces any file at the path, and removes it when destroyed.
+		 */
+		Socket(const Endpoint &endpoint);
+
 		/// Destructor
 		~Socket();
 
-		/// Connects to host_:port_
+		/// Connects to host_:port_ (or path_)
 		void connect() throw( SocketException );
 
-		/// Wait for a incoming connection to port_
+		/// Wait for a incoming connection to port_ (or path_)
 		void accept() throw( SocketException );
 
 		void send( const std::vector<unsigned char> &buffer) throw( SocketException );
+		void send( const unsigned char *buffer, std::size_t length) throw( SocketException );
 		void sendExact( const Storage & ) throw( SocketException );
+		/** \brief Send a TraCI message made of \p count segments
+		 *
+		 * The length and the segments are written with a single gathering
+		 * call (where available), without being copied into one buffer.
+		 */
+		void sendExact( const Segment *segments, int count ) throw( SocketException );
+		/** \brief Send the bytes of \p count segments, as many as fit without blocking
+		 *
+		 * Nothing is framed: the caller writes the length of a message itself.
+		 *
+		 * \return The number of bytes sent (0 if the send buffer is full)
+		 */
+		std::size_t trySend( const Segment *segments, int count ) throw( SocketException );
 		/// Receive up to \p bufSize available bytes from Socket::socket_
 		std::vector<unsigned char> receive( int bufSize = 2048 ) throw( SocketException );
 		/// Receive a complete TraCI message from Socket::socket_
 		bool receiveExact( Storage &) throw( SocketException );
+		/** \brief Receive a complete TraCI message only if it doesn't block
+		 *
+		 * Bytes of an incomplete message are kept and completed by the next
+		 * call (or by receiveExact).
+		 *
+		 * \return true iff a complete message was written to the Storage
+		 */
+		bool tryReceiveExact( Storage &) throw( SocketException );
+		/** \brief Receive a complete TraCI message without copying it
+		 *
+		 * Each read takes all the bytes available, so messages sent
+		 * together are yielded by later calls without further system calls.
+		 *
+		 * \param[out] data Receives the first byte of the message, after its length
+		 * \param[out] length Receives the number of bytes in the message, after its length
+		 *
+		 * The bytes are valid until the next call that receives from this socket.
+		 */
+		void receiveView( const unsigned char *&data, std::size_t &length ) throw( SocketException );
+		/** \brief Receive a complete TraCI message without copying it, only if it doesn't block
+		 *
+		 * \return true iff a complete message was located (see receiveView)
+		 */
+		bool tryReceiveView( const unsigned char *&data, std::size_t &length ) throw( SocketException );
 		void close();
 		int port();
+		/// Describes the endpoint for messages: "port N", or the path of the Unix domain socket
+		std::string address() const;
+		/// The descriptor of the client connection (-1 if not connected)
+		int fd() const;
+		/// The descriptor listening for connections (-1 until accept() is called)
+		int server_fd() const;
 		void set_blocking(bool) throw( SocketException );
 		bool is_blocking() throw();
 		bool has_client_connection() const;
@@ -113,13 +183,19 @@ namespace tcpip
 	protected:
 		/// Length of the message length part of a TraCI message
 		static const int lengthLen;
+		/// Initial size of Socket::recv_buffer_ (messages larger than that make it grow)
+		static const std::size_t RECV_BUFFER_SIZE;
 
 		/// Receive \p len bytes from Socket::socket_
 		void receiveComplete(unsigned char * const buffer, std::size_t len) const;
 		/// Receive up to \p len available bytes from Socket::socket_
 		size_t recvAndCheck(unsigned char * const buffer, std::size_t len) const;
-		/// Print \p label and \p buffer to stderr if Socket::verbose_ is set
-		void printBufferOnVerbose(const std::vector<unsigned char> buffer, const std::string &label) const;
+		/// Wait until Socket::socket_ is readable (or writable, if \p write)
+		void waitReady(bool write) const;
+		/// Print \p label and the \p length bytes of \p buffer to stderr if Socket::verbose_ is set
+		void printBufferOnVerbose(const unsigned char *buffer, std::size_t length, const char *label) const;
+		/// Decode the length in the first lengthLen bytes of a TraCI message
+		static int messageLength(const unsigned char *header);
 
 	private:
 		void init();
@@ -128,14 +204,36 @@ namespace tcpip
 		std::string GetWinsockErrorString(int err) const;
 #endif
 		bool atoaddr(std::string, struct in_addr& addr);
+		/// Fill \p addr with path_, false if it doesn't fit
+		bool unixaddr(struct sockaddr_un& addr) const;
+		/// Connect to the Unix domain socket at path_
+		void connectUnix() throw( SocketException );
 		bool datawaiting(int sock) const throw();
+		/// Apply the current blocking mode to the descriptor \p sock
+		void applyBlocking(int sock) throw( SocketException );
+		/// Read the bytes available into recv_buffer_, waiting for some if \p wait (false if none)
+		bool fillBuffer( bool wait ) throw( SocketException );
+		/// Locate the first message in recv_buffer_, if complete, and consume it
+		bool takeBufferedMessage( const unsigned char *&data, std::size_t &length ) throw( SocketException );
+		/// Length of the message starting at recv_begin_ (its length must be buffered)
+		std::size_t bufferedLength() const throw( SocketException );
 
 		std::string host_;
 		int port_;
+		/// Path of the Unix domain socket (empty for TCP)
+		std::string path_;
 		int socket_;
 		int server_socket_;
 		bool blocking_;
 
+		/// Bytes received and not yet consumed lie in [recv_begin_, recv_end_)
+		std::vector<unsigned char> recv_buffer_;
+		std::size_t recv_begin_;
+		std::size_t recv_end_;
+
+		/// A message concatenated by sendExact when it can't gather (reused to avoid allocations)
+		std::vector<unsigned char> send_buffer_;
+
 		bool verbose_;
 #ifdef WIN32
 		static bool init_windows_sockets_;
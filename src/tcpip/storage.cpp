@@ -43,9 +43,7 @@ namespace tcpip
 		// Length is calculated, if -1, or given
 		if (length == -1) length = sizeof(packet) / sizeof(unsigned char);
 
-		store.reserve(length);
-		// Get the content
-		for(int i = 0; i < length; ++i) store.push_back(packet[i]);
+		store.assign(packet, packet + length);
 
 		init();
 	}
@@ -55,11 +53,7 @@ namespace tcpip
 	void Storage::init()
 	{
 		// Initialize local variables
-		iter_ = store.begin();
-
-		short a = 0x0102;
-		unsigned char *p_a = reinterpret_cast<unsigned char*>(&a);
-		bigEndian_ = (p_a[0] == 0x01); // big endian?
+		pos_ = 0;
 	}
 
 
@@ -68,66 +62,11 @@ namespace tcpip
 	{}
 
 
-	// ----------------------------------------------------------------------
-	bool Storage::valid_pos()
-	{
-		return (iter_ != store.end());   // this implies !store.empty()
-	}
-
-
-	// ----------------------------------------------------------------------
-	unsigned int Storage::position() const
-	{
-		// According to C++ standard std::distance will simply compute the iterators
-		// difference for random access iterators as std::vector provides.
-		return static_cast<unsigned int>(std::distance(store.begin(), iter_));
-	}
-
-
 	// ----------------------------------------------------------------------
 	void Storage::reset()
 	{
 		store.clear();
-		iter_ = store.begin();
-	}
-
-
-	// ----------------------------------------------------------------------
-	/**
-	* Reads a char form the array
-	* @return The read char (between 0 and 255)
-	*/
-	unsigned char Storage::readChar() throw(std::invalid_argument)
-	{
-		if ( !valid_pos() )
-		{
-			throw std::invalid_argument("Storage::readChar(): invalid position");
-		}
-		return readCharUnsafe();
-	}
-
-
-	// ----------------------------------------------------------------------
-	/**
-	*
-	*/
-	void Storage::writeChar(unsigned char value) throw()
-	{
-		store.push_back(value);
-		iter_ = store.begin();
-	}
-
-
-	// ----------------------------------------------------------------------
-	/**
-	* Reads a byte form the array
-	* @return The read byte (between -128 and 127)
-	*/
-	int Storage::readByte()	throw(std::invalid_argument)
-	{
-		int i = static_cast<int>(readChar());
-		if (i < 128) return i;
-		else return (i - 256);
+		pos_ = 0;
 	}
 
 
@@ -145,17 +84,6 @@ namespace tcpip
 	}
 
 
-	// ----------------------------------------------------------------------
-	/**
-	* Reads an unsigned byte form the array
-	* @return The read byte (between 0 and 255)
-	*/
-	int Storage::readUnsignedByte()	throw(std::invalid_argument)
-	{
-		return static_cast<int>(readChar());
-	}
-
-
 	// ----------------------------------------------------------------------
 	/**
 	*
@@ -178,11 +106,11 @@ namespace tcpip
 	std::string Storage::readString() throw(std::invalid_argument)
 	{
 		int len = readInt();
+		if (len < 0)
+			throwReadError(len);
 		checkReadSafe(len);
-		StorageType::const_iterator end = iter_;
-		std::advance(end, len);
-		const string tmp(iter_, end);
-		iter_ = end;
+		const string tmp(reinterpret_cast<const char*>(&store[0]) + pos_, len);
+		pos_ += len;
 		return tmp;
 	}
 
@@ -195,9 +123,8 @@ namespace tcpip
 	void Storage::writeString(const std::string &s) throw()
 	{
 		writeInt(static_cast<int>(s.length()));
-
-		store.insert(store.end(), s.begin(), s.end());
-		iter_ = store.begin();
+		writePacket(reinterpret_cast<const unsigned char*>(s.data()),
+					static_cast<int>(s.length()));
 	}
 
 
@@ -210,6 +137,9 @@ namespace tcpip
 	{
 		std::vector<std::string> tmp;
 		const int len = readInt();
+		// every string takes at least the 4 bytes of its length
+		if (len > 0)
+			checkReadSafe(4 * static_cast<unsigned int>(len));
 		tmp.reserve(len);
 		for (int i = 0; i < len; i++)
 		{
@@ -234,23 +164,6 @@ namespace tcpip
 	}
 
 
-	// ----------------------------------------------------------------------
-	/**
-	* Restores an integer, which was split up in two bytes according to the
-	* specification, it must have been split by its row byte representation
-	* with MSBF-order
-	*
-	* @return the unspoiled integer value (between -32768 and 32767)
-	*/
-	int Storage::readShort() throw(std::invalid_argument)
-	{
-		short value = 0;
-		unsigned char *p_value = reinterpret_cast<unsigned char*>(&value);
-		readByEndianess(p_value, 2);
-		return value;
-	}
-
-
 	// ----------------------------------------------------------------------
 	void Storage::writeShort( int value ) throw(std::invalid_argument)
 	{
@@ -259,153 +172,92 @@ namespace tcpip
 			throw std::invalid_argument("Storage::writeShort(): Invalid value, not in [-32768, 32767]");
 		}
 
-		short svalue = static_cast<short>(value);
-		unsigned char *p_svalue = reinterpret_cast<unsigned char*>(&svalue);
-		writeByEndianess(p_svalue, 2);
-	}
-
-
-	// ----------------------------------------------------------------------
-	/**
-	* restores an integer, which was split up in four bytes acording to the
-	* specification, it must have been split by its row byte representation
-	* with MSBF-order
-	*
-	* @return the unspoiled integer value (between -2.147.483.648 and 2.147.483.647)
-	*/
-	int Storage::readInt() throw(std::invalid_argument)
-	{
-		int value = 0;
-		unsigned char *p_value = reinterpret_cast<unsigned char*>(&value);
-		readByEndianess(p_value, 4);
-		return value;
-	}
-
-
-	// ----------------------------------------------------------------------
-	void Storage::writeInt( int value ) throw()
-	{
-		unsigned char *p_value = reinterpret_cast<unsigned char*>(&value);
-		writeByEndianess(p_value, 4);
-	}
-
-
-	// ----------------------------------------------------------------------
-	/**
-	* restores a float , which was split up in four bytes acording to the
-	* specification, it must have been split by its row byte representation
-	* with MSBF-order
-	*
-	* @return the unspoiled float value
-	*/
-	float Storage::readFloat() throw(std::invalid_argument)
-	{
-		float value = 0;
-		unsigned char *p_value = reinterpret_cast<unsigned char*>(&value);
-		readByEndianess(p_value, 4);
-		return value;
-	}
-
-
-	// ----------------------------------------------------------------------
-	void Storage::writeFloat( float value ) throw()
-	{
-		unsigned char *p_value = reinterpret_cast<unsigned char*>(&value);
-		writeByEndianess(p_value, 4);
+		unsigned char *p = append(2);
+		p[0] = static_cast<unsigned char>((value >> 8) & 0xFF);
+		p[1] = static_cast<unsigned char>(value & 0xFF);
 	}
 
 
 	// ----------------------------------------------------------------------
 	void Storage::writeDouble( double value ) throw ()
 	{
-		unsigned char *p_value = reinterpret_cast<unsigned char*>(&value);
-		writeByEndianess(p_value, 8);
+		unsigned char bits[8];
+		std::memcpy(bits, &value, 8);
+
+		// doubles are sent in network byte order, like integers
+		unsigned char *p = append(8);
+		for (int i = 0; i < 8; ++i)
+			p[i] = bits[bigEndian()? i : 7 - i];
 	}
 
 
 	// ----------------------------------------------------------------------
 	double Storage::readDouble( ) throw (std::invalid_argument)
 	{
-		double value = 0;
-		unsigned char *p_value = reinterpret_cast<unsigned char*>(&value);
-		readByEndianess(p_value, 8);
-		return value;
-	}
+		checkReadSafe(8);
+		const unsigned char *p = &store[pos_];
+		pos_ += 8;
 
+		unsigned char bits[8];
+		for (int i = 0; i < 8; ++i)
+			bits[bigEndian()? i : 7 - i] = p[i];
 
-	// ----------------------------------------------------------------------
-	void Storage::writePacket(unsigned char* packet, int length)
-	{
-		store.insert(store.end(), &(packet[0]), &(packet[length]));
-		iter_ = store.begin();   // reserve() invalidates iterators
+		double value;
+		std::memcpy(&value, bits, 8);
+		return value;
 	}
 
 
 	// ----------------------------------------------------------------------
     void Storage::writePacket(const std::vector<unsigned char> &packet)
     {
-        std::copy(packet.begin(), packet.end(), std::back_inserter(store));
-		iter_ = store.begin();
+        store.insert(store.end(), packet.begin(), packet.end());
     }
 
 
 	// ----------------------------------------------------------------------
-	void Storage::writeStorage(tcpip::Storage& other)
+	void Storage::readPacket(unsigned char* packet, int length) throw(std::invalid_argument)
 	{
-		// the compiler cannot deduce to use a const_iterator as source
-		store.insert<StorageType::const_iterator>(store.end(), other.iter_, other.store.end());
-		iter_ = store.begin();
+		if (length <= 0)
+			return;
+		checkReadSafe(length);
+		std::memcpy(packet, &store[pos_], length);
+		pos_ += length;
 	}
 
 
 	// ----------------------------------------------------------------------
-	void Storage::checkReadSafe(unsigned int num) const  throw(std::invalid_argument)
+	void Storage::writeStorage(const tcpip::Storage& other)
 	{
-		if (std::distance(iter_, store.end()) < static_cast<int>(num))
+		if (&other == this)
 		{
-			std::ostringstream msg;
-			msg << "tcpip::Storage::readIsSafe: want to read "  << num << " bytes from Storage, "
-				<< "but only " << std::distance(iter_, store.end()) << " remaining";
-			throw std::invalid_argument(msg.str());
+			// inserting a range of the vector into itself isn't allowed
+			const StorageType copy(store.begin() + pos_, store.end());
+			writePacket(copy);
+		}
+		else if (other.pos_ < other.store.size())
+		{
+			writePacket(&other.store[other.pos_],
+						static_cast<int>(other.store.size() - other.pos_));
 		}
 	}
 
 
 	// ----------------------------------------------------------------------
-	unsigned char Storage::readCharUnsafe()
-	{
-		char hb = *iter_;
-		++iter_;
-		return hb;
-	}
-
-
-	// ----------------------------------------------------------------------
-	void Storage::writeByEndianess(const unsigned char * begin, unsigned int size)
+	void Storage::throwReadError(unsigned int num) const throw(std::invalid_argument)
 	{
-		const unsigned char * end = &(begin[size]);
-		if (bigEndian_)
-			store.insert(store.end(), begin, end);
-		else
-			store.insert(store.end(), std::reverse_iterator<const unsigned char *>(end), std::reverse_iterator<const unsigned char *>(begin));
-		iter_ = store.begin();
+		std::ostringstream msg;
+		msg << "tcpip::Storage::readIsSafe: want to read "  << num << " bytes from Storage, "
+			<< "but only " << (store.size() - pos_) << " remaining";
+		throw std::invalid_argument(msg.str());
 	}
 
 
 	// ----------------------------------------------------------------------
-	void Storage::readByEndianess(unsigned char * array, int size)
+	bool Storage::bigEndian()
 	{
-		checkReadSafe(size);
-		if (bigEndian_)
-		{
-			for (int i = 0; i < size; ++i)
-				array[i] = readCharUnsafe();
-		}
-		else
-		{
-			for (int i = size - 1; i >= 0; --i)
-				array[i] = readCharUnsafe();
-		}
+		static const short a = 0x0102;
+		return reinterpret_cast<const unsigned char*>(&a)[0] == 0x01;
 	}
 
 
@@ -30,10 +30,17 @@
 #include <string>
 #include <stdexcept>
 #include <iostream>
+#include <cstring>
 
 namespace tcpip
 {
 
+/** \brief A contiguous buffer of bytes in network byte order.
+ *
+ * Bytes are appended at the end and read from an offset, which is kept as
+ * an integer: writing never moves the read position. The most used
+ * primitives are inline and non-virtual.
+ */
 class Storage
 {
 
@@ -42,22 +49,44 @@ public:
 
 private:
 	StorageType store;
-	StorageType::const_iterator iter_;
 
-	// sortation of bytes forwards or backwards?
-	bool bigEndian_;
+	/// Offset of the next byte to read
+	unsigned int pos_;
 
 	/// Used in constructors to initialize local variables
 	void init();
 
 	/// Check if the next \p num bytes can be read safely
-	void checkReadSafe(unsigned int num) const throw(std::invalid_argument);
-	/// Read a byte \em without validity check
-	unsigned char readCharUnsafe();
-	/// Write \p size elements of array \p begin according to endianess
-	void writeByEndianess(const unsigned char * begin, unsigned int size);
-	/// Read \p size elements into \p array according to endianess
-	void readByEndianess(unsigned char * array, int size);
+	inline void checkReadSafe(unsigned int num) const throw(std::invalid_argument)
+	{
+		if (store.size() - pos_ < num)
+			throwReadError(num);
+	}
+	/// Throw the error for an unsafe read of \p num bytes
+	void throwReadError(unsigned int num) const throw(std::invalid_argument);
+
+	/// Determine if the host is big endian
+	static bool bigEndian();
+
+	/// Write a 32 bit value in network byte order
+	inline void writeUInt32(unsigned int value)
+	{
+		unsigned char *p = append(4);
+		p[0] = static_cast<unsigned char>(value >> 24);
+		p[1] = static_cast<unsigned char>(value >> 16);
+		p[2] = static_cast<unsigned char>(value >> 8);
+		p[3] = static_cast<unsigned char>(value);
+	}
+
+	/// Read a 32 bit value in network byte order
+	inline unsigned int readUInt32() throw(std::invalid_argument)
+	{
+		checkReadSafe(4);
+		const unsigned char *p = &store[pos_];
+		pos_ += 4;
+		return (static_cast<unsigned int>(p[0]) << 24) | (static_cast<unsigned int>(p[1]) << 16)
+			| (static_cast<unsigned int>(p[2]) << 8) | static_cast<unsigned int>(p[3]);
+	}
 
 
 public:
@@ -71,52 +100,107 @@ public:
 	// Destructor
 	virtual ~Storage();
 
-	virtual bool valid_pos();
-	virtual unsigned int position() const;
+	inline bool valid_pos() const { return pos_ < store.size(); }
+	inline unsigned int position() const { return pos_; }
 
+	/// Empty the storage and rewind, keeping the allocated capacity
 	void reset();
+	/// Make room for \p size bytes in total without further allocation
+	void reserve(StorageType::size_type size) { store.reserve(size); }
+	/// Append \p size bytes to be filled by the caller, returning the first of them
+	inline unsigned char *append(unsigned int size)
+	{
+		StorageType::size_type old = store.size();
+		store.resize(old + size);
+		return &store[old];
+	}
 	/// Dump storage content as series of hex values
 	std::string hexDump() const;
 
-	virtual unsigned char readChar() throw(std::invalid_argument);
-	virtual void writeChar(unsigned char) throw();
-
-	virtual int readByte() throw(std::invalid_argument);
-	virtual void writeByte(int) throw(std::invalid_argument);
-//	virtual void writeByte(unsigned char) throw();
-
-	virtual int readUnsignedByte() throw(std::invalid_argument);
-	virtual void writeUnsignedByte(int) throw(std::invalid_argument);
-
-	virtual std::string readString() throw(std::invalid_argument);
-	virtual void writeString(const std::string& s) throw();
-
-	virtual std::vector<std::string> readStringList() throw(std::invalid_argument);
-	virtual void writeStringList(const std::vector<std::string> &s) throw();
-
-	virtual int readShort() throw(std::invalid_argument);
-	virtual void writeShort(int) throw(std::invalid_argument);
-
-	virtual int readInt() throw(std::invalid_argument);
-	virtual void writeInt(int) throw();
-
-	virtual float readFloat() throw(std::invalid_argument);
-	virtual void writeFloat( float ) throw();
-
-	virtual double readDouble() throw(std::invalid_argument);
-	virtual void writeDouble( double ) throw();
-
-	virtual void writePacket(unsigned char* packet, int length);
-    virtual void writePacket(const std::vector<unsigned char> &packet);
-
-	virtual void writeStorage(tcpip::Storage& store);
-
-	// Some enabled functions of the underlying std::list
+	inline unsigned char readChar() throw(std::invalid_argument)
+	{
+		if ( !valid_pos() )
+			throw std::invalid_argument("Storage::readChar(): invalid position");
+		return store[pos_++];
+	}
+	inline void writeChar(unsigned char value) throw() { store.push_back(value); }
+
+	inline int readByte() throw(std::invalid_argument)
+	{
+		int i = static_cast<int>(readChar());
+		return (i < 128)? i : i - 256;
+	}
+	void writeByte(int) throw(std::invalid_argument);
+
+	inline int readUnsignedByte() throw(std::invalid_argument) { return static_cast<int>(readChar()); }
+	void writeUnsignedByte(int) throw(std::invalid_argument);
+
+	std::string readString() throw(std::invalid_argument);
+	void writeString(const std::string& s) throw();
+
+	std::vector<std::string> readStringList() throw(std::invalid_argument);
+	void writeStringList(const std::vector<std::string> &s) throw();
+
+	inline int readShort() throw(std::invalid_argument)
+	{
+		checkReadSafe(2);
+		const unsigned char *p = &store[pos_];
+		pos_ += 2;
+		return static_cast<short>((p[0] << 8) | p[1]);
+	}
+	void writeShort(int) throw(std::invalid_argument);
+
+	inline int readInt() throw(std::invalid_argument) { return static_cast<int>(readUInt32()); }
+	inline void writeInt(int value) throw() { writeUInt32(static_cast<unsigned int>(value)); }
+
+	inline float readFloat() throw(std::invalid_argument)
+	{
+		unsigned int bits = readUInt32();
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+	inline void writeFloat( float value ) throw()
+	{
+		unsigned int bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		writeUInt32(bits);
+	}
+
+	double readDouble() throw(std::invalid_argument);
+	void writeDouble( double ) throw();
+
+	/// Append \p length bytes at once
+	inline void writePacket(const unsigned char* packet, int length)
+	{
+		if (length > 0)
+			store.insert(store.end(), packet, packet + length);
+	}
+	void writePacket(const std::vector<unsigned char> &packet);
+
+	/// Read \p length bytes at once
+	void readPacket(unsigned char* packet, int length) throw(std::invalid_argument);
+	/// Skip \p length bytes without reading them
+	inline void skip(unsigned int length) throw(std::invalid_argument)
+	{
+		checkReadSafe(length);
+		pos_ += length;
+	}
+
+	/// Append the unread bytes of \p store
+	void writeStorage(const tcpip::Storage& store);
+
+	// Some enabled functions of the underlying std::vector
 	StorageType::size_type size() const { return store.size(); }
+	/// Bytes that fit without further allocation
+	StorageType::size_type capacity() const { return store.capacity(); }
 
 	StorageType::const_iterator begin() const { return store.begin(); }
 	StorageType::const_iterator end() const { return store.end(); }
 
+	/// The first byte (valid while the storage isn't written)
+	const unsigned char *data() const { return store.empty()? NULL : &store[0]; }
+
 };
 
 } // namespace tcpip
@@ -1,6 +1,29 @@
 #include <sstream>
+#include <pthread.h>
+
+#include "TraCIConstants.h"
 #include "util.h"
 
+namespace {
+
+	/** \brief Reads the length of what follows it, which must fit in the bytes left.
+	 *
+	 * \param bytes The length, then what it counts
+	 * \param left Number of bytes after the length
+	 * \param error Describes the value, when the length doesn't fit
+	 */
+	unsigned int readFittingLength(const unsigned char *bytes, unsigned int left,
+								   const char *error) throw (std::invalid_argument)
+	{
+		int length = tcpip::readRawInt(bytes);
+		if (length < 0 || static_cast<unsigned int>(length) > left) {
+			throw std::invalid_argument(error);
+		}
+		return static_cast<unsigned int>(length);
+	}
+
+}
+
 int tcpip::readCommandSize(tcpip::Storage &inStorage) throw(std::invalid_argument)
 {
 	// Try to obtain size from first byte
@@ -36,13 +59,307 @@ void tcpip::writeCommandSize(tcpip::Storage &outStorage, int size)
 }
 
 
-ProtocolException::ProtocolException(std::string what, int port, bool isClient) throw () :
-	myPort(port),
+tcpip::CommandSpan tcpip::readCommandSpan(const unsigned char *bytes, unsigned int offset,
+										  unsigned int size) throw (std::invalid_argument)
+{
+	CommandSpan span;
+	span.offset = offset;
+
+	// Short commands have the size in a single byte, long ones in an integer
+	unsigned int header = 1;
+	if (offset < size && bytes[offset] == 0) {
+		header = 5;
+	}
+	if (offset + header >= size) {
+		throw std::invalid_argument("Command header exceeds the message");
+	}
+
+	int length = (header == 1)? bytes[offset] : readRawInt(bytes + offset + 1);
+	if (length <= static_cast<int>(header) || static_cast<unsigned int>(length) > size - offset) {
+		throw std::invalid_argument("Command exceeds the message");
+	}
+
+	span.length = length;
+	span.code = bytes[offset + header];
+	return span;
+}
+
+tcpip::StatusResponse tcpip::readStatusResponse(const unsigned char *bytes,
+												 unsigned int offset, unsigned int size)
+	throw (std::invalid_argument)
+{
+	StatusResponse status;
+	status.span = readCommandSpan(bytes, offset, size);
+
+	// Code, result and description length follow the size
+	unsigned int pos = offset + commandSizeLength(bytes + offset) + 1;
+	unsigned int end = offset + status.span.length;
+	if (pos + 1 + 4 > end) {
+		throw std::invalid_argument("Status response too short");
+	}
+
+	status.result = bytes[pos];
+	status.descriptionLength = readRawInt(bytes + pos + 1);
+	status.descriptionOffset = pos + 1 + 4;
+
+	if (status.descriptionLength > end - status.descriptionOffset) {
+		throw std::invalid_argument("Status description exceeds the response");
+	}
+
+	return status;
+}
+
+unsigned int tcpip::typedValueLength(const unsigned char *bytes, unsigned int size)
+	throw (std::invalid_argument)
+{
+	if (size < 1) {
+		throw std::invalid_argument("Missing value type");
+	}
+
+	// Length of the value after the type, for fixed sizes
+	unsigned int length = 0;
+	unsigned int pos = 1;
+
+	switch (bytes[0]) {
+	case TYPE_UBYTE:
+	case TYPE_BYTE:
+		length = 1;
+		break;
+
+	case TYPE_INTEGER:
+	case TYPE_FLOAT:
+	case TYPE_COLOR:
+		length = 4;
+		break;
+
+	case TYPE_DOUBLE:
+		length = 8;
+		break;
+
+	case POSITION_2D:
+	case POSITION_LAT_LON:
+		length = 16;
+		break;
+
+	case POSITION_3D:
+	case POSITION_LAT_LON_ALT:
+		length = 24;
+		break;
+
+	case TYPE_BOUNDINGBOX:
+		length = 32;
+		break;
+
+	case TYPE_POLYGON:
+		if (size < 2) {
+			throw std::invalid_argument("Polygon value exceeds the message");
+		}
+		length = 1 + 16 * bytes[1];
+		break;
+
+	case TYPE_STRING:
+	case POSITION_ROADMAP:
+		if (size < 5) {
+			throw std::invalid_argument("String value exceeds the message");
+		}
+		length = 4 + readFittingLength(bytes + 1, size - 5, "String value exceeds the message");
+		if (bytes[0] == POSITION_ROADMAP) {
+			length += 8 + 1;
+		}
+		break;
+
+	case TYPE_STRINGLIST:
+		{
+			if (size < 5) {
+				throw std::invalid_argument("String list exceeds the message");
+			}
+			int count = readRawInt(bytes + 1);
+			if (count < 0) {
+				throw std::invalid_argument("String list with a negative count");
+			}
+			pos += 4;
+			for (int i=0; i < count; i++) {
+				if (pos + 4 > size) {
+					throw std::invalid_argument("String list exceeds the message");
+				}
+				pos += 4 + readFittingLength(bytes + pos, size - pos - 4,
+											 "String list exceeds the message");
+			}
+		}
+		break;
+
+	case TYPE_TLPHASELIST:
+		{
+			// Each phase: preceding edge, succeeding edge and phase
+			if (size < 2) {
+				throw std::invalid_argument("Phase list exceeds the message");
+			}
+			int count = bytes[1];
+			pos += 1;
+			for (int i=0; i < count; i++) {
+				for (int j=0; j < 2; j++) {
+					if (pos + 4 > size) {
+						throw std::invalid_argument("Phase list exceeds the message");
+					}
+					pos += 4 + readFittingLength(bytes + pos, size - pos - 4,
+												 "Phase list exceeds the message");
+				}
+				pos += 1;
+			}
+		}
+		break;
+
+	case TYPE_COMPOUND:
+		{
+			if (size < 5) {
+				throw std::invalid_argument("Compound value exceeds the message");
+			}
+			int count = readRawInt(bytes + 1);
+			if (count < 0) {
+				throw std::invalid_argument("Compound value with a negative count");
+			}
+			pos += 4;
+			for (int i=0; i < count; i++) {
+				if (pos >= size) {
+					throw std::invalid_argument("Compound value exceeds the message");
+				}
+				pos += typedValueLength(bytes + pos, size - pos);
+			}
+		}
+		break;
+
+	default:
+		throw std::invalid_argument("Unknown value type");
+	}
+
+	pos += length;
+	if (pos > size) {
+		throw std::invalid_argument("Value exceeds the message");
+	}
+	return pos;
+}
+
+void tcpip::splitCommands(const tcpip::Storage &message,
+						  std::vector<CommandSpan> &commands) throw (std::invalid_argument)
+{
+	commands.clear();
+	if (message.size() == 0) {
+		return;
+	}
+
+	const unsigned char *bytes = &*message.begin();
+	unsigned int size = static_cast<unsigned int>(message.size());
+
+	unsigned int offset = 0;
+	while (offset < size) {
+		commands.push_back(readCommandSpan(bytes, offset, size));
+		offset += commands.back().length;
+	}
+}
+
+void tcpip::splitAnswers(const tcpip::Storage &answers,
+						 const std::vector<CommandSpan> &commands,
+						 std::vector<CommandSpan> &spans) throw (std::invalid_argument)
+{
+	spans.clear();
+	if (commands.empty()) {
+		return;
+	}
+	if (answers.size() == 0) {
+		throw std::invalid_argument("Missing answers for the commands");
+	}
+
+	const unsigned char *bytes = &*answers.begin();
+	unsigned int size = static_cast<unsigned int>(answers.size());
+
+	unsigned int offset = 0;
+	std::vector<CommandSpan>::const_iterator it;
+	for (it=commands.begin(); it != commands.end(); it++) {
+		CommandSpan status = readCommandSpan(bytes, offset, size);
+		if (status.code != it->code) {
+			throw std::invalid_argument("Status response doesn't match the command");
+		}
+
+		// The result code follows the command code
+		unsigned int resultPos = offset + commandSizeLength(bytes + offset) + 1;
+		if (resultPos >= offset + status.length) {
+			throw std::invalid_argument("Status response without result code");
+		}
+		offset += status.length;
+
+		// Include the response command, when there is one
+		bool hasResponse = bytes[resultPos] == RTYPE_OK && hasResponseCommand(it->code);
+
+		// Removing a subscription (no variables) is only answered with the status
+		if (hasResponse && isSubscribeCommand(it->code)) {
+			hasResponse = offset < size
+				&& readCommandSpan(bytes, offset, size).code
+				   == it->code + RESPONSE_SUBSCRIBE_INDUCTIONLOOP_VARIABLE
+				      - CMD_SUBSCRIBE_INDUCTIONLOOP_VARIABLE;
+		}
+
+		if (hasResponse) {
+			CommandSpan response = readCommandSpan(bytes, offset, size);
+			status.length += response.length;
+			offset += response.length;
+		}
+
+		spans.push_back(status);
+	}
+}
+
+bool tcpip::hasResponseCommand(int cmdCode) throw()
+{
+	return cmdCode == CMD_GETVERSION || cmdCode == CMD_POSITIONCONVERSION
+		|| cmdCode == CMD_DISTANCEREQUEST || isGetCommand(cmdCode)
+		|| isSubscribeCommand(cmdCode);
+}
+
+bool tcpip::hasKnownAnswer(int cmdCode) throw()
+{
+	switch (cmdCode) {
+	case CMD_STOP:
+	case CMD_CHANGELANE:
+	case CMD_SLOWDOWN:
+	case CMD_CHANGETARGET:
+	case CMD_ADDVEHICLE:
+	case CMD_MOVENODE:
+	case CMD_REROUTE_TRAVELTIME:
+	case CMD_REROUTE_EFFORT:
+		return true;
+	}
+
+	return hasResponseCommand(cmdCode)
+		|| (cmdCode >= CMD_SET_TL_VARIABLE && cmdCode <= CMD_SET_GUI_VARIABLE);
+}
+
+bool tcpip::isGetCommand(int cmdCode) throw()
+{
+	return cmdCode >= CMD_GET_INDUCTIONLOOP_VARIABLE
+		&& cmdCode <= CMD_GET_GUI_VARIABLE;
+}
+
+bool tcpip::isSubscribeCommand(int cmdCode) throw()
+{
+	return cmdCode >= CMD_SUBSCRIBE_INDUCTIONLOOP_VARIABLE
+		&& cmdCode <= CMD_SUBSCRIBE_GUI_VARIABLE;
+}
+
+bool tcpip::changesState(int cmdCode) throw()
+{
+	// Only queries are answered with a response command
+	return !hasResponseCommand(cmdCode);
+}
+
+
+ProtocolException::ProtocolException(std::string what, std::string address,
+									 bool isClient) throw () :
+	myAddress(address),
 	myFromClient(isClient)
 {
 	std::ostringstream msg;
-	msg << myWhat << "(on " << (myFromClient? "client" : "SUMO")
-		<< " through port " << myPort;
+	msg << what << " (on " << (myFromClient? "client" : "SUMO")
+		<< " through " << myAddress << ")";
 	myWhat = msg.str();
 }
 
@@ -59,3 +376,32 @@ bool ProtocolException::isFromClient() const throw()
 {
 	return myFromClient;
 }
+
+
+namespace {
+
+	/// Serializes the lines written by Report
+	pthread_mutex_t reportLock = PTHREAD_MUTEX_INITIALIZER;
+
+}
+
+Report::Report(const std::string &prefix, std::ostream &out) :
+	myOut(out),
+	myLine()
+{
+	myLine << prefix;
+}
+
+Report::~Report()
+{
+	myLine << '\n';
+
+	pthread_mutex_lock(&reportLock);
+	myOut << myLine.str() << std::flush;
+	pthread_mutex_unlock(&reportLock);
+}
+
+std::ostream &Report::stream()
+{
+	return myLine;
+}
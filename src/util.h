@@ -1,6 +1,11 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include "tcpip/storage.h"
 
 namespace tcpip {
@@ -32,20 +37,177 @@ namespace tcpip {
 	void writeCommandSize(tcpip::Storage &outStorage, int size);
 
 
+	/// The bytes occupied by a command (or its answers) within a message
+	struct CommandSpan {
+		/// The command code
+		unsigned char code;
+
+		/// Position of the first byte (where the size starts)
+		unsigned int offset;
+
+		/// Number of bytes, INCLUDING the bytes used for the size
+		unsigned int length;
+	};
+
+	/** \brief Reads the command starting at the given offset of raw bytes.
+	 *
+	 * \param bytes The message bytes
+	 * \param offset Position where the command (its size) starts
+	 * \param size Number of bytes in the message
+	 *
+	 * \throw std::invalid_argument If the command exceeds the message
+	 */
+	CommandSpan readCommandSpan(const unsigned char *bytes, unsigned int offset,
+								unsigned int size) throw (std::invalid_argument);
+
+	/// A status response, located within a message
+	struct StatusResponse {
+		/// The bytes of the whole status (its code is the command answered)
+		CommandSpan span;
+
+		/// The result code (RTYPE_*)
+		unsigned char result;
+
+		/// Position of the first byte of the description
+		unsigned int descriptionOffset;
+
+		/// Number of bytes in the description
+		unsigned int descriptionLength;
+	};
+
+	/** \brief Reads the status response starting at the given offset of raw bytes.
+	 *
+	 * Nothing is copied: the description is only located.
+	 *
+	 * \param bytes The message bytes
+	 * \param offset Position where the status (its size) starts
+	 * \param size Number of bytes in the message
+	 *
+	 * \throw std::invalid_argument If the status is incomplete or exceeds the message
+	 */
+	StatusResponse readStatusResponse(const unsigned char *bytes, unsigned int offset,
+									  unsigned int size) throw (std::invalid_argument);
+
+	/// Number of bytes used by the size of the command starting at \p bytes
+	inline unsigned int commandSizeLength(const unsigned char *bytes)
+	{
+		return (bytes[0] == 0)? 5 : 1;
+	}
+
+	/** \brief Obtains the length of a typed value (type byte included).
+	 *
+	 * \param bytes The value, starting at its type
+	 * \param size Number of bytes available
+	 *
+	 * \throw std::invalid_argument If the type is unknown, a length or
+	 *     count is negative, or the value exceeds the available bytes
+	 */
+	unsigned int typedValueLength(const unsigned char *bytes, unsigned int size)
+		throw (std::invalid_argument);
+
+	/// Reads a big endian integer from raw bytes
+	inline int readRawInt(const unsigned char *bytes)
+	{
+		return static_cast<int>((static_cast<unsigned int>(bytes[0]) << 24)
+								| (static_cast<unsigned int>(bytes[1]) << 16)
+								| (static_cast<unsigned int>(bytes[2]) << 8)
+								| static_cast<unsigned int>(bytes[3]));
+	}
+
+	/** \brief Splits a message into commands.
+	 *
+	 * Reads the whole content of the message, regardless of its position.
+	 *
+	 * \param[in] message The message to split
+	 * \param[out] commands Receives one span for each command
+	 *
+	 * \throw std::invalid_argument If a command exceeds the message
+	 */
+	void splitCommands(const tcpip::Storage &message,
+					   std::vector<CommandSpan> &commands) throw (std::invalid_argument);
+
+	/** \brief Splits a message of answers according to the commands.
+	 *
+	 * Each command is answered by a status response, which is followed by
+	 * a response command when the status is OK and hasResponseCommand(int)
+	 * holds for the command. All commands must satisfy hasKnownAnswer(int).
+	 *
+	 * \param[in] answers The answers received for the commands
+	 * \param[in] commands The commands that were answered, in order
+	 * \param[out] spans Receives one span (status and response) per command
+	 *
+	 * \throw std::invalid_argument If the answers don't match the commands
+	 */
+	void splitAnswers(const tcpip::Storage &answers,
+					  const std::vector<CommandSpan> &commands,
+					  std::vector<CommandSpan> &spans) throw (std::invalid_argument);
+
+	/// Determines if the status response for a command is followed by a response command
+	bool hasResponseCommand(int cmdCode) throw();
+
+	/** \brief Determines if the hub knows how a command is answered.
+	 *
+	 * Either hasResponseCommand(int) holds for it or it's only answered
+	 * by the status (e.g. CMD_SET_*_VARIABLE). The answers to other commands
+	 * can't be told apart by splitAnswers(), they must be exchanged alone.
+	 */
+	bool hasKnownAnswer(int cmdCode) throw();
+
+	/// Determines if the command only queries values (CMD_GET_*_VARIABLE)
+	bool isGetCommand(int cmdCode) throw();
+
+	/// Determines if the command is a subscription (CMD_SUBSCRIBE_*_VARIABLE)
+	bool isSubscribeCommand(int cmdCode) throw();
+
+	/// Determines if the command may change the state of the simulation
+	bool changesState(int cmdCode) throw();
+
+
 }
 
 class ProtocolException: public std::exception {
 private:
 	std::string myWhat;
-	int myPort;
+	std::string myAddress;
 	bool myFromClient;
 
 public:
-	ProtocolException( std::string what, int port, bool FromClient=false ) throw ();
+	/// The address describes the connection (see tcpip::Socket::address())
+	ProtocolException( std::string what, std::string address, bool FromClient=false ) throw ();
 	~ProtocolException() throw();
 
 	virtual const char * what() const throw();
 	bool isFromClient() const throw();
 };
 
+/** \brief A line of output, written at once when destroyed.
+ *
+ * Lines written from several threads (e.g. by the hubs of an Ensemble)
+ * are never mixed. Each starts with a prefix telling who wrote it, and
+ * the end of line is added.
+ */
+class Report {
+public:
+	Report(const std::string &prefix, std::ostream &out=std::cout);
+	~Report();
+
+	template <typename T>
+	Report &operator<<(const T &value)
+	{
+		myLine << value;
+		return *this;
+	}
+
+	/// The stream where the line is composed
+	std::ostream &stream();
+
+private:
+	std::ostream &myOut;
+	std::ostringstream myLine;
+
+	// Not copyable (written once)
+	Report(const Report &);
+	Report &operator=(const Report &);
+};
+
 #endif